@@ -1,6 +1,9 @@
 #include "kernel_ken.h"
 #include "monitor.h"
+#include "vdata.h"
+#include "syscall.h"
 #include "error.h"
+#include "umalloc.h"
 
 /*  ##############################################################################
      __  __      ___ 
@@ -45,7 +48,7 @@ void print_dec(unsigned int n)
 */
 void *alloc(unsigned int size, unsigned char page_align)
 {
-    return NULL;
+    return umalloc(size, page_align);
 }
 
     // Allocates a contiguous region of memory 'size' in the user heap. If
@@ -54,7 +57,7 @@ void *alloc(unsigned int size, unsigned char page_align)
 
 void free(void *p)
 {
-    return;
+    ufree(p);
 }
 
     // Releases a block from the user heap allocated with 'alloc'.
@@ -110,7 +113,7 @@ int fork()
 
 void exit()
 {
-    return;
+    syscall_exit();
 }
 
     // Terminates the current process, cleaning up the resources allocated
@@ -140,10 +143,11 @@ int sleep(unsigned int secs)
 
 int getpid()
 {
-    return NULL;
+    return vdata_getpid();
 }
 
-    // Returns the pid of the current process.
+    // Returns the pid of the current process. Read from the shared kernel
+    // data page, so this never traps into the kernel.
 
 int setpriority(int pid, int new_priority)
 {
@@ -170,7 +174,7 @@ int setpriority(int pid, int new_priority)
 */
 int open_sem(int n)
 {
-    return NULL;
+    return syscall_sem_open(n);
 }
 
     // n is the number of processes that can be granted access to the critical
@@ -205,7 +209,7 @@ int signal(int s)
 
 int close_sem(int s)
 {
-    return NULL;
+    return syscall_sem_close(s);
 }
 
     // Close the semaphore s and release any associated resources. If s is invalid then
@@ -229,7 +233,7 @@ int close_sem(int s)
 #define INVALID_PIPE -1
 
 int open_pipe(){
-    return NULL;
+    return syscall_pipe_open();
 }
 
     // Initialize a new pipe and returns a descriptor. It returns INVALID_PIPE
@@ -258,7 +262,7 @@ unsigned int read(int fildes, void *buf, unsigned int nbyte)
     
 int close_pipe(int fildes)
 {
-    return NULL;
+    return syscall_pipe_close(fildes);
 }
 
     // Close the pipe specified by fildes. It returns INVALID_PIPE if the fildes
@@ -11,6 +11,12 @@ MBOOT_HEADER_MAGIC  equ 0x1BADB002 ; Multiboot Magic value
 MBOOT_HEADER_FLAGS  equ MBOOT_PAGE_ALIGN | MBOOT_MEM_INFO
 MBOOT_CHECKSUM      equ -(MBOOT_HEADER_MAGIC + MBOOT_HEADER_FLAGS)
 
+; The kernel is linked at KERNEL_VBASE + its load address (see link.ld).
+; Until paging is on every symbol has to be translated by hand.
+KERNEL_VBASE        equ 0xC0000000
+KERNEL_PDE          equ KERNEL_VBASE >> 22
+BOOT_STACK_SIZE     equ 0x4000
+
 
 [BITS 32]                       ; All instructions should be 32-bit.
 ALIGN 4
@@ -26,24 +32,64 @@ mboot:
     dd  MBOOT_HEADER_FLAGS      ; How GRUB should load your file / settings
     dd  MBOOT_CHECKSUM          ; To ensure that the above values are correct
     
-    dd  mboot                   ; Location of this descriptor
-    dd  code                    ; Start of kernel '.text' (code) section.
-    dd  bss                     ; End of kernel '.data' section.
-    dd  end                     ; End of kernel.
+    dd  mboot - KERNEL_VBASE    ; Location of this descriptor
+    dd  code - KERNEL_VBASE     ; Start of kernel '.text' (code) section.
+    dd  bss - KERNEL_VBASE      ; End of kernel '.data' section.
+    dd  end - KERNEL_VBASE      ; End of kernel.
     dd  start                   ; Kernel entry point (initial EIP).
 
 [GLOBAL start]                  ; Kernel entry point.
 [EXTERN kernel_main]                   ; This is the entry point of our C code
 
-start:
+; The bootloader jumps to the physical address of the entry point.
+start equ _start - KERNEL_VBASE
+
+_start:
+	; Map the first 4MB of physical memory both where we are now and at
+	; KERNEL_VBASE. initialise_paging() replaces this with the real kernel
+	; directory, which no longer has the low mapping.
+	mov edi, boot_page_table - KERNEL_VBASE
+	mov eax, 0x003              ; Present, writeable, frame 0.
+	mov ecx, 1024
+.fill:
+	mov [edi], eax
+	add eax, 0x1000
+	add edi, 4
+	loop .fill
+
+	mov eax, boot_page_table - KERNEL_VBASE + 0x003
+	mov [boot_page_directory - KERNEL_VBASE], eax
+	mov [boot_page_directory - KERNEL_VBASE + KERNEL_PDE*4], eax
+
+	mov eax, boot_page_directory - KERNEL_VBASE
+	mov cr3, eax
+	mov eax, cr0
+	or eax, 0x80000000          ; Enable paging.
+	mov cr0, eax
+
+	; Jump up to the linked address.
+	lea eax, [.higher_half]
+	jmp eax
+.higher_half:
 	; Set up stack pointer.
-	mov esp, 0x7FFFF
+	mov esp, boot_stack_top
 	push esp
-	push ebx ; Header pointer
+	add ebx, KERNEL_VBASE       ; Header pointer, as seen through the kernel mapping.
+	push ebx
 	; Disable interrupts
 	cli
 	; Call the C entry
 	extern	kernel_main
 	call	kernel_main
 	jmp		$
-	cli
\ No newline at end of file
+	cli
+
+[SECTION .bss align=4096]
+ALIGNB 4096
+boot_page_directory:
+	resb 4096
+boot_page_table:
+	resb 4096
+boot_stack:
+	resb BOOT_STACK_SIZE
+boot_stack_top:
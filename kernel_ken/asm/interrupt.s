@@ -3,14 +3,18 @@
 ;                Based on Bran's kernel development tutorials.
 ;                Rewritten for JamesM's kernel development tutorials.
 
+; Every vector gets its own stub, which pushes an error code (a dummy one
+; if the CPU does not) and the vector number, both as full dwords, so the
+; C side can index its handler table with int_no directly. The gates are
+; interrupt gates, so the CPU has already turned interrupts off.
+
 ; This macro creates a stub for an ISR which does NOT pass it's own
-; error code (adds a dummy errcode byte).
+; error code (adds a dummy errcode).
 %macro ISR_NOERRCODE 1
   global isr%1
   isr%1:
-    cli                         ; Disable interrupts firstly.
-    push byte 0                 ; Push a dummy error code.
-    push  %1                    ; Push the interrupt number.
+    push dword 0                ; Push a dummy error code.
+    push dword %1               ; Push the interrupt number.
     jmp isr_common_stub         ; Go to our common handler code.
 %endmacro
 
@@ -19,8 +23,7 @@
 %macro ISR_ERRCODE 1
   global isr%1
   isr%1:
-    cli                         ; Disable interrupts.
-    push %1                     ; Push the interrupt number
+    push dword %1               ; Push the interrupt number
     jmp isr_common_stub
 %endmacro
 
@@ -29,12 +32,49 @@
 %macro IRQ 2
   global irq%1
   irq%1:
-    cli
-    push byte 0
-    push %2
+    push dword 0
+    push dword %2
     jmp irq_common_stub
 %endmacro
-        
+
+; Offset of the saved CS from ESP once ENTER_FRAME has pushed DS:
+; DS, 8 registers, int_no, err_code and EIP come before it.
+%define FRAME_CS 48
+
+; Saves the processor state as a registers_t. The kernel data segments
+; only need loading when the interrupt came from user mode; in kernel
+; mode they are loaded already.
+%macro ENTER_FRAME 0
+    pusha                    ; Pushes edi,esi,ebp,esp,ebx,edx,ecx,eax
+
+    mov ax, ds               ; Lower 16-bits of eax = ds.
+    push eax                 ; save the data segment descriptor
+
+    test byte [esp+FRAME_CS], 3
+    jz %%kernel
+    mov ax, 0x10  ; load the kernel data segment descriptor
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+%%kernel:
+%endmacro
+
+; Restores what ENTER_FRAME saved and returns from the interrupt.
+%macro LEAVE_FRAME 0
+    test byte [esp+FRAME_CS], 3
+    pop ebx        ; reload the original data segment descriptor
+    jz %%kernel    ; (POP leaves the flags alone)
+    mov ds, bx
+    mov es, bx
+    mov fs, bx
+    mov gs, bx
+%%kernel:
+    popa                     ; Pops edi,esi,ebp...
+    add esp, 8     ; Cleans up the pushed error code and pushed ISR number
+    iret           ; pops 5 things at once: CS, EIP, EFLAGS, SS, and ESP
+%endmacro
+
 ISR_NOERRCODE 0
 ISR_NOERRCODE 1
 ISR_NOERRCODE 2
@@ -68,7 +108,6 @@ ISR_NOERRCODE 29
 ISR_NOERRCODE 30
 ISR_NOERRCODE 31
 ISR_NOERRCODE 128
-IRQ   0,    32
 IRQ   1,    33
 IRQ   2,    34
 IRQ   3,    35
@@ -87,65 +126,37 @@ IRQ  15,    47
 
 ; In isr.c
 extern isr_handler
+extern irq_handler
+extern irq_timer
+
+; The timer interrupts more often than anything else, so it has a stub of
+; its own that calls its handler directly, without the table lookup.
+global irq0
+irq0:
+    push dword 0
+    push dword 32
+    ENTER_FRAME
+    push esp                 ; registers_t *regs
+    call irq_timer
+    add esp, 4
+    LEAVE_FRAME
 
 ; This is our common ISR stub. It saves the processor state, sets
-; up for kernel mode segments, calls the C-level fault handler,
-; and finally restores the stack frame.
+; up for kernel mode segments, calls the C-level fault handler with a
+; pointer to the saved state, and finally restores the stack frame.
 isr_common_stub:
-    pusha                    ; Pushes edi,esi,ebp,esp,ebx,edx,ecx,eax
-
-    mov ax, ds               ; Lower 16-bits of eax = ds.
-    push eax                 ; save the data segment descriptor
-
-    mov ax, 0x10  ; load the kernel data segment descriptor
-    mov ds, ax
-    mov es, ax
-    mov fs, ax
-    mov gs, ax
-
+    ENTER_FRAME
+    push esp                 ; registers_t *regs
     call isr_handler
-
-    pop ebx        ; reload the original data segment descriptor
-    mov ds, bx
-    mov es, bx
-    mov fs, bx
-    mov gs, bx
-
-    popa                     ; Pops edi,esi,ebp...
-    add esp, 8     ; Cleans up the pushed error code and pushed ISR number
-    sti
-    iret           ; pops 5 things at once: CS, EIP, EFLAGS, SS, and ESP
-
-; In isr.c
-extern irq_handler
+    add esp, 4
+    LEAVE_FRAME
 
 ; This is our common IRQ stub. It saves the processor state, sets
-; up for kernel mode segments, calls the C-level fault handler,
-; and finally restores the stack frame.
+; up for kernel mode segments, calls the C-level IRQ handler with a
+; pointer to the saved state, and finally restores the stack frame.
 irq_common_stub:
-    pusha                    ; Pushes edi,esi,ebp,esp,ebx,edx,ecx,eax
-
-    mov ax, ds               ; Lower 16-bits of eax = ds.
-    push eax                 ; save the data segment descriptor
-
-    mov ax, 0x10  ; load the kernel data segment descriptor
-    mov ds, ax
-    mov es, ax
-    mov fs, ax
-    mov gs, ax
-
+    ENTER_FRAME
+    push esp                 ; registers_t *regs
     call irq_handler
-
-    pop ebx        ; reload the original data segment descriptor
-    mov ds, bx
-    mov es, bx
-    mov fs, bx
-    mov gs, bx
-
-    popa                     ; Pops edi,esi,ebp...
-    add esp, 8     ; Cleans up the pushed error code and pushed ISR number
-    sti
-    iret           ; pops 5 things at once: CS, EIP, EFLAGS, SS, and ESP
-
-
-        
+    add esp, 4
+    LEAVE_FRAME
@@ -1,49 +1,93 @@
-[GLOBAL read_eip]
-read_eip:
-    pop eax                     ; Get the return address
-    jmp eax                     ; Return. Can't use RET because return
-                                ; address popped off the stack. 
-
-[GLOBAL copy_page_physical]
-copy_page_physical:
-    push ebx              ; According to __cdecl, we must preserve the contents of EBX.
-    pushf                 ; push EFLAGS, so we can pop it and reenable interrupts
-                          ; later, if they were enabled anyway.
-    cli                   ; Disable interrupts, so we aren't interrupted.
-                          ; Load these in BEFORE we disable paging!
-    mov ebx, [esp+12]     ; Source address
-    mov ecx, [esp+16]     ; Destination address
-  
-    mov edx, cr0          ; Get the control register...
-    and edx, 0x7fffffff   ; and...
-    mov cr0, edx          ; Disable paging.
-  
-    mov edx, 1024         ; 1024*4bytes = 4096 bytes
-  
-.loop:
-    mov eax, [ebx]        ; Get the word at the source address
-    mov [ecx], eax        ; Store it at the dest address
-    add ebx, 4            ; Source address += sizeof(word)
-    add ecx, 4            ; Dest address += sizeof(word)
-    dec edx               ; One less word to do
-    jnz .loop             
-  
-    mov edx, cr0          ; Get the control register again
-    or  edx, 0x80000000   ; and...
-    mov cr0, edx          ; Enable paging.
-  
-    popf                  ; Pop EFLAGS back.
-    pop ebx               ; Get the original value of EBX back.
+; void switch_context(uint32_t *prev_esp, uint32_t next_esp, uint32_t next_cr3)
+; Saves the callee-saved registers and EFLAGS on the current stack, stores
+; the stack pointer in *prev_esp and resumes the task whose stack pointer is
+; next_esp. CR3 is only written if next_cr3 is non-zero, so switching between
+; tasks that share a page directory keeps the TLB. Even when it is written,
+; the kernel's global pages stay cached.
+[GLOBAL switch_context]
+switch_context:
+    mov eax, [esp+4]      ; prev_esp
+    mov edx, [esp+8]      ; next_esp
+    mov ecx, [esp+12]     ; next_cr3
+
+    push ebp              ; Everything __cdecl says a callee must preserve.
+    push ebx
+    push esi
+    push edi
+    pushf
+    mov [eax], esp        ; Save the outgoing task's stack pointer.
+
+    mov esp, edx          ; Take the incoming task's stack. Nothing touches it
+    test ecx, ecx         ; until CR3 has been switched as well.
+    jz .same_space
+    mov cr3, ecx
+.same_space:
+    popf
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    xor eax, eax          ; A task resumed from a fork_context frame sees 0.
+    ret
+
+; uint32_t fork_context(uint32_t *child_esp, void (*clone)(void*), void *arg)
+; Pushes the same frame switch_context does, stores its stack pointer in
+; *child_esp and calls clone(arg) while the frame is still on the stack, so
+; an address space cloned there contains it. Returns 1. When the child is
+; later resumed from *child_esp, it returns from here with 0.
+[GLOBAL fork_context]
+fork_context:
+    push ebp
+    push ebx
+    push esi
+    push edi
+    pushf
+    mov eax, [esp+24]     ; child_esp (5 pushes and the return address above it).
+    mov [eax], esp
+
+    push dword [esp+32]   ; arg
+    call dword [esp+32]   ; clone, now 4 bytes further up.
+    add esp, 4
+
+    popf
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    mov eax, 1
     ret
-    
-[GLOBAL perform_task_switch]
-perform_task_switch:
-     cli;
-     mov ecx, [esp+4]   ; EIP
-     mov eax, [esp+8]   ; physical address of current directory
-     mov ebp, [esp+12]  ; EBP
-     mov esp, [esp+16]  ; ESP
-     mov cr3, eax       ; set the page directory
-     mov eax, 0x12345   ; magic number to detect a task switch
-     sti;
-     jmp ecx
+
+; In task.c
+extern exit
+extern thread_user_exit
+
+; First code run by a task made by thread_create/thread_create_user. The
+; switch_context frame built for it leaves entry in EBX, arg in ESI and, for a
+; user thread, the top of its user stack in EDI.
+[GLOBAL thread_start]
+thread_start:
+    test edi, edi
+    jnz .user
+
+    sti                   ; Nobody is going to return through an iret for us.
+    push esi
+    call ebx              ; entry(arg)
+    call exit             ; Does not return.
+
+.user:
+    sub edi, 8            ; Make it look as if thread_user_exit called entry(arg).
+    mov [edi+4], esi
+    mov dword [edi], thread_user_exit
+
+    mov ax, 0x23          ; User data segment, with RPL 3.
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    push 0x23             ; SS
+    push edi              ; ESP
+    push 0x202            ; EFLAGS, IF set
+    push 0x1B             ; CS: user code segment, with RPL 3.
+    push ebx              ; EIP
+    iret
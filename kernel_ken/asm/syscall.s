@@ -0,0 +1,74 @@
+;
+; syscall.s -- System call entry and exit paths.
+;              The int 0x80 path goes through isr128 in interrupt.s; this file
+;              holds the SYSENTER/SYSEXIT fast path and the user-side stubs
+;              that the DEFN_SYSCALLn wrappers call through 'syscall_gate'.
+;
+; Calling convention for both user stubs:
+;   EAX = syscall number, EBX, ECX, EDX, ESI, EDI = arguments 1-5.
+;   The result comes back in EAX, every other register is preserved.
+
+[BITS 32]
+
+; In syscall.c
+extern syscall_dispatch
+
+KERNEL_VBASE        equ 0xC0000000  ; As in boot.s; user memory lies below it.
+
+; Kernel side of SYSENTER. The CPU has loaded CS/SS from IA32_SYSENTER_CS and
+; ESP from IA32_SYSENTER_ESP, which points at tss_entry.esp0, and interrupts
+; are off. Segments are flat, so the user data selectors can stay loaded.
+[GLOBAL sysenter_entry]
+sysenter_entry:
+    mov esp, [esp]          ; Switch to the current task's kernel stack.
+
+    ; EBP comes from user mode: the two words read through it must lie
+    ; below the kernel, or user code could have us read kernel memory.
+    cmp ebp, KERNEL_VBASE-12
+    ja .bad_stack
+
+    push ebp                ; The user stack pointer, needed by SYSEXIT.
+    push edi                ; Argument 5.
+    push esi                ; Argument 4.
+    push dword [ebp+4]      ; Argument 3: EDX, saved on the user stack by the stub.
+    push dword [ebp+8]      ; Argument 2: ECX, saved on the user stack by the stub.
+    push ebx                ; Argument 1.
+    push eax                ; Syscall number.
+    call syscall_dispatch   ; EBX, ESI, EDI and EBP are callee-saved.
+    cli                     ; It ran with interrupts on; not on the way out.
+    add esp, 24
+
+    pop ecx                 ; SYSEXIT takes the user ESP in ECX...
+    mov edx, sysenter_return ; ...and the user EIP in EDX.
+    sti                     ; STI only takes effect after SYSEXIT.
+    sysexit
+
+.bad_stack:
+    mov eax, -1             ; Fail the call without running it.
+    mov ecx, ebp
+    mov edx, sysenter_return
+    sti
+    sysexit
+
+; User side of SYSENTER. ECX and EDX are clobbered by SYSEXIT, so keep them on
+; the user stack where the kernel can also read them as arguments.
+[GLOBAL syscall_sysenter]
+syscall_sysenter:
+    push ecx
+    push edx
+    push ebp
+    mov ebp, esp            ; Tell the kernel where our stack is.
+    sysenter
+
+[GLOBAL sysenter_return]
+sysenter_return:
+    pop ebp
+    pop edx
+    pop ecx
+    ret
+
+; User side of the legacy path, used when the CPU has no SEP support.
+[GLOBAL syscall_int80]
+syscall_int80:
+    int 0x80
+    ret
@@ -0,0 +1,232 @@
+// host.c -- The Linux side of the host build: process entry, system
+//           calls, and stand-ins for the paging, tasking and panic
+//           functions the heap code calls in the kernel, and for the
+//           syscalls and shared data page the user heap uses.
+
+#include "host.h"
+#include "paging.h"
+#include "task.h"
+
+// i386 Linux system call numbers.
+#define SYS_EXIT_GROUP 252
+#define SYS_READ       3
+#define SYS_WRITE      4
+#define SYS_MMAP2      192
+
+#define PROT_READ      0x1
+#define PROT_WRITE     0x2
+#define MAP_PRIVATE    0x02
+#define MAP_ANONYMOUS  0x20
+#define MAP_NORESERVE  0x4000
+#define MAP_FIXED_NOREPLACE 0x100000
+
+// The sixth argument would go in ebp, the frame pointer. Nothing here
+// needs it other than as 0.
+static uint32_t host_syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+                             uint32_t a4, uint32_t a5)
+{
+    uint32_t ret;
+    asm volatile("push %%ebp\n\t"
+                 "xor %%ebp, %%ebp\n\t"
+                 "int $0x80\n\t"
+                 "pop %%ebp"
+                 : "=a" (ret)
+                 : "a" (num), "b" (a1), "c" (a2), "d" (a3), "S" (a4), "D" (a5)
+                 : "memory");
+    return ret;
+}
+
+asm(".globl _start\n"
+    "_start:\n\t"
+    "xor %ebp, %ebp\n\t"
+    "and $-16, %esp\n\t"
+    "call host_main\n\t"
+    "push %eax\n\t"
+    "call host_exit\n");
+
+void host_exit(int status)
+{
+    for (;;)
+        host_syscall(SYS_EXIT_GROUP, (uint32_t)status, 0, 0, 0, 0);
+}
+
+void host_write(const char *s)
+{
+    host_syscall(SYS_WRITE, 1, (uint32_t)s, strlen(s), 0, 0);
+}
+
+int host_read(void *buf, uint32_t len)
+{
+    return (int)host_syscall(SYS_READ, 0, (uint32_t)buf, len, 0, 0);
+}
+
+void host_write_dec64(uint64_t n)
+{
+    char buf[21];
+    int i = sizeof(buf) - 1;
+    buf[i] = '\0';
+    do
+    {
+        uint64_t q = udiv64_32(n, 10);
+        buf[--i] = '0' + (char)(n - q * 10);
+        n = q;
+    } while (n);
+    host_write(&buf[i]);
+}
+
+void host_write_dec(uint32_t n)
+{
+    host_write_dec64(n);
+}
+
+// Maps 'size' bytes at 'addr', which must be free, or anywhere if 'addr'
+// is 0.
+static void *map(uint32_t addr, uint32_t size)
+{
+    uint32_t flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    if (addr)
+        flags |= MAP_FIXED_NOREPLACE;
+    addr = host_syscall(SYS_MMAP2, addr, size, PROT_READ | PROT_WRITE, flags,
+                        (uint32_t)-1);
+    // Errors come back as -errno.
+    if (addr > (uint32_t)-4096)
+        return 0;
+    return (void*)addr;
+}
+
+void *host_map(uint32_t size)
+{
+    return map(0, size);
+}
+
+// The monitor, for anything that prints through it.
+void monitor_put(char c)
+{
+    char s[2] = { c, '\0' };
+    host_write(s);
+}
+
+void monitor_write(char *c)
+{
+    host_write(c);
+}
+
+void monitor_write_hex(uint32_t n)
+{
+    host_write("0x");
+    int i;
+    for (i = 28; i >= 0; i -= 4)
+        monitor_put("0123456789abcdef"[(n >> i) & 0xF]);
+}
+
+void monitor_write_dec(uint32_t n)
+{
+    host_write_dec(n);
+}
+
+// common.c is built with its panic functions renamed, since they stop
+// with cli, which is not allowed here. These exit instead.
+void panic(char *message, char *file, uint32_t line)
+{
+    host_write("PANIC(");
+    host_write(message);
+    host_write(") at ");
+    host_write(file);
+    host_write(":");
+    host_write_dec(line);
+    host_write("\n");
+    host_exit(2);
+}
+
+void panic_assert(char *file, uint32_t line, char *desc)
+{
+    host_write("ASSERTION-FAILED(");
+    host_write(desc);
+    host_write(") at ");
+    host_write(file);
+    host_write(":");
+    host_write_dec(line);
+    host_write("\n");
+    host_exit(2);
+}
+
+// Paging. Heaps are made in memory that is mapped from the start up to
+// their maximum, so growing and shrinking only has to be counted.
+page_directory_t *kernel_directory = 0;
+uint32_t host_pages_mapped = 0;
+uint32_t host_pages_unmapped = 0;
+
+page_t *map_kernel_page(uint32_t address, int is_kernel, int is_writeable)
+{
+    (void)address; (void)is_kernel; (void)is_writeable;
+    host_pages_mapped++;
+    return 0;
+}
+
+void unmap_kernel_page(uint32_t address)
+{
+    (void)address;
+    host_pages_unmapped++;
+}
+
+int is_large_page(uint32_t address, page_directory_t *dir)
+{
+    (void)address; (void)dir;
+    return 0;
+}
+
+uint32_t get_physical(uint32_t address, page_directory_t *dir)
+{
+    (void)dir;
+    return address;
+}
+
+// Tasking. There is only one thread.
+void preempt_disable()
+{
+}
+
+void preempt_enable()
+{
+}
+
+void preempt_point()
+{
+}
+
+// The user heap. Its break moves through an arena reserved on first use
+// where the kernel puts the heap, header first, and the "thread" on the
+// CPU is whichever host_pid says.
+#define HOST_ARENA_SIZE 0x4000000
+uint32_t host_sbrk_calls = 0;
+int host_pid = 1;
+static uint32_t arena = 0;
+static uint32_t arena_brk = 0;
+
+int syscall_sbrk(int increment)
+{
+    host_sbrk_calls++;
+    if (!arena)
+    {
+        arena = (uint32_t)map(USER_HEAP_START, HOST_ARENA_SIZE);
+        if (!arena)
+            return -1;
+        arena_brk = arena + USER_HEAP_HEADER;
+    }
+    uint32_t old = arena_brk;
+    uint32_t brk = old + increment;
+    if (brk < arena + USER_HEAP_HEADER || brk > arena + HOST_ARENA_SIZE)
+        return -1;
+    arena_brk = brk;
+    return (int)old;
+}
+
+int syscall_yield()
+{
+    return 0;
+}
+
+int vdata_getpid()
+{
+    return host_pid;
+}
@@ -0,0 +1,39 @@
+// host.h -- Defines what the host build of the kernel's heap, ordered
+//           array and string code needs from Linux. There is no libc:
+//           the kernel's own common.c provides the string functions, and
+//           the few system calls used are made directly with int 0x80.
+
+#ifndef HOST_H
+#define HOST_H
+
+#include "common.h"
+
+/**
+   Reads up to 'len' bytes of standard input. Returns the number read, 0
+   at the end, or a negative errno.
+**/
+int host_read(void *buf, uint32_t len);
+
+/**
+   Writes to standard output.
+**/
+void host_write(const char *s);
+void host_write_dec(uint32_t n);
+void host_write_dec64(uint64_t n);
+
+/**
+   Maps 'size' bytes of zeroed, writeable memory. Returns 0 on failure.
+**/
+void *host_map(uint32_t size);
+
+/**
+   Ends the process.
+**/
+void host_exit(int status);
+
+/**
+   The program itself. Its return value is the exit status.
+**/
+int host_main();
+
+#endif // HOST_H
@@ -0,0 +1,498 @@
+// hostbench.c -- Correctness tests and microbenchmarks for the kernel
+//                heap, the user heap, the ordered array and the string
+//                functions in common.c, built for and run on the host by
+//                `make hostbench`.
+
+#include "host.h"
+#include "kheap.h"
+#include "umalloc.h"
+#include "syscall.h"
+#include "ordered_array.h"
+
+extern uint32_t placement_address;
+extern uint32_t host_pages_mapped;
+extern uint32_t host_pages_unmapped;
+extern uint32_t host_sbrk_calls;
+extern int host_pid;
+
+// Threads the user heap tests pretend to be.
+#define UMALLOC_THREADS 4
+
+// Address space reserved for each test heap, and the part of it that is
+// "mapped" when the heap is made, as for the kernel heap.
+#define BENCH_HEAP_SPAN     0x4000000
+#define BENCH_HEAP_INITIAL  KHEAP_INITIAL_SIZE
+
+// Blocks alive at once in the churn workloads.
+#define CHURN_SLOTS 1024
+
+static int failures = 0;
+
+// Backing for the placement allocator create_heap() takes its heap_t from.
+static uint8_t placement_pool[0x10000];
+
+static uint32_t rng_state = 2463534242u;
+
+// xorshift32: fast, and the same sequence on every run.
+static uint32_t rng()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// A size between 'lo' and 'hi', evenly spread over powers of two, which
+// is closer to what the kernel asks for than a flat spread.
+static uint32_t rng_size(uint32_t lo, uint32_t hi)
+{
+    uint32_t size = lo << (rng() % 13);
+    size += rng() % size;
+    return size > hi ? hi : size;
+}
+
+static void check(int ok, const char *what)
+{
+    if (ok)
+        return;
+    host_write("FAIL: ");
+    host_write(what);
+    host_write("\n");
+    failures++;
+}
+
+static void report(const char *name, uint64_t cycles, uint32_t ops)
+{
+    host_write("  ");
+    host_write(name);
+    host_write(": ");
+    host_write_dec64(udiv64_32(cycles, ops));
+    host_write(" cycles/op\n");
+}
+
+static heap_t *make_heap()
+{
+    uint32_t start = (uint32_t)host_map(BENCH_HEAP_SPAN);
+    check(start != 0, "mmap heap");
+    if (!start)
+        host_exit(1);
+    // The heap wants page alignment, which mmap gives.
+    return create_heap(start, start + BENCH_HEAP_INITIAL, start + BENCH_HEAP_SPAN, 0, 0);
+}
+
+// Walks every block of 'heap' and checks the headers and footers agree,
+// that no two holes are neighbours, and that the index holds exactly the
+// holes, smallest first.
+static int heap_consistent(heap_t *heap, uint32_t *holes, uint32_t *free_bytes, uint32_t *largest)
+{
+    uint32_t addr = heap->start_address;
+    uint32_t nholes = 0, nfree = 0, big = 0;
+    int prev_hole = 0;
+    while (addr < heap->end_address)
+    {
+        header_t *header = (header_t*)addr;
+        if (header->magic != HEAP_MAGIC ||
+            header->size < sizeof(header_t) + sizeof(footer_t) ||
+            addr + header->size > heap->end_address)
+            return 0;
+        footer_t *footer = (footer_t*)(addr + header->size - sizeof(footer_t));
+        if (footer->magic != HEAP_MAGIC || footer->header != header)
+            return 0;
+        if (header->is_hole)
+        {
+            if (prev_hole)
+                return 0;
+            nholes++;
+            nfree += header->size;
+            if (header->size > big)
+                big = header->size;
+            uint32_t i;
+            for (i = 0; i < heap->index.size; i++)
+                if (lookup_ordered_array(i, &heap->index) == (type_t)header)
+                    break;
+            if (i == heap->index.size)
+                return 0;
+        }
+        prev_hole = header->is_hole;
+        addr += header->size;
+    }
+    if (addr != heap->end_address || nholes != heap->index.size)
+        return 0;
+
+    uint32_t i;
+    for (i = 1; i < heap->index.size; i++)
+    {
+        header_t *a = (header_t*)lookup_ordered_array(i - 1, &heap->index);
+        header_t *b = (header_t*)lookup_ordered_array(i, &heap->index);
+        if (a->size > b->size)
+            return 0;
+    }
+
+    if (holes) *holes = nholes;
+    if (free_bytes) *free_bytes = nfree;
+    if (largest) *largest = big;
+    return 1;
+}
+
+static int8_t less_than(type_t a, type_t b)
+{
+    return ((uint32_t)a < (uint32_t)b) ? 1 : 0;
+}
+
+static void test_ordered_array()
+{
+    static type_t storage[2048];
+    ordered_array_t array = place_ordered_array(storage, 2048, &less_than);
+
+    uint32_t i;
+    for (i = 0; i < 2000; i++)
+        insert_ordered_array((type_t)(rng() % 5000), &array);
+    check(array.size == 2000, "ordered array size after inserts");
+
+    for (i = 0; i < 1000; i++)
+        remove_ordered_array(rng() % array.size, &array);
+    check(array.size == 1000, "ordered array size after removes");
+
+    int sorted = 1;
+    for (i = 1; i < array.size; i++)
+        if ((uint32_t)lookup_ordered_array(i - 1, &array) > (uint32_t)lookup_ordered_array(i, &array))
+            sorted = 0;
+    check(sorted, "ordered array stays sorted");
+}
+
+// Plain byte-at-a-time versions to check the optimised ones against.
+static uint32_t ref_strlen(const char *s)
+{
+    uint32_t n = 0;
+    while (s[n])
+        n++;
+    return n;
+}
+
+static const char *ref_strstr(const char *h, const char *n)
+{
+    uint32_t nl = ref_strlen(n);
+    for (; *h; h++)
+    {
+        uint32_t i = 0;
+        while (i < nl && h[i] == n[i])
+            i++;
+        if (i == nl)
+            return h;
+    }
+    return nl ? 0 : h;
+}
+
+static void test_strings()
+{
+    static char a[512], c[512];
+    uint32_t round;
+    for (round = 0; round < 2000; round++)
+    {
+        uint32_t len = rng() % 300;
+        uint32_t off = rng() % 8;
+        uint32_t i;
+        // A small alphabet, so searches find partial matches.
+        for (i = 0; i < len; i++)
+            a[off + i] = 'a' + rng() % 3;
+        a[off + len] = '\0';
+
+        check(strlen(a + off) == len, "strlen");
+
+        uint32_t dst = rng() % 8;
+        memcpy(c + dst, a + off, len + 1);
+        check(memcmp(c + dst, a + off, len + 1) == 0, "memcpy/memcmp");
+        check(strcmp(c + dst, a + off) == 0, "strcmp");
+
+        // Overlapping moves, both ways.
+        memmove(c + dst + 3, c + dst, len + 1);
+        check(memcmp(c + dst + 3, a + off, len + 1) == 0, "memmove forwards");
+        memmove(c + dst, c + dst + 3, len + 1);
+        check(memcmp(c + dst, a + off, len + 1) == 0, "memmove backwards");
+
+        uint32_t nlen = rng() % 6;
+        char needle[8];
+        for (i = 0; i < nlen; i++)
+            needle[i] = 'a' + rng() % 3;
+        needle[nlen] = '\0';
+        check(strstr(a + off, needle) == ref_strstr(a + off, needle), "strstr");
+    }
+}
+
+static void test_heap()
+{
+    heap_t *heap = make_heap();
+    static uint8_t *blocks[CHURN_SLOTS];
+    static uint32_t sizes[CHURN_SLOTS];
+    memset(blocks, 0, sizeof(blocks));
+
+    uint32_t op;
+    int intact = 1, aligned = 1, consistent = 1;
+    for (op = 0; op < 50000; op++)
+    {
+        uint32_t slot = rng() % CHURN_SLOTS;
+        if (blocks[slot])
+        {
+            uint32_t i;
+            for (i = 0; i < sizes[slot]; i++)
+                if (blocks[slot][i] != (uint8_t)slot)
+                    intact = 0;
+            free(blocks[slot], heap);
+            blocks[slot] = 0;
+        }
+        else
+        {
+            uint8_t page_align = (rng() % 32) == 0;
+            sizes[slot] = rng_size(8, 16384);
+            blocks[slot] = alloc(sizes[slot], page_align, heap);
+            if (page_align && ((uint32_t)blocks[slot] & 0xFFF))
+                aligned = 0;
+            memset(blocks[slot], (uint8_t)slot, sizes[slot]);
+        }
+        if (op % 1000 == 0 && !heap_consistent(heap, 0, 0, 0))
+            consistent = 0;
+    }
+    check(intact, "heap blocks keep their contents");
+    check(aligned, "page aligned allocations");
+    check(consistent, "heap consistent during churn");
+
+    uint32_t i;
+    for (i = 0; i < CHURN_SLOTS; i++)
+        free(blocks[i], heap);
+    uint32_t holes;
+    check(heap_consistent(heap, &holes, 0, 0), "heap consistent after freeing all");
+    check(holes <= 1, "free space coalesces into one hole");
+}
+
+static void test_umalloc()
+{
+    static uint8_t *blocks[CHURN_SLOTS];
+    static uint32_t sizes[CHURN_SLOTS];
+    memset(blocks, 0, sizeof(blocks));
+    // Make the heap, header and all, as spawn() would have.
+    check(syscall_sbrk(0) != -1, "user heap at USER_HEAP_START");
+
+    uint32_t op;
+    int intact = 1, aligned = 1, allocated = 1;
+    for (op = 0; op < 50000; op++)
+    {
+        // Blocks are often freed by another thread than made them.
+        host_pid = 1 + rng() % UMALLOC_THREADS;
+        uint32_t slot = rng() % CHURN_SLOTS;
+        if (blocks[slot])
+        {
+            uint32_t i;
+            for (i = 0; i < sizes[slot]; i++)
+                if (blocks[slot][i] != (uint8_t)slot)
+                    intact = 0;
+            ufree(blocks[slot]);
+            blocks[slot] = 0;
+        }
+        else
+        {
+            int page_align = (rng() % 32) == 0;
+            sizes[slot] = rng_size(1, 16384);
+            blocks[slot] = umalloc(sizes[slot], page_align);
+            if (!blocks[slot])
+            {
+                allocated = 0;
+                continue;
+            }
+            if ((page_align && ((uint32_t)blocks[slot] & 0xFFF)) || ((uint32_t)blocks[slot] & 0xF))
+                aligned = 0;
+            memset(blocks[slot], (uint8_t)slot, sizes[slot]);
+        }
+    }
+    check(allocated, "umalloc never runs out");
+    check(intact, "umalloc blocks keep their contents");
+    check(aligned, "umalloc alignment");
+
+    uint32_t i;
+    for (i = 0; i < CHURN_SLOTS; i++)
+        ufree(blocks[i]);
+    for (host_pid = 1; host_pid <= UMALLOC_THREADS; host_pid++)
+        umalloc_thread_exit();
+    host_pid = 1;
+
+    // A cached size in a loop: no trips to the kernel at all.
+    ufree(umalloc(64, 0));
+    uint32_t calls = host_sbrk_calls;
+    for (i = 0; i < 10000; i++)
+        ufree(umalloc(64, 0));
+    check(host_sbrk_calls == calls, "umalloc of a cached size does not call sbrk");
+
+    // A big block freed at the top of the heap goes back to the kernel.
+    uint32_t before = (uint32_t)syscall_sbrk(0);
+    void *big = umalloc(UMALLOC_TRIM * 2, 0);
+    check(big != 0 && (uint32_t)syscall_sbrk(0) > before, "umalloc grows the heap");
+    ufree(big);
+    check((uint32_t)syscall_sbrk(0) <= before + UMALLOC_GROW, "umalloc gives memory back");
+}
+
+static void bench_heap()
+{
+    heap_t *heap = make_heap();
+    static void *blocks[CHURN_SLOTS];
+    memset(blocks, 0, sizeof(blocks));
+
+    uint32_t i;
+    uint64_t start = rdtsc();
+    for (i = 0; i < 100000; i++)
+        free(alloc(64, 0, heap), heap);
+    report("alloc+free 64 bytes, empty heap", rdtsc() - start, 100000);
+
+    // Keep half the slots full, then time a steady state of random churn.
+    for (i = 0; i < CHURN_SLOTS; i += 2)
+        blocks[i] = alloc(rng_size(16, 8192), 0, heap);
+    start = rdtsc();
+    for (i = 0; i < 100000; i++)
+    {
+        uint32_t slot = rng() % CHURN_SLOTS;
+        if (blocks[slot])
+        {
+            free(blocks[slot], heap);
+            blocks[slot] = 0;
+        }
+        else
+        {
+            blocks[slot] = alloc(rng_size(16, 8192), 0, heap);
+        }
+    }
+    report("random churn, 16..8192 bytes", rdtsc() - start, 100000);
+
+    start = rdtsc();
+    for (i = 0; i < 10000; i++)
+        free(alloc(100, 1, heap), heap);
+    report("page aligned alloc+free", rdtsc() - start, 10000);
+
+    uint32_t holes, free_bytes, largest;
+    heap_consistent(heap, &holes, &free_bytes, &largest);
+    uint32_t live = 0;
+    for (i = 0; i < CHURN_SLOTS; i++)
+        if (blocks[i])
+            live += ((header_t*)((uint32_t)blocks[i] - sizeof(header_t)))->size;
+    host_write("  fragmentation after churn: ");
+    host_write_dec(heap->end_address - heap->start_address);
+    host_write(" byte heap, ");
+    host_write_dec(live);
+    host_write(" in use, ");
+    host_write_dec(holes);
+    host_write(" holes, ");
+    host_write_dec(free_bytes);
+    host_write(" free, largest hole ");
+    host_write_dec(largest);
+    host_write(" (");
+    host_write_dec(free_bytes ? 100 - (uint32_t)udiv64_32((uint64_t)largest * 100, free_bytes) : 0);
+    host_write("% fragmented)\n");
+    host_write("  pages mapped/unmapped: ");
+    host_write_dec(host_pages_mapped);
+    host_write("/");
+    host_write_dec(host_pages_unmapped);
+    host_write("\n");
+}
+
+static void bench_umalloc()
+{
+    static void *blocks[CHURN_SLOTS];
+    memset(blocks, 0, sizeof(blocks));
+    host_pid = 1;
+    uint32_t calls = host_sbrk_calls;
+
+    uint32_t i;
+    uint64_t start = rdtsc();
+    for (i = 0; i < 100000; i++)
+        ufree(umalloc(64, 0));
+    report("umalloc+ufree 64 bytes", rdtsc() - start, 100000);
+
+    for (i = 0; i < CHURN_SLOTS; i += 2)
+        blocks[i] = umalloc(rng_size(16, 8192), 0);
+    start = rdtsc();
+    for (i = 0; i < 100000; i++)
+    {
+        uint32_t slot = rng() % CHURN_SLOTS;
+        if (blocks[slot])
+        {
+            ufree(blocks[slot]);
+            blocks[slot] = 0;
+        }
+        else
+        {
+            blocks[slot] = umalloc(rng_size(16, 8192), 0);
+        }
+    }
+    report("umalloc random churn, 16..8192 bytes", rdtsc() - start, 100000);
+
+    start = rdtsc();
+    for (i = 0; i < 10000; i++)
+        ufree(umalloc(100, 1));
+    report("umalloc page aligned", rdtsc() - start, 10000);
+
+    for (i = 0; i < CHURN_SLOTS; i++)
+        ufree(blocks[i]);
+    host_write("  umalloc sbrk calls: ");
+    host_write_dec(host_sbrk_calls - calls);
+    host_write(" in 210000 operations\n");
+}
+
+static void bench_strings()
+{
+    static char src[8192], dst[8192];
+    uint32_t i;
+    for (i = 0; i < sizeof(src) - 1; i++)
+        src[i] = 'a' + i % 26;
+    src[sizeof(src) - 1] = '\0';
+
+    uint64_t start = rdtsc();
+    for (i = 0; i < 100000; i++)
+        memcpy(dst, src, 64);
+    report("memcpy 64 bytes", rdtsc() - start, 100000);
+
+    start = rdtsc();
+    for (i = 0; i < 10000; i++)
+        memcpy(dst, src, 4096);
+    report("memcpy 4096 bytes", rdtsc() - start, 10000);
+
+    start = rdtsc();
+    for (i = 0; i < 10000; i++)
+        memmove(dst + 1, dst, 4096);
+    report("memmove 4096 bytes, overlapping", rdtsc() - start, 10000);
+
+    start = rdtsc();
+    for (i = 0; i < 10000; i++)
+        memset(dst, i, 4096);
+    report("memset 4096 bytes", rdtsc() - start, 10000);
+
+    uint32_t total = 0;
+    start = rdtsc();
+    for (i = 0; i < 10000; i++)
+        total += strlen(src + (i & 7));
+    report("strlen ~8K", rdtsc() - start, 10000);
+
+    // A needle found only at the very end.
+    src[4000] = '\0';
+    memcpy(src + 3990, "0123456789", 10);
+    start = rdtsc();
+    for (i = 0; i < 10000; i++)
+        total += (uint32_t)strstr(src, "0123456789");
+    report("strstr 4K haystack, 10 byte needle", rdtsc() - start, 10000);
+    // Keep the loops from being thrown away.
+    check(total != 0, "string benchmarks ran");
+}
+
+int host_main()
+{
+    placement_address = (uint32_t)placement_pool;
+
+    host_write("tests\n");
+    test_ordered_array();
+    test_strings();
+    test_heap();
+    test_umalloc();
+    host_write(failures ? "  some tests FAILED\n" : "  all passed\n");
+
+    host_write("benchmarks\n");
+    bench_heap();
+    bench_umalloc();
+    bench_strings();
+    return failures ? 1 : 0;
+}
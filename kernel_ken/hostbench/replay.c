@@ -0,0 +1,513 @@
+// replay.c -- Replays a kernel heap trace (see kheap_trace_dump()) through
+//             the real kheap code and through simpler allocation policies,
+//             and compares their footprint, fragmentation and speed.
+//
+//             make replay TRACE=serial.log
+
+#include "host.h"
+#include "kheap.h"
+
+extern uint32_t placement_address;
+
+// Most operations, and most distinct blocks, a trace may hold.
+#define REPLAY_MAX_OPS  (1 << 17)
+#define REPLAY_HASH     (1 << 18)
+// Most input read.
+#define REPLAY_MAX_LOG  0x4000000
+// Address space for the kheap under test.
+#define REPLAY_HEAP_SPAN 0x8000000
+
+#define NO_BLOCK 0xFFFFFFFF
+
+// Per-block overhead of the kheap, charged by the simulated policies too
+// so they are compared on placement alone.
+#define BLOCK_OVERHEAD (sizeof(header_t) + sizeof(footer_t))
+
+typedef struct
+{
+    uint8_t op;        // KHEAP_TRACE_ALLOC or KHEAP_TRACE_FREE.
+    uint8_t align;
+    uint32_t size;
+    uint32_t block;    // Which allocation the op is about.
+} op_t;
+
+static op_t ops[REPLAY_MAX_OPS];
+static uint32_t nops = 0;
+static uint32_t nblocks = 0;
+static uint32_t unmatched = 0;
+
+// Trace pointer -> block, for pairing frees with their allocations.
+static uint32_t hash_ptr[REPLAY_HASH];
+static uint32_t hash_block[REPLAY_HASH];
+
+static uint32_t *hash_slot(uint32_t ptr)
+{
+    uint32_t i = (ptr * 2654435761u) & (REPLAY_HASH - 1);
+    while (hash_ptr[i] && hash_ptr[i] != ptr)
+        i = (i + 1) & (REPLAY_HASH - 1);
+    hash_ptr[i] = ptr;
+    return &hash_block[i];
+}
+
+static void fail(const char *why)
+{
+    host_write("replay: ");
+    host_write(why);
+    host_write("\n");
+    host_exit(1);
+}
+
+static const char *parse_num(const char *p, uint32_t *out)
+{
+    uint32_t n = 0;
+    while (*p == ' ')
+        p++;
+    if (p[0] == '0' && p[1] == 'x')
+    {
+        for (p += 2; ; p++)
+        {
+            if (*p >= '0' && *p <= '9')
+                n = n * 16 + (*p - '0');
+            else if (*p >= 'a' && *p <= 'f')
+                n = n * 16 + (*p - 'a' + 10);
+            else
+                break;
+        }
+    }
+    else
+    {
+        for (; *p >= '0' && *p <= '9'; p++)
+            n = n * 10 + (*p - '0');
+    }
+    *out = n;
+    return p;
+}
+
+// Turns the "H a"/"H f" lines of a serial log into ops. Anything else in
+// the log is skipped.
+static void parse(char *log)
+{
+    memset(hash_block, 0xFF, sizeof(hash_block));
+    char *line = log;
+    while (*line)
+    {
+        char *next = strchrnul(line, '\n');
+        if (*next)
+            *next++ = '\0';
+
+        if (line[0] == 'H' && line[1] == ' ' && (line[2] == 'a' || line[2] == 'f'))
+        {
+            uint32_t dt, ptr, size = 0, align = 0;
+            const char *p = parse_num(line + 3, &dt);
+            p = parse_num(p, &ptr);
+            uint32_t *block = hash_slot(ptr);
+            if (nops == REPLAY_MAX_OPS)
+                fail("trace too long");
+            op_t *op = &ops[nops];
+            if (line[2] == 'a')
+            {
+                p = parse_num(p, &size);
+                parse_num(p, &align);
+                op->op = KHEAP_TRACE_ALLOC;
+                op->size = size;
+                op->align = align ? 1 : 0;
+                op->block = *block = nblocks++;
+                nops++;
+            }
+            else if (*block != NO_BLOCK)
+            {
+                op->op = KHEAP_TRACE_FREE;
+                op->block = *block;
+                *block = NO_BLOCK;
+                nops++;
+            }
+            else
+            {
+                // Allocated before the trace began, or in a dropped record.
+                unmatched++;
+            }
+        }
+        line = next;
+    }
+}
+
+/**
+   What a policy's address space looks like.
+**/
+typedef struct
+{
+    uint32_t footprint;    // Bytes from the start of the heap to its end.
+    uint32_t holes;
+    uint32_t free_bytes;
+    uint32_t largest;      // Largest hole.
+} layout_t;
+
+typedef struct
+{
+    const char *name;
+    void (*init)();
+    uint32_t (*alloc)(uint32_t block, uint32_t size, uint8_t align);
+    void (*free)(uint32_t block);
+    uint32_t (*footprint)();
+    void (*layout)(layout_t *out);
+} policy_t;
+
+static uint32_t block_addr[REPLAY_MAX_OPS];
+static uint32_t block_size[REPLAY_MAX_OPS];
+
+// The kheap itself: best fit from a size-ordered index, with boundary tags.
+
+static heap_t *heap;
+static uint8_t placement_pool[0x1000];
+
+static void kheap_init()
+{
+    placement_address = (uint32_t)placement_pool;
+    uint32_t start = (uint32_t)host_map(REPLAY_HEAP_SPAN);
+    if (!start)
+        fail("cannot map heap");
+    heap = create_heap(start, start + KHEAP_INITIAL_SIZE, start + REPLAY_HEAP_SPAN, 0, 0);
+}
+
+static uint32_t kheap_alloc(uint32_t block, uint32_t size, uint8_t align)
+{
+    return block_addr[block] = (uint32_t)alloc(size, align, heap);
+}
+
+static void kheap_free(uint32_t block)
+{
+    free((void*)block_addr[block], heap);
+}
+
+static uint32_t kheap_footprint()
+{
+    return heap->end_address - heap->start_address;
+}
+
+static void kheap_layout(layout_t *out)
+{
+    out->footprint = kheap_footprint();
+    out->holes = heap->index.size;
+    out->free_bytes = 0;
+    out->largest = 0;
+    uint32_t i;
+    for (i = 0; i < heap->index.size; i++)
+    {
+        header_t *hole = (header_t*)lookup_ordered_array(i, &heap->index);
+        out->free_bytes += hole->size;
+        if (hole->size > out->largest)
+            out->largest = hole->size;
+    }
+}
+
+// A simulated address space with an address-ordered list of holes, for
+// first fit. Nothing is stored at the addresses; only the layout is kept.
+
+static uint32_t seg_addr[REPLAY_MAX_OPS];
+static uint32_t seg_size[REPLAY_MAX_OPS];
+static uint32_t nsegs;
+static uint32_t top;
+
+static void seg_insert(uint32_t i, uint32_t addr, uint32_t size)
+{
+    memmove(&seg_addr[i + 1], &seg_addr[i], (nsegs - i) * sizeof(uint32_t));
+    memmove(&seg_size[i + 1], &seg_size[i], (nsegs - i) * sizeof(uint32_t));
+    seg_addr[i] = addr;
+    seg_size[i] = size;
+    nsegs++;
+}
+
+static void seg_remove(uint32_t i)
+{
+    nsegs--;
+    memmove(&seg_addr[i], &seg_addr[i + 1], (nsegs - i) * sizeof(uint32_t));
+    memmove(&seg_size[i], &seg_size[i + 1], (nsegs - i) * sizeof(uint32_t));
+}
+
+// Returns a hole to the list, merging it with its neighbours, and gives
+// back whole pages at the top, as the kheap contracts.
+static void ff_give(uint32_t addr, uint32_t size)
+{
+    uint32_t i = 0;
+    while (i < nsegs && seg_addr[i] < addr)
+        i++;
+    if (i < nsegs && addr + size == seg_addr[i])
+    {
+        seg_addr[i] = addr;
+        seg_size[i] += size;
+    }
+    else
+    {
+        seg_insert(i, addr, size);
+    }
+    if (i > 0 && seg_addr[i - 1] + seg_size[i - 1] == seg_addr[i])
+    {
+        seg_size[i - 1] += seg_size[i];
+        seg_remove(i);
+        i--;
+    }
+
+    uint32_t keep = ((seg_addr[i] + BLOCK_OVERHEAD + PAGE_SZ - 1) & ~(PAGE_SZ - 1)) - seg_addr[i];
+    if (seg_addr[i] + seg_size[i] == top && seg_size[i] > keep)
+    {
+        top = seg_addr[i] + keep;
+        seg_size[i] = keep;
+    }
+}
+
+// Takes 'size' bytes from the first hole they fit in, such that 'offset'
+// bytes into them is page aligned if 'align' is set. A gap left in front
+// stays a hole; a tail too small to be a hole is handed out too, and
+// 'size' is updated to include it.
+static uint32_t ff_take(uint32_t *size, uint8_t align, uint32_t offset)
+{
+    for (;;)
+    {
+        uint32_t i;
+        for (i = 0; i < nsegs; i++)
+        {
+            uint32_t front = 0;
+            if (align)
+            {
+                uint32_t data = seg_addr[i] + offset;
+                front = ((data + PAGE_SZ - 1) & ~(PAGE_SZ - 1)) - data;
+                if (front && front < BLOCK_OVERHEAD)
+                    front += PAGE_SZ;
+            }
+            if (seg_size[i] < front + *size)
+                continue;
+
+            uint32_t addr = seg_addr[i] + front;
+            uint32_t back = seg_size[i] - front - *size;
+            if (back < BLOCK_OVERHEAD)
+            {
+                *size += back;
+                back = 0;
+            }
+            if (front)
+                seg_size[i] = front;
+            else
+                seg_remove(i--);
+            if (back)
+                seg_insert(i + 1, addr + *size, back);
+            return addr;
+        }
+
+        // Nothing fits: grow, the new space joining any hole at the top.
+        uint32_t grow = (*size + PAGE_SZ + BLOCK_OVERHEAD + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+        if (nsegs && seg_addr[nsegs - 1] + seg_size[nsegs - 1] == top)
+            seg_size[nsegs - 1] += grow;
+        else
+            seg_insert(nsegs, top, grow);
+        top += grow;
+    }
+}
+
+static void ff_init()
+{
+    nsegs = 0;
+    top = 0;
+}
+
+static uint32_t ff_alloc(uint32_t block, uint32_t size, uint8_t align)
+{
+    uint32_t bytes = (size + BLOCK_OVERHEAD + 3) & ~3;
+    block_addr[block] = ff_take(&bytes, align, sizeof(header_t));
+    block_size[block] = bytes;
+    return block_addr[block];
+}
+
+static void ff_free(uint32_t block)
+{
+    ff_give(block_addr[block], block_size[block]);
+}
+
+static uint32_t ff_footprint()
+{
+    return top;
+}
+
+static void ff_layout(layout_t *out)
+{
+    out->footprint = top;
+    out->holes = nsegs;
+    out->free_bytes = 0;
+    out->largest = 0;
+    uint32_t i;
+    for (i = 0; i < nsegs; i++)
+    {
+        out->free_bytes += seg_size[i];
+        if (seg_size[i] > out->largest)
+            out->largest = seg_size[i];
+    }
+}
+
+// Size classes: power-of-two slots from 16 to 2048 bytes, carved from
+// pages taken from the first-fit space and never given back. Larger or
+// page-aligned blocks go to the first-fit space directly.
+
+#define CLASS_MIN_SHIFT 4
+#define CLASS_MAX_SHIFT 11
+#define NCLASSES (CLASS_MAX_SHIFT - CLASS_MIN_SHIFT + 1)
+#define LARGE_CLASS 0xFF
+
+static uint32_t *class_free[NCLASSES];
+static uint32_t class_nfree[NCLASSES];
+static uint8_t block_class[REPLAY_MAX_OPS];
+
+static int size_class(uint32_t size)
+{
+    int c = 0;
+    while ((1u << (c + CLASS_MIN_SHIFT)) < size)
+        c++;
+    return c;
+}
+
+static void sc_init()
+{
+    ff_init();
+    int c;
+    for (c = 0; c < NCLASSES; c++)
+    {
+        // Free slot stacks, big enough for every block in the trace.
+        if (!class_free[c])
+            class_free[c] = (uint32_t*)host_map(REPLAY_MAX_OPS * sizeof(uint32_t));
+        class_nfree[c] = 0;
+    }
+}
+
+static uint32_t sc_alloc(uint32_t block, uint32_t size, uint8_t align)
+{
+    if (align || size > (1u << CLASS_MAX_SHIFT))
+    {
+        block_class[block] = LARGE_CLASS;
+        return ff_alloc(block, size, align);
+    }
+
+    int c = size_class(size);
+    uint32_t slot = 1u << (c + CLASS_MIN_SHIFT);
+    if (!class_nfree[c])
+    {
+        uint32_t page = PAGE_SZ;
+        uint32_t addr = ff_take(&page, 1, 0);
+        uint32_t i;
+        for (i = page / slot; i > 0; i--)
+            class_free[c][class_nfree[c]++] = addr + (i - 1) * slot;
+    }
+    block_class[block] = c;
+    return block_addr[block] = class_free[c][--class_nfree[c]];
+}
+
+static void sc_free(uint32_t block)
+{
+    int c = block_class[block];
+    if (c == LARGE_CLASS)
+        ff_free(block);
+    else
+        class_free[c][class_nfree[c]++] = block_addr[block];
+}
+
+static void sc_layout(layout_t *out)
+{
+    ff_layout(out);
+    int c;
+    for (c = 0; c < NCLASSES; c++)
+    {
+        uint32_t slot = 1u << (c + CLASS_MIN_SHIFT);
+        out->holes += class_nfree[c];
+        out->free_bytes += class_nfree[c] * slot;
+        if (class_nfree[c] && slot > out->largest)
+            out->largest = slot;
+    }
+}
+
+static const policy_t policies[] =
+{
+    { "kheap best fit", kheap_init, kheap_alloc, kheap_free, kheap_footprint, kheap_layout },
+    { "first fit",      ff_init,    ff_alloc,    ff_free,    ff_footprint,    ff_layout },
+    { "size classes",   sc_init,    sc_alloc,    sc_free,    ff_footprint,    sc_layout },
+};
+
+static void column(uint32_t n)
+{
+    host_write(" ");
+    host_write_dec(n);
+}
+
+static void replay(const policy_t *policy)
+{
+    static uint32_t live_size[REPLAY_MAX_OPS];
+    uint32_t live = 0, peak = 0, nalloc = 0, nfree = 0;
+    uint64_t alloc_cycles = 0, free_cycles = 0;
+
+    policy->init();
+    uint32_t i;
+    for (i = 0; i < nops; i++)
+    {
+        op_t *op = &ops[i];
+        uint64_t start = rdtsc();
+        if (op->op == KHEAP_TRACE_ALLOC)
+        {
+            policy->alloc(op->block, op->size, op->align);
+            alloc_cycles += rdtsc() - start;
+            nalloc++;
+            live_size[op->block] = op->size;
+            live += op->size;
+            uint32_t footprint = policy->footprint();
+            if (footprint > peak)
+                peak = footprint;
+        }
+        else
+        {
+            policy->free(op->block);
+            free_cycles += rdtsc() - start;
+            nfree++;
+            live -= live_size[op->block];
+        }
+    }
+
+    layout_t l;
+    policy->layout(&l);
+    host_write(policy->name);
+    host_write(":");
+    column(peak);
+    column(l.footprint);
+    column(live);
+    column(l.holes);
+    column(l.free_bytes);
+    column(l.largest);
+    column(l.free_bytes ? 100 - (uint32_t)udiv64_32((uint64_t)l.largest * 100, l.free_bytes) : 0);
+    column(nalloc ? (uint32_t)udiv64_32(alloc_cycles, nalloc) : 0);
+    column(nfree ? (uint32_t)udiv64_32(free_cycles, nfree) : 0);
+    host_write("\n");
+}
+
+int host_main()
+{
+    char *log = (char*)host_map(REPLAY_MAX_LOG);
+    if (!log)
+        fail("cannot map log buffer");
+    uint32_t len = 0;
+    int n;
+    while ((n = host_read(log + len, REPLAY_MAX_LOG - 1 - len)) > 0)
+        len += n;
+    log[len] = '\0';
+
+    parse(log);
+    host_write("replay: ");
+    host_write_dec(nops);
+    host_write(" ops on ");
+    host_write_dec(nblocks);
+    host_write(" blocks, ");
+    host_write_dec(unmatched);
+    host_write(" frees of blocks from before the trace skipped\n");
+    if (!nops)
+        fail("no \"H a\"/\"H f\" records in the input");
+
+    host_write("policy: peak_footprint end_footprint live_bytes holes free_bytes "
+               "largest_hole fragmentation_% alloc_cycles free_cycles\n");
+    uint32_t i;
+    for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+        replay(&policies[i]);
+    return 0;
+}
@@ -0,0 +1,40 @@
+// bench.h -- Defines the boot-time benchmark suite. Booted with "bench"
+//            on the command line, the kernel runs it instead of its usual
+//            start-up, reports to the serial port and powers off; see
+//            tools/bench.py, which drives it for `make bench`.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "common.h"
+
+// Port of QEMU's isa-debug-exit device. QEMU exits with status
+// (value << 1) | 1 when a value is written there.
+#define BENCH_EXIT_PORT 0xF4
+
+// Times each benchmark is repeated; the fastest repetition is reported.
+#define BENCH_REPEAT 5
+
+// Room for a benchmark name reported from user mode, its 0 included.
+#define BENCH_NAME_MAX 32
+
+/**
+   Nonzero if the command line asks for the benchmarks.
+**/
+int bench_wanted(const char *cmdline);
+
+/**
+   Runs every benchmark, writing one "BENCH <name> <value> <unit>" line
+   per result between "bench: begin" and "bench: end", then exits QEMU.
+   Needs tasking and the workqueues up. Does not return.
+**/
+void bench_run();
+
+/**
+   System call for benchmarks running in user mode, which cannot reach the
+   serial port: reports 'cycles' per iteration under 'name', a string in
+   the caller's memory. Returns 0, or -1 for a bad name.
+**/
+int bench_report(char *name, uint32_t cycles);
+
+#endif // BENCH_H
@@ -0,0 +1,77 @@
+// clock.h -- Defines the interface for the monotonic clock. Time is kept
+//            as 64-bit nanoseconds since boot, read from a free-running
+//            counter: the TSC once it has been calibrated against the PIT,
+//            or the PIT itself if that fails.
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include "common.h"
+
+// Clock ids for clock_gettime(). Only the monotonic clock exists; there is
+// no RTC driver to give the wall time.
+#define CLOCK_MONOTONIC 1
+
+// Fixed-point shifts for each source's mult. The PIT's 838ns per count
+// needs a smaller one to fit in 32 bits.
+#define CLOCK_TSC_SHIFT 24
+#define CLOCK_PIT_SHIFT 20
+
+// The TSC is measured over this many PIT channel 2 counts (about 10ms),
+// this many times over, and the median kept.
+#define CLOCK_CALIBRATE_COUNTS 11932
+#define CLOCK_CALIBRATE_RUNS 3
+
+/**
+   A counter the clock can be read from. Nanoseconds are
+   (count * mult) >> shift.
+**/
+typedef struct
+{
+    const char *name;
+    uint64_t (*read)();
+    uint32_t mult;
+    uint32_t shift;
+    uint32_t khz;         // Counter rate, for reporting.
+} clocksource_t;
+
+/**
+   What clock_gettime() fills in.
+**/
+typedef struct
+{
+    uint32_t tv_sec;
+    uint32_t tv_nsec;
+} timespec_t;
+
+/**
+   Picks and calibrates the source. Call with the PIT's channel 2 free,
+   before init_timer() so nothing interrupts the measurement.
+**/
+void init_clock();
+
+/**
+   Moves the clock's base up to now, so that readers only ever convert a
+   short stretch of counter. Called from the timer interrupt.
+**/
+void clock_tick();
+
+/**
+   Nanoseconds since boot. Never goes backwards.
+**/
+uint64_t clock_ns();
+
+/**
+   The source in use, and the counter value and time of the last
+   clock_tick(), for vdata to publish.
+**/
+const clocksource_t *clock_source();
+void clock_base(uint64_t *count, uint64_t *ns);
+
+/**
+   Writes the time on clock 'clock' to 'ts'. Returns 0, or -1 for an
+   unknown clock or a bad pointer.
+**/
+int clock_gettime(int clock, timespec_t *ts);
+
+#endif // CLOCK_H
@@ -12,6 +12,34 @@ void outb(uint16_t port, uint8_t value);
 uint8_t inb(uint16_t port);
 uint16_t inw(uint16_t port);
 
+void wrmsr(uint32_t msr, uint64_t value);
+uint64_t rdmsr(uint32_t msr);
+void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx);
+uint64_t rdtsc();
+uint32_t read_eflags();
+// Turns interrupts off and returns the flags to give irq_restore(), which
+// turns them back on only if they were on before.
+uint32_t irq_save();
+void irq_restore(uint32_t flags);
+
+// Interrupts off and on. Built with -DIRQSOFF_TRACE, every section with
+// them off is timed and the longest one kept, see irqstat.h.
+#ifdef IRQSOFF_TRACE
+void irqsoff_cli();
+void irqsoff_sti();
+void irqsoff_cli_at(void *site);
+void irqsoff_sti_at(void *site);
+#define cli() irqsoff_cli()
+#define sti() irqsoff_sti()
+#else
+#define cli() asm volatile("cli")
+#define sti() asm volatile("sti")
+#endif
+// Stops the compiler moving memory accesses across it. Enough to order
+// stores against another task or user space on one CPU.
+#define barrier() asm volatile("" : : : "memory")
+uint64_t udiv64_32(uint64_t n, uint32_t d);
+
 #define PANIC(msg) panic(msg, __FILE__, __LINE__);
 #define ASSERT(b) ((b) ? (void)0 : panic_assert(__FILE__, __LINE__, #b))
 
@@ -23,6 +51,14 @@ uint16_t inw(uint16_t port);
 
 #define PAGE_SZ 0x1000
 
+#define EFLAGS_IF 0x200   // Interrupts enabled.
+
+// The kernel lives in the top 1GB of every address space, where all of
+// physical memory is also mapped at KERNEL_VBASE + its physical address.
+#define KERNEL_VBASE 0xC0000000
+#define PHYS_TO_VIRT(p) ((void*)((uint32_t)(p) + KERNEL_VBASE))
+#define VIRT_TO_PHYS(v) ((uint32_t)(v) - KERNEL_VBASE)
+
 #define UCHAR_MAX 255
 
 void break_point();
@@ -0,0 +1,38 @@
+// fpu.h -- Defines the interface for FPU/SSE initialisation and lazy
+//          per-task FPU context switching.
+
+#ifndef FPU_H
+#define FPU_H
+
+#include "common.h"
+#include "task.h"
+
+// Size of the FXSAVE/FXRSTOR area, which must be 16-byte aligned.
+#define FPU_STATE_SIZE  512
+#define FPU_STATE_ALIGN 16
+
+/**
+   Enables the FPU (and SSE, if present) and installs the #NM handler.
+   The FPU starts out unowned with CR0.TS set, so the first FPU
+   instruction any task executes traps.
+**/
+void initialise_fpu();
+
+/**
+   Called on every task switch with the incoming task. Only CR0.TS is
+   touched here; the registers themselves are saved and restored by the
+   #NM handler when the incoming task actually uses the FPU.
+**/
+void fpu_switch(task_t *next);
+
+/**
+   Gives 'child' a copy of the FPU state of 'parent', if it has one.
+**/
+void fpu_fork(task_t *parent, task_t *child);
+
+/**
+   Drops the FPU state of a task that is going away.
+**/
+void fpu_release(task_t *task);
+
+#endif // FPU_H
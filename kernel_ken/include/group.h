@@ -0,0 +1,74 @@
+// group.h -- Defines task groups: sets of tasks that share a CPU quota.
+//            A group may run for 'quota' in every 'period'; once it has,
+//            all its tasks are held back until the next period starts.
+
+#ifndef GROUP_H
+#define GROUP_H
+
+#include "common.h"
+#include "task.h"
+
+typedef struct task_group
+{
+    int id;                 // Handle, see handle.h.
+    uint64_t quota;         // Timer counts of CPU per period.
+    uint64_t period;
+    uint64_t used;          // Counts used in the current period.
+    uint64_t period_end;
+    int throttled;
+    uint32_t members;       // Tasks in the group, zombies aside.
+    task_t *parked;         // Tasks held back while throttled.
+    struct task_group *next;
+} task_group_t;
+
+/**
+   Makes a group allowed 'quota_us' of CPU time every 'period_us'.
+   Returns its id, or 0.
+**/
+int group_create(uint32_t quota_us, uint32_t period_us);
+
+/**
+   Moves task 'pid' into group 'gid', or out of any group if 'gid' is 0.
+   Children forked or spawned later inherit the group. Returns 1, or 0 if
+   either id is invalid.
+**/
+int group_attach(int gid, int pid);
+
+/**
+   Destroys group 'gid' and frees its id. Returns 1, or 0 if the id is
+   invalid or the group still has tasks in it.
+**/
+int group_destroy(int gid);
+
+/**
+   Task side, with interrupts off. group_join puts a new task in 'group',
+   which may be 0; group_leave takes a task out of the group it is in.
+**/
+void group_join(task_t *task, task_group_t *group);
+void group_leave(task_t *task);
+
+/**
+   Scheduler side. Charges the time since the last charge to the group of
+   'task', which must be the task that has been running.
+**/
+void group_charge(task_t *task);
+
+/**
+   Nonzero if 'task' is in a group that has used up its quota.
+**/
+int group_throttled(task_t *task);
+
+/**
+   Holds back a task of a throttled group until the group's next period.
+   The task must not be in a scheduler class.
+**/
+void group_park(task_t *task);
+
+/**
+   Starts new periods for groups that are due, handing their parked tasks
+   back to their scheduler classes, and asks the timer for the next time
+   a group of 'curr' or a throttled group needs looking at.
+**/
+void group_tick(task_t *curr);
+
+#endif // GROUP_H
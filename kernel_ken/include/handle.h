@@ -0,0 +1,63 @@
+// handle.h -- Defines the table that maps ids to kernel objects. Pids,
+//             semaphore ids, pipe descriptors and ring ids are all handles
+//             into it.
+
+#ifndef HANDLE_H
+#define HANDLE_H
+
+#include "common.h"
+
+// Object types.
+#define HANDLE_FREE 0
+#define HANDLE_TASK 1
+#define HANDLE_SEM  2
+#define HANDLE_PIPE 3
+#define HANDLE_GROUP 4
+#define HANDLE_RING  5
+
+// A handle is (generation << HANDLE_INDEX_BITS) | index. Index 0 is never
+// used, so no valid handle is 0, and all of them are positive.
+#define HANDLE_INDEX_BITS 16
+#define HANDLE_INDEX_MASK ((1 << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GEN_MASK   0x7FFF
+
+// The table starts this big and doubles when it runs out of free slots.
+#define HANDLE_TABLE_INITIAL 64
+#define HANDLE_TABLE_MAX     (1 << HANDLE_INDEX_BITS)
+
+/**
+   One slot of the table. A free slot uses 'next_free' to link into the
+   free list; 'generation' is bumped every time a slot is released, so
+   handles to an earlier occupant no longer match.
+**/
+typedef struct
+{
+    void *object;
+    uint32_t next_free;
+    uint16_t generation;
+    uint8_t type;
+} handle_entry_t;
+
+/**
+   Stores 'object' and returns a new handle for it, or 0 if the table is full.
+**/
+int handle_alloc(uint8_t type, void *object);
+
+/**
+   Returns the object behind 'handle', or 0 if the handle is stale, free or
+   refers to an object of another type.
+**/
+void *handle_lookup(int handle, uint8_t type);
+
+/**
+   Frees the slot of 'handle'. Does nothing to the object itself.
+**/
+void handle_release(int handle);
+
+// Typed lookups.
+struct task *lookup_task(int pid);
+struct semaphore *lookup_sem(int id);
+struct pipe *lookup_pipe(int id);
+struct ring *lookup_ring(int id);
+
+#endif // HANDLE_H
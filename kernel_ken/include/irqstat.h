@@ -0,0 +1,75 @@
+// irqstat.h -- Defines per-vector interrupt statistics: how often each
+//              vector fires, how long its handler runs and how long
+//              interrupts stay masked for it, as log2 histograms of TSC
+//              cycles. Built with -DIRQSOFF_TRACE, the kernel also times
+//              every section that runs with interrupts off and keeps the
+//              longest, with the addresses that opened and closed it.
+
+#ifndef IRQSTAT_H
+#define IRQSTAT_H
+
+#include "common.h"
+
+// Histogram bucket i counts samples of [2^i, 2^(i+1)) cycles; bucket 0
+// also takes 0 and the last bucket everything above it.
+#define IRQSTAT_BUCKETS 32
+
+/**
+   Statistics for one vector.
+**/
+typedef struct
+{
+    uint32_t count;                           // Interrupts taken.
+    uint32_t masked_count;                    // Of those, samples in masked_hist.
+    uint64_t handler_cycles;                  // Total cycles in the handler.
+    uint64_t handler_max;                     // Longest single handler run.
+    uint64_t masked_max;                      // Longest time with IF clear.
+    uint32_t handler_hist[IRQSTAT_BUCKETS];   // Entry to end of handler.
+    uint32_t masked_hist[IRQSTAT_BUCKETS];    // Entry to the first point IF is set again.
+} irqstat_t;
+
+/**
+   The longest section with interrupts off seen so far. Sites are the
+   return addresses of the cli() and sti() that bounded it.
+**/
+typedef struct
+{
+    uint64_t cycles;
+    uint32_t begin_site;
+    uint32_t end_site;
+    uint32_t sections;                        // Sections timed in total.
+} irqsoff_t;
+
+/**
+   Records one interrupt on 'vector'. 'masked' is 0 when the handler
+   turned interrupts on before returning, so there is no masked sample.
+**/
+void irqstat_record(uint8_t vector, uint64_t handler, uint64_t masked);
+
+/**
+   Copies the statistics for 'vector' to 'out'. Returns 0, or -1 for a bad
+   vector or pointer.
+**/
+int irqstat_get(int vector, irqstat_t *out);
+
+/**
+   Copies the longest interrupts-off section to 'out'. Returns 0, or -1 if
+   the kernel was built without IRQSOFF_TRACE or 'out' is bad.
+**/
+int irqsoff_get(irqsoff_t *out);
+
+/**
+   Writes every vector that has fired, and the longest interrupts-off
+   section, to the serial port.
+**/
+void irqstat_dump();
+
+#ifdef IRQSOFF_TRACE
+/**
+   Called on entry to every interrupt handler. The CPU cleared IF without
+   going through cli(), so any section left open is not ours to close.
+**/
+void irqsoff_enter();
+#endif
+
+#endif // IRQSTAT_H
@@ -9,8 +9,9 @@
 #include "common.h"
 #include "ordered_array.h"
 
-#define KHEAP_START         0xC0000000
+#define KHEAP_START         0xD0000000
 #define KHEAP_INITIAL_SIZE  0x100000
+#define KHEAP_MAX           0xDF000000
 
 #define HEAP_INDEX_SIZE   0x20000
 #define HEAP_MAGIC        0x123890AB
@@ -40,6 +41,7 @@ typedef struct
     uint32_t max_address;   // The maximum address the heap can be expanded to.
     uint8_t supervisor;     // Should extra pages requested by us be mapped as supervisor-only?
     uint8_t readonly;       // Should extra pages requested by us be mapped as read-only?
+    uint32_t growing;       // Expansions under way. The heap does not contract meanwhile.
 } heap_t;
 
 /**
@@ -97,4 +99,36 @@ uint32_t kmalloc(uint32_t sz);
 **/
 void kfree(void *p);
 
+// Built with -DKHEAP_TRACE, every kmalloc and kfree on the kernel heap is
+// recorded from boot until the trace buffer is full, for replay on the
+// host with hostbench/replay.c.
+#define KHEAP_TRACE_ENTRIES 16384
+
+#define KHEAP_TRACE_ALLOC 0
+#define KHEAP_TRACE_FREE  1
+
+typedef struct
+{
+    uint64_t tsc;     // When the call returned.
+    uint32_t ptr;     // The block.
+    uint32_t size;    // Size asked for, 0 for a free.
+    uint8_t op;       // KHEAP_TRACE_ALLOC or KHEAP_TRACE_FREE.
+    uint8_t align;    // Nonzero if the block had to be page aligned.
+} kheap_trace_t;
+
+#ifdef KHEAP_TRACE
+/**
+   Appends a record. Called with preemption off, from kmalloc_int() and
+   kfree().
+**/
+void kheap_trace_record(uint8_t op, uint32_t ptr, uint32_t size, uint8_t align);
+#endif
+
+/**
+   Writes the trace to the serial port, one "H a <dt> <ptr> <size> <align>"
+   or "H f <dt> <ptr>" line per call, where dt is the TSC cycles since the
+   record before. Says so if the kernel was built without KHEAP_TRACE.
+**/
+void kheap_trace_dump();
+
 #endif // KHEAP_H
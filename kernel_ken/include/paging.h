@@ -14,15 +14,50 @@ typedef struct page
     uint32_t user       : 1;   // Supervisor level only if clear
     uint32_t accessed   : 1;   // Has the page been accessed since last refresh?
     uint32_t dirty      : 1;   // Has the page been written to since last refresh?
-    uint32_t unused     : 7;   // Amalgamation of unused and reserved bits
+    uint32_t unused     : 3;   // Amalgamation of unused and reserved bits
+    uint32_t global     : 1;   // Survives CR3 writes in the TLB (needs CR4.PGE)
+    uint32_t avail      : 3;   // Free for the kernel's own use
     uint32_t frame      : 20;  // Frame address (shifted right 12 bits)
 } page_t;
 
+// page_t.avail: the kernel works on the page for as long as it is set,
+// so it must stay mapped. See pin_user_range().
+#define PAGE_PINNED 0x1
+
 typedef struct page_table
 {
     page_t pages[1024];
 } page_table_t;
 
+// Page directory entry flags.
+#define PDE_PRESENT 0x001
+#define PDE_RW      0x002
+#define PDE_USER    0x004
+#define PDE_LARGE   0x080   // Entry maps a 4MB page directly (needs CR4.PSE).
+#define PDE_GLOBAL  0x100   // 4MB page survives CR3 writes (needs CR4.PGE).
+
+#define LARGE_PAGE_SZ 0x400000
+
+// Directory entries from here up map the kernel. They are made once, at
+// boot, and every directory holds the same ones.
+#define KERNEL_PDE_START (KERNEL_VBASE / LARGE_PAGE_SZ)
+
+// User thread stacks are carved out of a fixed region, one slot per thread.
+#define USER_STACKS_START 0xA0000000
+#define USER_STACK_SLOT   0x100000
+#define USER_STACK_SLOTS  256
+
+// Where the user heap of a spawned process starts, and how much of it is
+// mapped up front. The heap may grow up to the thread stacks.
+#define USER_HEAP_START         0x40000000
+#define USER_HEAP_INITIAL_SIZE  0x10000
+#define USER_HEAP_END           USER_STACKS_START
+
+// Bytes at the start of every user heap kept for the process' allocator
+// to keep its state in, see umalloc.h. They are mapped and zeroed when
+// the heap is made, and the break starts above them.
+#define USER_HEAP_HEADER        0x2000
+
 typedef struct page_directory
 {
     /**
@@ -31,7 +66,8 @@ typedef struct page_directory
     page_table_t *tables[1024];
     /**
        Array of pointers to the pagetables above, but gives their *physical*
-       location, for loading into the CR3 register.
+       location, for loading into the CR3 register. An entry with PDE_LARGE
+       set maps a 4MB page instead, and has no pagetable in 'tables'.
     **/
     uint32_t tablesPhysical[1024];
 
@@ -41,6 +77,31 @@ typedef struct page_directory
        may be in a different location in virtual memory.
     **/
     uint32_t physicalAddr;
+
+    /**
+       Number of tasks using this directory. It is freed when the last
+       one goes away.
+    **/
+    uint32_t refcount;
+
+    /**
+       Bitmap of the user thread stack slots in use in this address space.
+    **/
+    uint32_t stack_slots[USER_STACK_SLOTS/32];
+
+    /**
+       The user heap: [heap_start, heap_end) is mapped, and heap_brk, the
+       program break, lies within it. All are 0 if this address space has
+       no heap yet.
+    **/
+    uint32_t heap_start;
+    uint32_t heap_end;
+    uint32_t heap_brk;
+
+    /**
+       User threads running in this address space that have not exited.
+    **/
+    uint32_t user_threads;
 } page_directory_t;
 
 // Function to allocate a frame.
@@ -66,17 +127,131 @@ void switch_page_directory(page_directory_t *new);
    Retrieves a pointer to the page required.
    If make == 1, if the page-table in which this page should
    reside isn't created, create it!
+   Returns 0 for an address covered by a 4MB page, which has no page_t.
 **/
 page_t *get_page(uint32_t address, int make, page_directory_t *dir);
 
+/**
+   Nonzero once CR4.PSE is on and 4MB pages can be used.
+**/
+extern uint8_t pse_enabled;
+
+/**
+   Maps the 4MB page at 'address' to the physical 4MB page at 'phys'.
+   Both must be 4MB aligned.
+**/
+void map_large_page(uint32_t address, uint32_t phys, int is_kernel, int is_writeable, page_directory_t *dir);
+
+/**
+   Maps a 4MB page at 'address' backed by a fresh run of 1024 contiguous
+   frames. Returns 0 if 4MB pages are unavailable or no such run is free;
+   the caller should then fall back to 4KB pages. Only the kernel maps
+   memory this way; user memory always comes in 4KB pages.
+**/
+int alloc_large_page(uint32_t address, int is_kernel, int is_writeable, page_directory_t *dir);
+
+/**
+   Nonzero if 'address' is covered by a 4MB page in 'dir'.
+**/
+int is_large_page(uint32_t address, page_directory_t *dir);
+
+/**
+   Translates a mapped virtual address to its physical address.
+**/
+uint32_t get_physical(uint32_t address, page_directory_t *dir);
+
+/**
+   Maps a fresh frame at 'address' in the kernel half, as a global page.
+   Every directory sees the new page at once.
+**/
+page_t *map_kernel_page(uint32_t address, int is_kernel, int is_writeable);
+
+/**
+   Frees the frame behind a kernel half page and flushes it from the TLB.
+**/
+void unmap_kernel_page(uint32_t address);
+
+/**
+   Nonzero if 'size' bytes at 'p' lie wholly in the user half and are
+   mapped user-accessible in the current directory, and writeable too if
+   'write' is set. A syscall may then copy there without touching kernel
+   memory or faulting. Another thread of the process may unmap the pages
+   once the caller is switched out, so check and copy with preemption
+   off, or pin the memory.
+**/
+int user_ptr_ok(const void *p, uint32_t size, int write);
+
+/**
+   Pins the 'size' bytes at 'start' in 'dir', so they stay mapped until
+   unpinned: the break will not drop below them, and an exiting thread
+   leaves them, and its stack slot, in place. Returns 0 unless every page
+   is mapped user writable and none is pinned already. Interrupts must be
+   off.
+**/
+int pin_user_range(page_directory_t *dir, uint32_t start, uint32_t size);
+void unpin_user_range(page_directory_t *dir, uint32_t start, uint32_t size);
+
+/**
+   Nonzero if a page of [start, end) in 'dir' is pinned.
+**/
+int user_range_pinned(page_directory_t *dir, uint32_t start, uint32_t end);
+
+/**
+   Moves the calling process' program break by 'increment' bytes, mapping
+   or freeing pages to match. An address space without a heap gets one at
+   USER_HEAP_START, holding just its header. Returns the old break, or
+   (void*)-1 if the break would leave [heap_start + USER_HEAP_HEADER,
+   USER_HEAP_END), there are not enough free frames, or a page to be
+   freed is pinned.
+**/
+void *sbrk(int increment);
+
+/**
+   Sets the program break to 'addr'. Returns 0, or -1 as for sbrk.
+**/
+int brk(void *addr);
+
+/**
+   Gives 'dir' a heap, as sbrk() would, if it has none yet. Every address
+   space that runs user code has one, so its allocator can rely on the
+   header being there. Returns 0, or -1 if the header cannot be mapped.
+**/
+int user_heap_init(page_directory_t *dir);
+
 /**
    Handler for page faults.
 **/
 void page_fault(registers_t *regs);
 
 /**
-   Makes a copy of a page directory.
+   Makes a directory with the kernel half only and an empty user half.
+**/
+page_directory_t *new_directory();
+
+/**
+   Copies 'size' bytes from 'src' to 'address' in 'dir', which need not be
+   the current directory. The destination pages must be mapped.
+**/
+void copy_to_directory(page_directory_t *dir, uint32_t address, const void *src, uint32_t size);
+
+/**
+   Makes a copy of a page directory. The user half is copied, the
+   kernel half is the same as in every other directory. The copy can
+   be preempted between pages.
 **/
 page_directory_t *clone_directory(page_directory_t *src);
 
+/**
+   Maps zeroed, writeable user frames at [start, end) in 'dir'. Can be
+   preempted between pages.
+**/
+void alloc_user_range(page_directory_t *dir, uint32_t start, uint32_t end);
+
+/**
+   Drops a reference to a directory made by clone_directory. On the last
+   reference, frees every frame and table in its user half, and the
+   directory itself.
+**/
+void free_directory(page_directory_t *dir);
+
 #endif
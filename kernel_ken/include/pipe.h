@@ -0,0 +1,42 @@
+// pipe.h -- Defines pipes: fixed size, non-blocking byte FIFOs. Their
+//           descriptors are handles, see handle.h.
+
+#ifndef PIPE_H
+#define PIPE_H
+
+#include "common.h"
+
+#define PIPE_SIZE    512
+#define PIPE_INVALID -1
+
+typedef struct pipe
+{
+    int id;
+    uint32_t head;          // Next byte to read.
+    uint32_t count;         // Bytes in the pipe.
+    uint8_t buffer[PIPE_SIZE];
+} pipe_t;
+
+/**
+   Makes a pipe. Returns its descriptor, or PIPE_INVALID.
+**/
+int pipe_open();
+
+/**
+   Writes all 'nbyte' bytes of 'buf', or nothing if they do not fit.
+   Returns the number of bytes written.
+**/
+uint32_t pipe_write(int fd, const void *buf, uint32_t nbyte);
+
+/**
+   Reads up to 'nbyte' bytes into 'buf'. Returns the number read, or
+   (uint32_t)-1 if the pipe is invalid.
+**/
+uint32_t pipe_read(int fd, void *buf, uint32_t nbyte);
+
+/**
+   Frees the pipe. Returns 'fd', or PIPE_INVALID if it is invalid.
+**/
+int pipe_close(int fd);
+
+#endif // PIPE_H
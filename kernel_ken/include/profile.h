@@ -0,0 +1,56 @@
+// profile.h -- Defines the sampling profiler. While it runs, the timer
+//              interrupts at the sampling rate on top of its own events,
+//              and each of those interrupts records the interrupted EIP
+//              and the call chain found by following saved frame pointers.
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "common.h"
+#include "isr.h"
+
+// Return addresses kept per sample, after the EIP itself.
+#define PROFILE_DEPTH   15
+// Samples the buffer holds; once it is full, further samples are dropped.
+#define PROFILE_SAMPLES 2048
+// Fastest sampling rate allowed, and the rate used when 0 is asked for.
+#define PROFILE_MAX_HZ     10000
+#define PROFILE_DEFAULT_HZ 1000
+
+#define PROFILE_USER 0x1   // The sample was taken in ring 3.
+
+typedef struct
+{
+    int pid;
+    uint16_t flags;                 // PROFILE_* flags.
+    uint16_t depth;                 // Entries used in 'callers'.
+    uint32_t eip;
+    uint32_t callers[PROFILE_DEPTH]; // Innermost first.
+} profile_sample_t;
+
+/**
+   Empties the buffer and starts sampling 'hz' times a second. Returns 0,
+   or -1 if 'hz' is too high.
+**/
+int profile_start(uint32_t hz);
+
+/**
+   Stops sampling. The samples stay in the buffer.
+**/
+void profile_stop();
+
+/**
+   Writes the buffer to the serial port, one sample per line, as
+   "P <pid> <k|u> <eip> <caller>...". tools/profile.py turns a log of this
+   into folded stacks.
+**/
+void profile_dump();
+
+/**
+   Called by the timer's top half with the clock at this interrupt. Takes
+   a sample if one is due and returns when the next one is, or
+   TIMER_NEVER when not profiling.
+**/
+uint64_t profile_interrupt(registers_t *regs, uint64_t now);
+
+#endif // PROFILE_H
@@ -0,0 +1,141 @@
+// ring.h -- Defines submission/completion rings: batched, asynchronous
+//           system calls. A process lays a ring out in its own memory,
+//           queues operations on the submission queue and reads their
+//           results off the completion queue. One ring_enter() runs every
+//           queued operation, or, with a polling thread, none is needed.
+//           Ring ids are handles, see handle.h.
+
+#ifndef RING_H
+#define RING_H
+
+#include "common.h"
+#include "paging.h"
+
+// Most entries a ring may have. The count must be a power of two.
+#define RING_MAX_ENTRIES 256
+
+// Operations. args[] holds the operands in the order listed.
+#define RING_OP_NOP        0    // Does nothing, result 0.
+#define RING_OP_WRITE      1    // buf, len: writes to the monitor, result len.
+#define RING_OP_PIPE_WRITE 2    // fd, buf, len: as pipe_write().
+#define RING_OP_PIPE_READ  3    // fd, buf, len: as pipe_read().
+#define RING_OP_SEM_WAIT   4    // id: as sem_wait(), 0 if the ring closes first.
+#define RING_OP_SEM_SIGNAL 5    // id: as sem_signal().
+#define RING_OP_SYSCALL    6    // num, p1..p5: any syscall but the ring ones and exit.
+
+// ring_shared_t.flags: the polling thread has gone to sleep and needs a
+// ring_enter(id, 0, RING_ENTER_WAKEUP) to see new submissions.
+#define RING_NEED_WAKEUP 0x1
+
+// ring_enter() flags.
+#define RING_ENTER_WAKEUP 0x1
+
+/**
+   A submission queue entry. 'user_data' comes back in the completion.
+**/
+typedef struct
+{
+    uint32_t opcode;
+    uint32_t user_data;
+    uint32_t args[6];
+} ring_sqe_t;
+
+/**
+   A completion queue entry: the operation's result, as the function the
+   opcode names would have returned it, or -1 for a bad operation.
+**/
+typedef struct
+{
+    uint32_t user_data;
+    int32_t result;
+} ring_cqe_t;
+
+/**
+   The head of the shared memory; the submission queue follows it and the
+   completion queue follows that. Indices run freely and wrap at 2^32;
+   entry i is in slot i & (entries - 1). The process writes sq_tail and
+   cq_head, the kernel sq_head, cq_tail and flags. A queue is empty when
+   its head equals its tail.
+**/
+typedef struct
+{
+    volatile uint32_t sq_head;
+    volatile uint32_t sq_tail;
+    volatile uint32_t cq_head;
+    volatile uint32_t cq_tail;
+    volatile uint32_t flags;
+    uint32_t entries;
+    uint32_t sq_fill;           // User side only: end of the slots ring_get_sqe() gave out.
+    uint32_t reserved;
+} ring_shared_t;
+
+// Bytes of memory a ring of 'n' entries needs.
+#define RING_BYTES(n) (sizeof(ring_shared_t) + (n) * (sizeof(ring_sqe_t) + sizeof(ring_cqe_t)))
+
+/**
+   Kernel side state of a ring. sq_head and cq_tail are the kernel's own
+   copies; the shared ones are only ever written from them, so a process
+   scribbling on its ring cannot make the kernel run past the queues.
+**/
+typedef struct ring
+{
+    int id;
+    ring_shared_t *shared;
+    ring_sqe_t *sq;
+    ring_cqe_t *cq;
+    uint32_t mask;              // entries - 1.
+    uint32_t sq_head;
+    uint32_t cq_tail;
+    page_directory_t *dir;      // Address space the memory belongs to.
+    int poller;                 // Id of the polling thread, 0 if none.
+    uint64_t idle_ns;           // How long it polls an empty ring before sleeping.
+    volatile int busy;          // Someone is running operations.
+    volatile int closing;
+    struct ring *next;
+} ring_t;
+
+/**
+   Sets up a ring of 'entries' entries in the RING_BYTES(entries) bytes at
+   'mem', which must be page aligned, mapped and writable in the caller's
+   address space and not in another ring. The memory is pinned until the
+   ring is closed, see pin_user_range(). With 'poll_idle_us' set, a kernel
+   thread works the ring and sleeps once it has been empty that long.
+   Returns the ring's id, or 0.
+**/
+int ring_setup(void *mem, uint32_t entries, uint32_t poll_idle_us);
+
+/**
+   Runs up to 'to_submit' queued operations (0 for all of them), stopping
+   early if the completion queue fills. Returns the number run, or -1 for
+   a bad ring or one another thread is working. On a polled ring this runs
+   nothing; RING_ENTER_WAKEUP wakes its thread.
+**/
+int ring_enter(int id, uint32_t to_submit, uint32_t flags);
+
+/**
+   Stops the ring and frees it, first waiting for a polling thread to
+   finish the operation it is on. The memory then belongs to the process
+   again. Returns 'id', or 0 if the ring is invalid or busy.
+**/
+int ring_close(int id);
+
+/**
+   Closes every ring in 'dir', as ring_close() does. Called as the last
+   user thread of a process exits.
+**/
+void ring_exit(page_directory_t *dir);
+
+/**
+   User side. These work on the shared memory only, they never enter the
+   kernel. ring_get_sqe returns a free submission slot or 0 if the queue
+   is full; ring_submit makes the slots filled so far visible.
+   ring_peek_cqe returns the oldest completion or 0, and ring_cqe_seen
+   frees its slot. On a polled ring, check for RING_NEED_WAKEUP after
+   ring_submit.
+**/
+ring_sqe_t *ring_get_sqe(ring_shared_t *ring);
+void ring_submit(ring_shared_t *ring);
+ring_cqe_t *ring_peek_cqe(ring_shared_t *ring);
+void ring_cqe_seen(ring_shared_t *ring);
+
+#endif // RING_H
@@ -0,0 +1,69 @@
+// sched.h -- Defines the scheduler class interface. task.c does the
+//            mechanics of switching; which task runs next is left to the
+//            scheduler class chosen at boot.
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "common.h"
+#include "task.h"
+
+/**
+   A scheduling policy. A class holds the runnable tasks that are not
+   currently on the CPU.
+**/
+typedef struct sched_class
+{
+    const char *name;
+    // Adds a runnable task. Also called with the running task when it is
+    // preempted or yields, before pick_next.
+    void (*enqueue)(task_t *task);
+    // Removes a task that was enqueued.
+    void (*dequeue)(task_t *task);
+    // Removes and returns the task to run next, or 0 if there is none.
+    task_t *(*pick_next)();
+    // Called on every timer tick with the running task. Returns nonzero
+    // if it should be preempted.
+    int (*tick)(task_t *curr);
+    // Called when the running task gives up the CPU of its own accord.
+    void (*yield)(task_t *curr);
+} sched_class_t;
+
+extern sched_class_t sched_prio;
+extern sched_class_t sched_fair;
+
+/**
+   The deadline class. It runs ahead of the normal class, and its tick is
+   called on every timer interrupt, with whichever task is running.
+**/
+extern sched_class_t sched_dl;
+
+/**
+   The normal class in use, for every task not in the deadline class.
+**/
+extern sched_class_t *sched;
+
+/**
+   Admission control for the deadline class. Sets the parameters of 'task'
+   (in timer counts) if the total utilisation stays under DL_UTIL_MAX.
+   Returns 1 on success, 0 otherwise.
+**/
+int sched_dl_admit(task_t *task, uint64_t runtime, uint64_t deadline, uint64_t period);
+
+/**
+   Gives back the bandwidth of a task leaving the deadline class.
+**/
+void sched_dl_leave(task_t *task);
+
+// Utilisation is fixed point with this many fractional bits. Keep some CPU
+// for the normal tasks.
+#define DL_UTIL_SHIFT 20
+#define DL_UTIL_MAX   ((95 << DL_UTIL_SHIFT) / 100)
+
+/**
+   Picks the class named by a "sched=<name>" option on the kernel command
+   line, if there is one. Must be called before initialise_tasking().
+**/
+void sched_select(const char *cmdline);
+
+#endif // SCHED_H
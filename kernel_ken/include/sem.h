@@ -0,0 +1,64 @@
+// sem.h -- Defines counting semaphores. Their ids are handles, see handle.h.
+
+#ifndef SEM_H
+#define SEM_H
+
+#include "common.h"
+
+#include "task.h"
+
+/**
+   A task asleep in sem_wait(). It lives on the waiter's own stack, so it
+   is on the queue for exactly as long as the waiter is in sem_wait().
+**/
+typedef struct sem_waiter
+{
+    task_t *task;
+    int state;                  // SEM_WAITING, SEM_GRANTED or SEM_CLOSED.
+    struct sem_waiter *next;
+} sem_waiter_t;
+
+#define SEM_WAITING 0
+#define SEM_GRANTED 1           // sem_signal() handed it a slot.
+#define SEM_CLOSED  2           // The semaphore went while it waited.
+
+typedef struct semaphore
+{
+    int id;
+    int count;                  // Free slots left.
+    int max;                    // Slots in total, as given to sem_open.
+    sem_waiter_t *head, *tail;  // Waiters, oldest first. Only there while count is 0.
+} semaphore_t;
+
+/**
+   Makes a semaphore that lets 'n' tasks in at once. Returns its id, or 0.
+**/
+int sem_open(int n);
+
+/**
+   Takes a slot of semaphore 'id', sleeping until one is free. Waiters are
+   served in the order they arrived: a slot given back while anyone waits
+   goes straight to the oldest waiter. Returns 'id', or 0 if the semaphore
+   is invalid or is closed while waiting.
+**/
+int sem_wait(int id);
+
+/**
+   As sem_wait(), but gives up and returns 0 once '*abort' is set. Whoever
+   sets it must task_wake() the waiter.
+**/
+int sem_wait_abort(int id, volatile int *abort);
+
+/**
+   Gives a slot back. Returns 'id', or 0 if the semaphore is invalid or no
+   slot is taken.
+**/
+int sem_signal(int id);
+
+/**
+   Frees the semaphore; anyone still waiting gets 0 from sem_wait().
+   Returns 'id', or 0 if it is invalid.
+**/
+int sem_close(int id);
+
+#endif // SEM_H
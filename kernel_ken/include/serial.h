@@ -0,0 +1,33 @@
+// serial.h -- Defines the interface for the serial port driver. Output
+//             goes to COM1 by polling, so it works with interrupts off.
+
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include "common.h"
+
+#define SERIAL_COM1 0x3F8
+
+/**
+   Sets COM1 up for 115200 baud, 8N1. Returns 1, or 0 if there is no
+   working port there; the other functions then do nothing.
+**/
+int init_serial();
+
+/**
+   Writes a single character out.
+**/
+void serial_put(char c);
+
+/**
+   Writes a null-terminated ASCII string.
+**/
+void serial_write(const char *c);
+
+/**
+   Writes a number in hex, or in decimal.
+**/
+void serial_write_hex(uint32_t n);
+void serial_write_dec(uint32_t n);
+
+#endif // SERIAL_H
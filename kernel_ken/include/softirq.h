@@ -0,0 +1,52 @@
+// softirq.h -- Defines bottom halves. An interrupt handler (the top half)
+//              does only what cannot wait and raises a softirq; the
+//              softirq then runs on the way out of the interrupt, with
+//              interrupts back on.
+
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include "common.h"
+
+// Softirq numbers. Lower numbers run first.
+#define SOFTIRQ_TIMER 0      // Scheduler tick, raised by the timer.
+#define NR_SOFTIRQS   4
+
+// Times do_softirq() goes round again for softirqs raised while it ran;
+// anything still pending after that waits for the next interrupt.
+#define SOFTIRQ_MAX_RESTART 4
+
+typedef void (*softirq_handler_t)();
+
+/**
+   Statistics, one per softirq.
+**/
+typedef struct
+{
+    uint32_t raised;        // raise_softirq() calls.
+    uint32_t runs;          // Times the handler ran.
+    uint64_t cycles;        // TSC cycles spent in the handler.
+    uint64_t max_cycles;    // Longest single run.
+} softirq_stats_t;
+
+extern softirq_stats_t softirq_stats[NR_SOFTIRQS];
+
+/**
+   Installs the handler for softirq 'nr'.
+**/
+void open_softirq(int nr, softirq_handler_t handler);
+
+/**
+   Marks softirq 'nr' pending. Safe to call from interrupt handlers.
+**/
+void raise_softirq(int nr);
+
+/**
+   Runs the pending softirqs with interrupts on and preemption off. Called
+   at the end of every IRQ, with interrupts off, and returns with them off.
+   Does nothing when called from an interrupt that arrived while
+   softirqs were already running. Returns 1 if it ran any, else 0.
+**/
+int do_softirq();
+
+#endif // SOFTIRQ_H
@@ -8,6 +8,29 @@
 
 void initialise_syscalls();
 
+// Model specific registers used by SYSENTER/SYSEXIT.
+#define IA32_SYSENTER_CS  0x174
+#define IA32_SYSENTER_ESP 0x175
+#define IA32_SYSENTER_EIP 0x176
+
+// Dispatches syscall 'num' with its arguments. Both the int 0x80 handler and
+// the SYSENTER entry stub end up here. Returns -1 for an unknown syscall.
+int syscall_dispatch(uint32_t num, uint32_t p1, uint32_t p2, uint32_t p3, uint32_t p4, uint32_t p5);
+
+// Runs syscall 'num' from kernel code that is already past the entry, such
+// as a ring (see ring.h). Interrupts stay as they are. Returns -1 for an
+// unknown syscall.
+int syscall_call(uint32_t num, uint32_t p1, uint32_t p2, uint32_t p3, uint32_t p4, uint32_t p5);
+
+// User-side entry stubs (in syscall.s). Both take the syscall number in EAX,
+// the arguments in EBX, ECX, EDX, ESI, EDI and return the result in EAX.
+extern void syscall_int80();
+extern void syscall_sysenter();
+
+// The stub the DEFN_SYSCALLn wrappers call, picked by initialise_syscalls().
+// SYSEXIT always returns to ring 3, so these wrappers are for user mode only.
+extern void (*syscall_gate)();
+
 #define DECL_SYSCALL0(fn) int syscall_##fn();
 #define DECL_SYSCALL1(fn,p1) int syscall_##fn(p1);
 #define DECL_SYSCALL2(fn,p1,p2) int syscall_##fn(p1,p2);
@@ -19,7 +42,7 @@ void initialise_syscalls();
 int syscall_##fn() \
 { \
   int a; \
-  asm volatile("int $0x80" : "=a" (a) : "0" (num)); \
+  asm volatile("call *syscall_gate" : "=a" (a) : "0" (num) : "memory"); \
   return a; \
 }
 
@@ -27,7 +50,7 @@ int syscall_##fn() \
 int syscall_##fn(P1 p1) \
 { \
   int a; \
-  asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((int)p1)); \
+  asm volatile("call *syscall_gate" : "=a" (a) : "0" (num), "b" ((int)p1) : "memory"); \
   return a; \
 }
 
@@ -35,7 +58,7 @@ int syscall_##fn(P1 p1) \
 int syscall_##fn(P1 p1, P2 p2) \
 { \
   int a; \
-  asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((int)p1), "c" ((int)p2)); \
+  asm volatile("call *syscall_gate" : "=a" (a) : "0" (num), "b" ((int)p1), "c" ((int)p2) : "memory"); \
   return a; \
 }
 
@@ -43,7 +66,7 @@ int syscall_##fn(P1 p1, P2 p2) \
 int syscall_##fn(P1 p1, P2 p2, P3 p3) \
 { \
   int a; \
-  asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((int)p1), "c" ((int)p2), "d"((int)p3)); \
+  asm volatile("call *syscall_gate" : "=a" (a) : "0" (num), "b" ((int)p1), "c" ((int)p2), "d"((int)p3) : "memory"); \
   return a; \
 }
 
@@ -51,20 +74,97 @@ int syscall_##fn(P1 p1, P2 p2, P3 p3) \
 int syscall_##fn(P1 p1, P2 p2, P3 p3, P4 p4) \
 { \
   int a; \
-  asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((int)p1), "c" ((int)p2), "d" ((int)p3), "S" ((int)p4)); \
+  asm volatile("call *syscall_gate" : "=a" (a) : "0" (num), "b" ((int)p1), "c" ((int)p2), "d" ((int)p3), "S" ((int)p4) : "memory"); \
   return a; \
 }
 
-#define DEFN_SYSCALL5(fn, num) \
+#define DEFN_SYSCALL5(fn, num, P1, P2, P3, P4, P5) \
 int syscall_##fn(P1 p1, P2 p2, P3 p3, P4 p4, P5 p5) \
 { \
   int a; \
-  asm volatile("int $0x80" : "=a" (a) : "0" (num), "b" ((int)p1), "c" ((int)p2), "d" ((int)p3), "S" ((int)p4), "D" ((int)p5)); \
+  asm volatile("call *syscall_gate" : "=a" (a) : "0" (num), "b" ((int)p1), "c" ((int)p2), "d" ((int)p3), "S" ((int)p4), "D" ((int)p5) : "memory"); \
   return a; \
 }
 
-DECL_SYSCALL1(monitor_write, const char*)
-DECL_SYSCALL1(monitor_write_hex, const char*)
-DECL_SYSCALL1(monitor_write_dec, const char*)
+/**
+   The system call registry. This is the only place a syscall is declared:
+   the syscall numbers, the user-side syscall_<name>() wrappers, the typed
+   kernel trampolines, the dispatch table and the invocation counters are
+   all generated from it.
+
+   Each entry is S(name, kind, nargs, T1, ..., Tn) where 'name' is the kernel
+   function implementing the call, 'kind' is INT if its result is returned to
+   the caller or VOID if it returns nothing, and T1..Tn are its argument types.
+   Numbers are assigned in list order, so only ever append.
+**/
+#define SYSCALL_LIST(S) \
+    S(monitor_write,     VOID, 1, char*) \
+    S(monitor_write_hex, VOID, 1, uint32_t) \
+    S(monitor_write_dec, VOID, 1, uint32_t) \
+    S(exit,              VOID, 0) \
+    S(thread_create_user, INT, 3, void*, void*, uint32_t) \
+    S(sched_setdeadline, INT, 4, int, uint32_t, uint32_t, uint32_t) \
+    S(group_create, INT, 2, uint32_t, uint32_t) \
+    S(group_attach, INT, 2, int, int) \
+    S(group_destroy, INT, 1, int) \
+    S(irqstat_get,  INT, 2, int, void*) \
+    S(irqsoff_get,  INT, 1, void*) \
+    S(irqstat_dump, VOID, 0) \
+    S(profile_start, INT, 1, uint32_t) \
+    S(profile_stop,  VOID, 0) \
+    S(profile_dump,  VOID, 0) \
+    S(kheap_trace_dump, VOID, 0) \
+    S(bench_report, INT, 2, char*, uint32_t) \
+    S(clock_gettime, INT, 2, int, void*) \
+    S(ring_setup, INT, 3, void*, uint32_t, uint32_t) \
+    S(ring_enter, INT, 3, int, uint32_t, uint32_t) \
+    S(ring_close, INT, 1, int) \
+    S(sbrk, INT, 1, int) \
+    S(brk,  INT, 1, void*) \
+    S(yield, VOID, 0) \
+    S(sem_open,   INT, 1, int) \
+    S(sem_close,  INT, 1, int) \
+    S(pipe_open,  INT, 0) \
+    S(pipe_close, INT, 1, int)
+
+#define SYSCALL_ENUM(name, kind, n, ...) SYS_##name,
+enum
+{
+    SYSCALL_LIST(SYSCALL_ENUM)
+    NUM_SYSCALLS
+};
+#undef SYSCALL_ENUM
+
+#define SYSCALL_DECL(name, kind, n, ...) DECL_SYSCALL##n(name, ##__VA_ARGS__)
+SYSCALL_LIST(SYSCALL_DECL)
+#undef SYSCALL_DECL
+
+// Kernel-side trampolines, one type per arity. Arguments arrive as raw
+// register values and are cast back to their declared types by the trampoline.
+typedef uint32_t (*syscall0_t)(void);
+typedef uint32_t (*syscall1_t)(uint32_t);
+typedef uint32_t (*syscall2_t)(uint32_t, uint32_t);
+typedef uint32_t (*syscall3_t)(uint32_t, uint32_t, uint32_t);
+typedef uint32_t (*syscall4_t)(uint32_t, uint32_t, uint32_t, uint32_t);
+typedef uint32_t (*syscall5_t)(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
+
+typedef struct
+{
+    uint32_t nargs;
+    union
+    {
+        syscall0_t fn0;
+        syscall1_t fn1;
+        syscall2_t fn2;
+        syscall3_t fn3;
+        syscall4_t fn4;
+        syscall5_t fn5;
+    } fn;
+    const char *name;
+} syscall_entry_t;
+
+// Number of times each syscall has been dispatched, indexed by SYS_<name>.
+extern uint32_t syscall_counts[NUM_SYSCALLS];
+extern const syscall_entry_t syscall_table[NUM_SYSCALLS];
 
 #endif
@@ -10,34 +10,142 @@
 #include "paging.h"
 
 #define KERNEL_STACK_SIZE 2048       // Use a 2kb kernel stack.
+#define THREAD_STACK_SIZE 0x4000     // Default stack size for thread_create.
+
+// Task states.
+#define TASK_RUNNABLE 0      // On the ready queue (or running).
+#define TASK_ZOMBIE   1      // Exited, waiting to be reaped.
+#define TASK_SLEEPING 2      // Off the ready queue until task_wake().
+#define TASK_THROTTLED 3     // Its group is out of quota; parked in the group.
+
+// Task priorities. A lower number is a higher priority; the scheduler
+// always runs a task of the highest priority that is runnable.
+#define PRIORITY_HIGHEST 1
+#define PRIORITY_LOWEST  10
+#define PRIORITY_DEFAULT 5
+
+// Upper bound on the bytes of arguments spawn() copies to the new process.
+#define SPAWN_ARGS_MAX 0x1000
 
 // This structure defines a 'task' - a process.
 typedef struct task
 {
     int id;                // Process ID.
-    uint32_t esp, ebp;       // Stack and base pointers.
-    uint32_t eip;            // Instruction pointer.
+    int tgid;              // Thread group ID: the id of the task that started the process.
+    int state;             // One of the TASK_* states above.
+    int priority;          // PRIORITY_HIGHEST..PRIORITY_LOWEST.
+    int preempt_count;     // Kernel preemption is off while non-zero.
+    uint32_t esp;            // Saved stack pointer, pointing at a switch_context frame.
     page_directory_t *page_directory; // Page directory.
     uint32_t kernel_stack;   // Kernel stack location.
+    uint32_t kernel_stack_size;
+    uint32_t user_stack;     // Base of the user stack slot of a user thread, or 0.
+    uint32_t user_stack_size;
+    void *fpu_area;          // Allocation holding fpu_state, 0 if none.
+    uint8_t *fpu_state;      // Aligned FXSAVE area, 0 until the task first uses the FPU.
+    struct sched_class *sched_class; // The scheduler class this task is in.
+    struct task_group *group; // CPU quota group, 0 if none.
+    uint64_t vruntime;       // Fair scheduler: weighted TSC cycles run so far.
+    uint64_t exec_start;     // Fair scheduler: TSC when last charged, 0 if off the CPU.
+    struct task *tree_left;  // Fair scheduler: links in its tree of runnable tasks.
+    struct task *tree_right;
+    int tree_height;
+    uint64_t dl_runtime;     // Deadline class, in timer counts: runtime per period,
+    uint64_t dl_deadline;    // relative deadline,
+    uint64_t dl_period;      // and period.
+    int64_t dl_budget;       // Runtime left in the current period.
+    uint64_t dl_abs_deadline;// Deadline of the current period.
+    uint64_t dl_release;     // Start of the next period.
+    uint64_t dl_start;       // When it last went on the CPU, 0 if off it.
     struct task *next;     // The next task in a linked list.
 } task_t;
 
 // Initialises the tasking system.
 void initialise_tasking();
 
-// Called by the timer hook, this changes the running process.
+// Called from the timer softirq after every timer interrupt; 'periodic' is
+// set when there has been a regular tick since. Lets the scheduler classes
+// account the time, and has the running process changed on the way out of
+// the interrupt if they say so.
+void task_tick(int periodic);
+
+// Puts the running task back to the scheduler class and runs whichever task
+// it picks. Interrupts must be off.
 void task_switch();
 
+// Takes the running task off the CPU until task_wake() is called for it.
+// Interrupts must be off; the caller re-checks whatever it waited for.
+void task_sleep();
+
+// Hands a sleeping task back to its scheduler class. Interrupts must be off.
+void task_wake(task_t *task);
+
+// Kernel preemption. Kernel code may be switched out whenever interrupts
+// are on and the running task's preempt_count is 0: on the way out of an
+// interrupt, or as soon as preempt_enable() drops the count back to 0.
+// Sections that leave interrupts on but must not be switched out nest
+// preempt_disable()/preempt_enable() around themselves.
+void preempt_disable();
+void preempt_enable();
+
+// An explicit preemption point for long loops inside a preempt_disable()
+// section, to be called where the section's state is consistent. A pending
+// switch happens here if the caller's section is the outermost one.
+void preempt_point();
+
+// Called at the end of every IRQ, with interrupts still off. Switches away
+// if a switch is pending and the interrupted code could be preempted.
+void preempt_irq_exit();
+
 void switch_to_user_mode();
 
 // Forks the current process, spawning a new one with a different
 // memory space.
 int fork();
 
+typedef void (*thread_entry_t)(void *arg);
+
+// Starts a new process running entry(argv) in user mode at 'priority'.
+// Nothing of the caller's address space is copied: the new one has only the
+// kernel mappings, a fresh user stack and a fresh heap. 'args' is a
+// 0-terminated array of strings, copied onto the new stack; 'entry' gets a
+// pointer to that copy. Returns the new pid, or 0 on failure.
+int spawn(thread_entry_t entry, char **args, int priority);
+
+// Starts a kernel thread running entry(arg) on its own stack of
+// 'stack_size' bytes (0 for the default). It shares the page directory of
+// the calling task, so switching between the two never reloads CR3.
+// Returns the id of the new thread. Returning from 'entry' exits the thread.
+int thread_create(thread_entry_t entry, void *arg, uint32_t stack_size);
+
+// As thread_create, but 'entry' runs in user mode on a new user stack
+// mapped into the shared address space.
+int thread_create_user(thread_entry_t entry, void *arg, uint32_t stack_size);
+
+// Terminates the current process. Its memory is freed once another
+// task is running.
+void exit();
+
 // Causes the current process' stack to be forcibly moved to a new location.
 void move_stack(void *new_stack_start, uint32_t size);
 
 // Returns the pid of the current process.
 int getpid();
 
+// Sets the priority of the task 'pid'. Returns the new priority, or 0 if
+// the pid or the priority is invalid.
+int setpriority(int pid, int new_priority);
+
+// Gives up the CPU to the highest priority task, which may be this one.
+// A deadline task gives up the rest of its runtime for this period.
+void yield();
+
+// Moves task 'pid' into the deadline class: every 'period_us' it may run
+// for 'runtime_us', and must have done so within 'deadline_us' of the
+// period starting. It then runs ahead of all normal tasks, earliest
+// deadline first. A runtime of 0 moves it back to the normal class.
+// Returns 1, or 0 if the parameters are invalid or admitting the task
+// would overcommit the CPU.
+int sched_setdeadline(int pid, uint32_t runtime_us, uint32_t deadline_us, uint32_t period_us);
+
 #endif
@@ -5,7 +5,43 @@
 #define TIMER_H
 
 #include "common.h"
+#include "isr.h"
+
+// The PIT's input clock. Timer times are counted in its cycles.
+#define TIMER_PIT_HZ 1193180
+
+// Shortest count we program, so interrupts cannot come back to back.
+#define TIMER_MIN_COUNTS 24
+
+#define TIMER_NEVER 0xFFFFFFFFFFFFFFFFULL
 
 void init_timer(uint32_t frequency);
 
+/**
+   The top half of IRQ0, called from its stub in interrupt.s by way of
+   irq_timer(). Keeps the clock and raises SOFTIRQ_TIMER.
+**/
+void timer_interrupt(registers_t *regs);
+
+// Ticks since boot, and the rate they arrive at.
+extern uint32_t tick;
+extern uint32_t timer_frequency;
+
+/**
+   PIT cycles since boot.
+**/
+uint64_t timer_now();
+
+/**
+   Asks for a timer interrupt no later than 'when' (in timer_now() units).
+   Requests only last until the next interrupt; whoever still needs one
+   asks again from there.
+**/
+void timer_request(uint64_t when);
+
+/**
+   Converts microseconds to timer_now() units.
+**/
+uint64_t timer_us_to_counts(uint32_t us);
+
 #endif
@@ -0,0 +1,45 @@
+// umalloc.h -- Defines the user heap allocator. It runs in user mode on
+//              memory it gets from the kernel with sbrk, a large chunk at
+//              a time. Small blocks come from per-thread caches of size
+//              classes, so most calls never enter the kernel or take a
+//              lock. Its state is kept in the process' own heap, in the
+//              USER_HEAP_HEADER bytes the kernel sets aside at its start
+//              (see paging.h), so each process has a heap of its own.
+
+#ifndef UMALLOC_H
+#define UMALLOC_H
+
+#include "common.h"
+
+// Small block sizes. Larger requests, and page aligned ones, get whole
+// pages of their own.
+#define UMALLOC_CLASSES   14
+#define UMALLOC_MAX_SMALL 2048
+
+// Threads that can have a cache at once; any others share the central
+// lists under the heap lock.
+#define UMALLOC_CACHES 16
+
+// The heap grows by at least this much each time it calls sbrk, and
+// gives memory back once this much is free at its top.
+#define UMALLOC_GROW 0x10000
+#define UMALLOC_TRIM (4 * UMALLOC_GROW)
+
+/**
+   Allocates 'size' bytes, page aligned if 'page_align' is set. Returns 0
+   if the heap cannot grow.
+**/
+void *umalloc(uint32_t size, int page_align);
+
+/**
+   Frees a block from umalloc(). Does nothing for 0.
+**/
+void ufree(void *p);
+
+/**
+   Hands the calling thread's cached blocks back to the heap and frees its
+   cache for another thread. Called as a user thread exits.
+**/
+void umalloc_thread_exit();
+
+#endif // UMALLOC_H
@@ -0,0 +1,52 @@
+// vdata.h -- Defines the shared kernel data page. The kernel keeps a few
+//            frequently read values in one page that is mapped read-only
+//            into every address space, so they can be read without a syscall.
+
+#ifndef VDATA_H
+#define VDATA_H
+
+#include "common.h"
+#include "clock.h"
+
+// Fixed virtual address of the page in every address space. It sits in
+// the kernel half, so all directories share its page table.
+#define VDATA_ADDR 0xFFFFF000
+
+// Fixed-point shift used by tsc_mult, the clock's own.
+#define VDATA_TSC_SHIFT CLOCK_TSC_SHIFT
+
+/**
+   Layout of the page. The kernel bumps 'seq' to an odd value before
+   changing the fields below it and to an even value afterwards; readers
+   retry if they saw an odd value or if 'seq' changed under them.
+**/
+typedef struct
+{
+    uint32_t seq;
+    int32_t pid;          // Pid of the task currently on the CPU.
+    uint32_t tick;        // Timer ticks since boot.
+    uint32_t tick_hz;     // Timer frequency.
+    uint64_t tsc_base;    // TSC value at the last tick.
+    uint64_t ns_base;     // Nanoseconds since boot at tsc_base.
+    uint32_t tsc_mult;    // ns per TSC cycle << VDATA_TSC_SHIFT, 0 unless the clock runs on the TSC.
+} vdata_t;
+
+/**
+   Kernel side. Called once paging is up and the page is mapped.
+**/
+void initialise_vdata(uint32_t tick_hz);
+
+/**
+   Kernel side. Publish a new tick / a new running task.
+**/
+void vdata_tick(uint32_t tick);
+void vdata_set_pid(int pid);
+
+/**
+   User side. These only read the page, they never enter the kernel.
+**/
+int vdata_getpid();
+uint32_t vdata_ticks();
+uint64_t vdata_time_ns();
+
+#endif // VDATA_H
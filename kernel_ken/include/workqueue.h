@@ -0,0 +1,82 @@
+// workqueue.h -- Defines workqueues: lists of work items run, in the
+//                order they were queued, by a small pool of kernel threads.
+//                Work runs in task context with interrupts on, so unlike a
+//                softirq it may take as long as it likes.
+
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include "common.h"
+#include "task.h"
+
+#define WQ_MAX_WORKERS 4
+
+typedef void (*work_func_t)(void *arg);
+
+/**
+   A unit of work. It belongs to whoever queued it, and may be queued
+   again once its function has started.
+**/
+typedef struct work
+{
+    work_func_t func;
+    void *arg;
+    int pending;            // Queued and not started yet.
+    uint64_t queued_at;     // TSC when it was queued.
+    struct work *next;
+} work_t;
+
+/**
+   Statistics, one set per queue.
+**/
+typedef struct
+{
+    uint32_t queued;        // Items queued.
+    uint32_t merged;        // queue_work() calls for an item already pending.
+    uint32_t done;          // Items run.
+    uint32_t depth;         // Items pending now,
+    uint32_t max_depth;     // and the most there have ever been.
+    uint64_t wait_cycles;   // TSC cycles from queueing to start, summed,
+    uint64_t max_wait;      // and the longest.
+    uint64_t run_cycles;    // TSC cycles spent running items.
+} workqueue_stats_t;
+
+typedef struct workqueue
+{
+    const char *name;
+    work_t *head, *tail;
+    task_t *workers[WQ_MAX_WORKERS];
+    int nworkers;
+    workqueue_stats_t stats;
+    struct workqueue *next;
+} workqueue_t;
+
+// The queue for work that has no queue of its own.
+extern workqueue_t *system_wq;
+
+// Every queue made so far, newest first.
+extern workqueue_t *workqueues;
+
+/**
+   Makes the system queue. Call once tasking is up.
+**/
+void initialise_workqueues();
+
+/**
+   Makes a queue served by 'nworkers' kernel threads, at most
+   WQ_MAX_WORKERS.
+**/
+workqueue_t *create_workqueue(const char *name, int nworkers);
+
+/**
+   Sets up 'work' to call func(arg).
+**/
+void init_work(work_t *work, work_func_t func, void *arg);
+
+/**
+   Queues 'work' on 'wq' and wakes a worker. Safe to call from interrupt
+   handlers. Returns 1, or 0 if the item was already pending.
+**/
+int queue_work(workqueue_t *wq, work_t *work);
+
+#endif // WORKQUEUE_H
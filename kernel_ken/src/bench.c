@@ -0,0 +1,295 @@
+// bench.c -- The boot-time benchmark suite. Each benchmark times a loop
+//            with the TSC and reports the cost of one iteration in cycles.
+
+#include "bench.h"
+#include "kheap.h"
+#include "paging.h"
+#include "task.h"
+#include "timer.h"
+#include "clock.h"
+#include "serial.h"
+#include "handle.h"
+#include "syscall.h"
+#include "vdata.h"
+#include "umalloc.h"
+
+#define BENCH_OPTION "bench"
+
+extern page_directory_t *current_directory;
+
+int bench_wanted(const char *cmdline)
+{
+    if (!cmdline)
+        return 0;
+    // A word of its own, not part of another option.
+    const char *opt = cmdline;
+    while ((opt = strstr(opt, BENCH_OPTION)) != 0)
+    {
+        char after = opt[strlen(BENCH_OPTION)];
+        if ((opt == cmdline || opt[-1] == ' ') && (after == '\0' || after == ' '))
+            return 1;
+        opt += strlen(BENCH_OPTION);
+    }
+    return 0;
+}
+
+static void report(const char *name, uint64_t cycles, uint32_t iterations)
+{
+    serial_write("BENCH ");
+    serial_write(name);
+    serial_put(' ');
+    serial_write_dec((uint32_t)udiv64_32(cycles, iterations));
+    serial_write(" cycles\n");
+}
+
+// Runs 'body' 'iterations' times, BENCH_REPEAT times over, and reports
+// the fastest round.
+static void measure(const char *name, void (*body)(), uint32_t iterations)
+{
+    uint64_t best = 0;
+    int round;
+    for (round = 0; round < BENCH_REPEAT; round++)
+    {
+        uint64_t start = rdtsc();
+        uint32_t i;
+        for (i = 0; i < iterations; i++)
+            body();
+        uint64_t cycles = rdtsc() - start;
+        if (!round || cycles < best)
+            best = cycles;
+    }
+    report(name, best, iterations);
+}
+
+static void kmalloc_kfree_64()
+{
+    kfree((void*)kmalloc(64));
+}
+
+static void kmalloc_kfree_page_aligned()
+{
+    kfree((void*)kmalloc_a(PAGE_SZ));
+}
+
+// A spread of sizes held at once, so the heap has holes to search.
+static void kmalloc_kfree_mixed()
+{
+    static const uint32_t sizes[] = { 24, 4000, 96, 16384, 512, 40, 2048, 128 };
+    uint32_t blocks[sizeof(sizes) / sizeof(sizes[0])];
+    uint32_t i;
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        blocks[i] = kmalloc(sizes[i]);
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i += 2)
+        kfree((void*)blocks[i]);
+    for (i = 1; i < sizeof(sizes) / sizeof(sizes[0]); i += 2)
+        kfree((void*)blocks[i]);
+}
+
+static void frame_alloc_free()
+{
+    page_t page;
+    memset(&page, 0, sizeof(page));
+    alloc_frame(&page, 1, 1);
+    free_frame(&page);
+}
+
+static void clone_free_directory()
+{
+    free_directory(clone_directory(current_directory));
+}
+
+static void read_timer()
+{
+    timer_now();
+}
+
+static void read_clock()
+{
+    clock_ns();
+}
+
+static volatile int ping_stop;
+
+static void ping_thread(void *arg)
+{
+    (void)arg;
+    while (!ping_stop)
+        yield();
+}
+
+// A round trip to another kernel thread and back: two task switches in
+// the same address space.
+static void yield_round_trip()
+{
+    yield();
+}
+
+static void fork_exit()
+{
+    if (fork() == 0)
+        exit();
+}
+
+// Results reported by the user mode benchmarks.
+static uint32_t user_reports = 0;
+
+int bench_report(char *name, uint32_t cycles)
+{
+    // Copied in first: the page could go while we write to the port.
+    char buf[BENCH_NAME_MAX];
+    preempt_disable();
+    int ok = user_ptr_ok(name, BENCH_NAME_MAX, 0);
+    if (ok)
+        memcpy(buf, name, BENCH_NAME_MAX);
+    preempt_enable();
+    if (!ok)
+        return -1;
+    uint32_t len = 0;
+    while (len < BENCH_NAME_MAX && buf[len])
+        len++;
+    if (!len || len == BENCH_NAME_MAX)
+        return -1;
+    report(buf, cycles, 1);
+    user_reports++;
+    return 0;
+}
+
+// Everything from here to bench_exit() runs in user mode, in a process
+// of its own. It keeps no writeable statics, and reports through
+// bench_report.
+
+// As measure(), for user mode.
+static void user_measure(const char *name, void (*body)(), uint32_t iterations)
+{
+    uint64_t best = 0;
+    int round;
+    for (round = 0; round < BENCH_REPEAT; round++)
+    {
+        uint64_t start = rdtsc();
+        uint32_t i;
+        for (i = 0; i < iterations; i++)
+            body();
+        uint64_t cycles = rdtsc() - start;
+        if (!round || cycles < best)
+            best = cycles;
+    }
+    // The kernel only takes the name from user memory.
+    char buf[BENCH_NAME_MAX];
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, name, MIN(strlen(name), BENCH_NAME_MAX - 1));
+    syscall_bench_report(buf, (uint32_t)udiv64_32(best, iterations));
+}
+
+// The shared data page is there so that user mode can read these without
+// entering the kernel.
+static void user_vdata_time_ns()
+{
+    vdata_time_ns();
+}
+
+static void user_vdata_getpid()
+{
+    vdata_getpid();
+}
+
+static void umalloc_ufree_64()
+{
+    ufree(umalloc(64, 0));
+}
+
+// The sizes of kmalloc_kfree_mixed, plus a page aligned block, each filled
+// and checked before it is freed. Returns 0 if any came back damaged.
+static int umalloc_ufree_checked()
+{
+    static const uint32_t sizes[] = { 24, 4000, 96, 16384, 512, 40, 2048, 128 };
+    uint8_t *blocks[sizeof(sizes) / sizeof(sizes[0]) + 1];
+    uint32_t n = sizeof(sizes) / sizeof(sizes[0]);
+    uint32_t i, j;
+    int ok = 1;
+    for (i = 0; i < n; i++)
+        blocks[i] = (uint8_t*)umalloc(sizes[i], 0);
+    blocks[n] = (uint8_t*)umalloc(PAGE_SZ, 1);
+    for (i = 0; i < n; i++)
+    {
+        if (!blocks[i])
+            return 0;
+        memset(blocks[i], i + 1, sizes[i]);
+    }
+    if (!blocks[n] || ((uint32_t)blocks[n] & (PAGE_SZ - 1)))
+        return 0;
+    ufree(blocks[n]);
+    for (i = 0; i < n; i++)
+    {
+        for (j = 0; j < sizes[i]; j++)
+            if (blocks[i][j] != (uint8_t)(i + 1))
+                ok = 0;
+        ufree(blocks[i]);
+    }
+    return ok;
+}
+
+static void umalloc_ufree_mixed()
+{
+    umalloc_ufree_checked();
+}
+
+// The user mode process. Nothing is reported if the heap hands back a
+// damaged block, and the kernel's page fault handler stops the run if
+// the heap touches memory user mode may not.
+static void user_bench(void *arg)
+{
+    (void)arg;
+    if (!umalloc_ufree_checked())
+        return;
+    user_measure("user_vdata_time_ns", &user_vdata_time_ns, 1000);
+    user_measure("user_vdata_getpid", &user_vdata_getpid, 1000);
+    user_measure("umalloc_ufree_64", &umalloc_ufree_64, 1000);
+    user_measure("umalloc_ufree_mixed", &umalloc_ufree_mixed, 200);
+}
+
+// The number of results user_bench() reports.
+#define USER_BENCH_RESULTS 4
+
+static void bench_exit(uint8_t status)
+{
+    outb(BENCH_EXIT_PORT, status);
+    // No such device: stop here instead.
+    for (;;)
+        asm volatile("cli; hlt");
+}
+
+void bench_run()
+{
+    serial_write("bench: begin\n");
+
+    measure("kmalloc_kfree_64", &kmalloc_kfree_64, 1000);
+    measure("kmalloc_kfree_page_aligned", &kmalloc_kfree_page_aligned, 200);
+    measure("kmalloc_kfree_mixed", &kmalloc_kfree_mixed, 200);
+    measure("frame_alloc_free", &frame_alloc_free, 1000);
+    measure("clone_free_directory", &clone_free_directory, 20);
+    measure("timer_now", &read_timer, 1000);
+    measure("clock_ns", &read_clock, 1000);
+
+    ping_stop = 0;
+    thread_create(&ping_thread, 0, 0);
+    yield();
+    measure("yield_round_trip", &yield_round_trip, 1000);
+    ping_stop = 1;
+    yield();
+
+    // Only the parent gets here; the cost includes none of the child's run.
+    measure("fork", &fork_exit, 10);
+
+    // From a user mode process, through the SYSENTER or int 0x80 gate.
+    int pid = spawn(&user_bench, 0, PRIORITY_DEFAULT);
+    while (pid && lookup_task(pid))
+        yield();
+    if (user_reports != USER_BENCH_RESULTS)
+    {
+        serial_write("bench: user mode benchmarks failed\n");
+        bench_exit(1);
+    }
+
+    serial_write("bench: end\n");
+    bench_exit(0);
+}
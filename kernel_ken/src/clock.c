@@ -0,0 +1,192 @@
+// clock.c -- The monotonic clock. The base is moved up on every timer
+//            tick under a sequence count; readers convert the counter
+//            delta since then and retry if a tick slipped in between.
+
+#include "clock.h"
+#include "timer.h"
+#include "paging.h"
+#include "task.h"
+#include "serial.h"
+
+// Port 0x61 holds channel 2's gate (bit 0), the speaker enable (bit 1)
+// and channel 2's output (bit 5).
+#define PIT_CH2_GATE 0x01
+#define PIT_SPEAKER  0x02
+#define PIT_CH2_OUT  0x20
+
+// Polls of port 0x61 before giving up on channel 2. Each takes about a
+// microsecond, so this is far past the measurement's 10ms.
+#define CALIBRATE_SPINS 10000000
+
+static clocksource_t pit_source =
+{
+    "pit", &timer_now,
+    (uint32_t)((1000000000ULL << CLOCK_PIT_SHIFT) / TIMER_PIT_HZ),
+    CLOCK_PIT_SHIFT, TIMER_PIT_HZ / 1000
+};
+
+static clocksource_t tsc_source =
+{
+    "tsc", &rdtsc, 0, CLOCK_TSC_SHIFT, 0
+};
+
+static clocksource_t *source = &pit_source;
+
+// Counter value at the last tick and the time it stood for. Odd 'seq'
+// means they are being changed.
+static volatile uint32_t seq;
+static uint64_t base_count;
+static uint64_t base_ns;
+
+static uint64_t to_ns(uint64_t count)
+{
+    return (count * source->mult) >> source->shift;
+}
+
+// CPUID.01h:EDX.TSC (bit 4).
+static int tsc_present()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 1)
+        return 0;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    return (edx & (1 << 4)) ? 1 : 0;
+}
+
+// TSC cycles while PIT channel 2 counts CLOCK_CALIBRATE_COUNTS down, or 0
+// if its output never went high.
+static uint32_t tsc_measure()
+{
+    // Gate channel 2 on, with the speaker kept off.
+    outb(0x61, (inb(0x61) & ~PIT_SPEAKER) | PIT_CH2_GATE);
+    // Channel 2, lobyte/hibyte, mode 0: the output goes high at terminal count.
+    outb(0x43, 0xB0);
+    outb(0x42, CLOCK_CALIBRATE_COUNTS & 0xFF);
+    outb(0x42, (CLOCK_CALIBRATE_COUNTS >> 8) & 0xFF);
+
+    uint64_t start = rdtsc();
+    uint32_t spins = 0;
+    while (!(inb(0x61) & PIT_CH2_OUT))
+    {
+        if (++spins == CALIBRATE_SPINS)
+            return 0;
+    }
+    uint64_t cycles = rdtsc() - start;
+    return (cycles >> 32) ? 0 : (uint32_t)cycles;
+}
+
+// Sets tsc_source up from the median of CLOCK_CALIBRATE_RUNS measurements,
+// so that one run stretched by an SMI or a host preemption cannot skew it.
+// Returns 0 if the TSC is unusable.
+static int tsc_calibrate()
+{
+    if (!tsc_present())
+        return 0;
+
+    uint32_t runs[CLOCK_CALIBRATE_RUNS];
+    int i, j;
+    uint32_t flags = irq_save();
+    for (i = 0; i < CLOCK_CALIBRATE_RUNS; i++)
+    {
+        uint32_t cycles = tsc_measure();
+        for (j = i; j > 0 && runs[j - 1] > cycles; j--)
+            runs[j] = runs[j - 1];
+        runs[j] = cycles;
+    }
+    irq_restore(flags);
+
+    uint32_t cycles = runs[CLOCK_CALIBRATE_RUNS / 2];
+    if (!runs[0] || !cycles)
+        return 0;
+
+    // The measurement spans a whole number of PIT counts, not exactly 10ms.
+    uint32_t ns = (uint32_t)udiv64_32((uint64_t)CLOCK_CALIBRATE_COUNTS * 1000000000, TIMER_PIT_HZ);
+    tsc_source.mult = (uint32_t)udiv64_32((uint64_t)ns << CLOCK_TSC_SHIFT, cycles);
+    tsc_source.khz = (uint32_t)udiv64_32((uint64_t)cycles * 1000000, ns);
+    return tsc_source.mult != 0;
+}
+
+void init_clock()
+{
+    if (tsc_calibrate())
+    {
+        uint32_t flags = irq_save();
+        uint64_t now = clock_ns();
+        seq++;
+        barrier();
+        source = &tsc_source;
+        base_count = rdtsc();
+        base_ns = now;
+        barrier();
+        seq++;
+        irq_restore(flags);
+    }
+
+    serial_write("clock: ");
+    serial_write(source->name);
+    serial_write(" at ");
+    serial_write_dec(source->khz);
+    serial_write(" kHz\n");
+}
+
+void clock_tick()
+{
+    uint64_t now = source->read();
+    seq++;
+    barrier();
+    base_ns += to_ns(now - base_count);
+    base_count = now;
+    barrier();
+    seq++;
+}
+
+uint64_t clock_ns()
+{
+    uint32_t s;
+    uint64_t ns;
+    do
+    {
+        s = seq;
+        barrier();
+        ns = base_ns + to_ns(source->read() - base_count);
+        barrier();
+    } while ((s & 1) || s != seq);
+    return ns;
+}
+
+const clocksource_t *clock_source()
+{
+    return source;
+}
+
+void clock_base(uint64_t *count, uint64_t *ns)
+{
+    uint32_t s;
+    do
+    {
+        s = seq;
+        barrier();
+        *count = base_count;
+        *ns = base_ns;
+        barrier();
+    } while ((s & 1) || s != seq);
+}
+
+int clock_gettime(int clock, timespec_t *ts)
+{
+    if (clock != CLOCK_MONOTONIC)
+        return -1;
+    uint64_t ns = clock_ns();
+    uint64_t sec = udiv64_32(ns, 1000000000);
+    preempt_disable();
+    if (!user_ptr_ok(ts, sizeof(timespec_t), 1))
+    {
+        preempt_enable();
+        return -1;
+    }
+    ts->tv_sec = (uint32_t)sec;
+    ts->tv_nsec = (uint32_t)(ns - sec * 1000000000);
+    preempt_enable();
+    return 0;
+}
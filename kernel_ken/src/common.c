@@ -35,6 +35,74 @@ uint16_t inw(uint16_t port)
     return ret;
 }
 
+// Write a 64-bit value to a model specific register.
+void wrmsr(uint32_t msr, uint64_t value)
+{
+    asm volatile ("wrmsr" : : "c" (msr), "a" ((uint32_t)value), "d" ((uint32_t)(value >> 32)));
+}
+
+uint64_t rdmsr(uint32_t msr)
+{
+    uint32_t lo, hi;
+    asm volatile ("rdmsr" : "=a" (lo), "=d" (hi) : "c" (msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Read the processor's time-stamp counter.
+uint64_t rdtsc()
+{
+    uint64_t ret;
+    asm volatile ("rdtsc" : "=A" (ret));
+    return ret;
+}
+
+uint32_t read_eflags()
+{
+    uint32_t eflags;
+    asm volatile ("pushf; pop %0" : "=r" (eflags));
+    return eflags;
+}
+
+uint32_t irq_save()
+{
+    uint32_t flags = read_eflags();
+#ifdef IRQSOFF_TRACE
+    irqsoff_cli_at(__builtin_return_address(0));
+#else
+    cli();
+#endif
+    return flags;
+}
+
+void irq_restore(uint32_t flags)
+{
+    if (!(flags & EFLAGS_IF))
+        return;
+#ifdef IRQSOFF_TRACE
+    irqsoff_sti_at(__builtin_return_address(0));
+#else
+    sti();
+#endif
+}
+
+// Divide a 64-bit value by a 32-bit one without pulling in libgcc's __udivdi3.
+uint64_t udiv64_32(uint64_t n, uint32_t d)
+{
+    uint32_t hi = (uint32_t)(n >> 32);
+    uint32_t q_hi = hi / d;
+    uint32_t r = hi % d;
+    uint32_t q_lo;
+    // r < d, so the 64/32 divide below cannot overflow.
+    asm ("divl %4" : "=a" (q_lo), "=d" (r) : "a" ((uint32_t)n), "d" (r), "rm" (d));
+    return ((uint64_t)q_hi << 32) | q_lo;
+}
+
+// Query the processor identification leaf 'leaf'.
+void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    asm volatile ("cpuid" : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) : "0" (leaf), "2" (0));
+}
+
 /* vim: tabstop=4 shiftwidth=4 noexpandtab
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
@@ -0,0 +1,173 @@
+// fpu.c -- FPU/SSE initialisation and lazy FPU context switching.
+//          The task whose registers are currently loaded in the FPU is the
+//          'owner'. Switching to any other task sets CR0.TS, so the first
+//          FPU/SSE instruction it runs raises #NM (vector 7); only then is
+//          the owner's state saved and the new task's state restored.
+
+#include "fpu.h"
+#include "isr.h"
+#include "kheap.h"
+
+#define CR0_MP (1 << 1)   // Monitor coprocessor: WAIT honours TS.
+#define CR0_EM (1 << 2)   // Emulation: must be clear for a real FPU.
+#define CR0_TS (1 << 3)   // Task switched: next FPU instruction traps.
+#define CR0_NE (1 << 5)   // Native FPU error reporting.
+#define CR4_OSFXSR     (1 << 9)   // OS supports FXSAVE/FXRSTOR.
+#define CR4_OSXMMEXCPT (1 << 10)  // OS handles SIMD floating point exceptions.
+
+#define MXCSR_DEFAULT 0x1F80
+
+extern volatile task_t *current_task;
+
+// The task whose state is in the FPU registers, or 0.
+static task_t *fpu_owner = 0;
+static uint8_t has_fxsr = 0;
+static uint8_t has_sse = 0;
+
+static void fpu_trap(registers_t *regs);
+
+static uint32_t read_cr0()
+{
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r" (cr0));
+    return cr0;
+}
+
+static void write_cr0(uint32_t cr0)
+{
+    asm volatile("mov %0, %%cr0" : : "r" (cr0));
+}
+
+static void fpu_save(uint8_t *state)
+{
+    if (has_fxsr)
+        asm volatile("fxsave (%0)" : : "r" (state) : "memory");
+    else
+        asm volatile("fnsave (%0)" : : "r" (state) : "memory");
+}
+
+static void fpu_restore(uint8_t *state)
+{
+    if (has_fxsr)
+        asm volatile("fxrstor (%0)" : : "r" (state) : "memory");
+    else
+        asm volatile("frstor (%0)" : : "r" (state) : "memory");
+}
+
+// Allocates an aligned save area for a task.
+static void fpu_alloc(task_t *task)
+{
+    task->fpu_area = (void*)kmalloc(FPU_STATE_SIZE + FPU_STATE_ALIGN - 1);
+    task->fpu_state = (uint8_t*)(((uint32_t)task->fpu_area + FPU_STATE_ALIGN - 1)
+                                 & ~(FPU_STATE_ALIGN - 1));
+}
+
+void initialise_fpu()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    has_fxsr = (edx & (1 << 24)) ? 1 : 0;
+    has_sse = (edx & (1 << 25)) ? 1 : 0;
+
+    uint32_t cr0 = read_cr0();
+    cr0 &= ~(CR0_EM | CR0_TS);
+    cr0 |= CR0_MP | CR0_NE;
+    write_cr0(cr0);
+
+    if (has_fxsr)
+    {
+        uint32_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r" (cr4));
+        cr4 |= CR4_OSFXSR;
+        if (has_sse)
+            cr4 |= CR4_OSXMMEXCPT;
+        asm volatile("mov %0, %%cr4" : : "r" (cr4));
+    }
+
+    asm volatile("fninit");
+
+    register_interrupt_handler(7, &fpu_trap);
+
+    // Nobody owns the FPU yet, so the first user traps.
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+void fpu_switch(task_t *next)
+{
+    uint32_t cr0 = read_cr0();
+    if (next == fpu_owner)
+    {
+        // Its registers are still live, let it run without trapping.
+        if (cr0 & CR0_TS)
+            asm volatile("clts");
+    }
+    else if (!(cr0 & CR0_TS))
+    {
+        write_cr0(cr0 | CR0_TS);
+    }
+}
+
+// #NM: the current task touched the FPU while CR0.TS was set.
+static void fpu_trap(registers_t *regs)
+{
+    (void)regs;
+    task_t *task = (task_t*)current_task;
+
+    asm volatile("clts");
+    if (fpu_owner == task)
+        return;
+
+    if (fpu_owner)
+        fpu_save(fpu_owner->fpu_state);
+
+    if (task->fpu_state)
+    {
+        fpu_restore(task->fpu_state);
+    }
+    else
+    {
+        // First use: give it a clean FPU/SSE state.
+        fpu_alloc(task);
+        asm volatile("fninit");
+        if (has_sse)
+        {
+            uint32_t mxcsr = MXCSR_DEFAULT;
+            asm volatile("ldmxcsr %0" : : "m" (mxcsr));
+        }
+    }
+    fpu_owner = task;
+}
+
+void fpu_fork(task_t *parent, task_t *child)
+{
+    child->fpu_area = 0;
+    child->fpu_state = 0;
+    if (!parent->fpu_state)
+        return;
+
+    // If the parent's registers are live, flush them to its save area first.
+    if (fpu_owner == parent)
+    {
+        asm volatile("clts");
+        fpu_save(parent->fpu_state);
+        // FNSAVE reinitialises the FPU, so reload what we just saved.
+        if (!has_fxsr)
+            fpu_restore(parent->fpu_state);
+    }
+
+    fpu_alloc(child);
+    memcpy(child->fpu_state, parent->fpu_state, FPU_STATE_SIZE);
+}
+
+void fpu_release(task_t *task)
+{
+    // The #NM handler may change the owner under us.
+    uint32_t flags = irq_save();
+    if (fpu_owner == task)
+        fpu_owner = 0;
+    irq_restore(flags);
+    if (task->fpu_area)
+        kfree(task->fpu_area);
+    task->fpu_area = 0;
+    task->fpu_state = 0;
+}
@@ -0,0 +1,157 @@
+// group.c -- Implements task groups and their CPU quotas.
+
+#include "group.h"
+#include "handle.h"
+#include "kheap.h"
+#include "sched.h"
+#include "timer.h"
+
+extern volatile task_t *current_task;
+
+static task_group_t *groups = 0;
+
+// When the running task was last charged.
+static uint64_t charged_at = 0;
+
+int group_create(uint32_t quota_us, uint32_t period_us)
+{
+    if (!quota_us || quota_us > period_us)
+        return 0;
+
+    task_group_t *group = (task_group_t*)kmalloc(sizeof(task_group_t));
+    memset(group, 0, sizeof(task_group_t));
+    group->quota = timer_us_to_counts(quota_us);
+    group->period = timer_us_to_counts(period_us);
+
+    cli();
+    int id = group->id = handle_alloc(HANDLE_GROUP, group);
+    if (id)
+    {
+        group->period_end = timer_now() + group->period;
+        group->next = groups;
+        groups = group;
+    }
+    sti();
+    if (!id)
+        kfree(group);
+    return id;
+}
+
+static void unpark(task_group_t *group, task_t *task)
+{
+    task_t **link = &group->parked;
+    while (*link && *link != task)
+        link = &(*link)->next;
+    if (*link)
+        *link = task->next;
+    task->next = 0;
+    task->state = TASK_RUNNABLE;
+    task->sched_class->enqueue(task);
+}
+
+int group_attach(int gid, int pid)
+{
+    cli();
+    task_group_t *group = gid ? (task_group_t*)handle_lookup(gid, HANDLE_GROUP) : 0;
+    task_t *task = lookup_task(pid);
+    if (!task || (gid && !group))
+    {
+        sti();
+        return 0;
+    }
+
+    // A parked task goes back to its class; if the new group is throttled
+    // too, it is parked again the next time it is picked.
+    if (task->state == TASK_THROTTLED)
+        unpark(task->group, task);
+    if (task == current_task)
+        group_charge(task);
+    group_leave(task);
+    group_join(task, group);
+    sti();
+    return 1;
+}
+
+int group_destroy(int gid)
+{
+    cli();
+    task_group_t *group = (task_group_t*)handle_lookup(gid, HANDLE_GROUP);
+    if (!group || group->members)
+    {
+        sti();
+        return 0;
+    }
+
+    task_group_t **link = &groups;
+    while (*link != group)
+        link = &(*link)->next;
+    *link = group->next;
+    handle_release(gid);
+    sti();
+    kfree(group);
+    return 1;
+}
+
+void group_join(task_t *task, task_group_t *group)
+{
+    task->group = group;
+    if (group)
+        group->members++;
+}
+
+void group_leave(task_t *task)
+{
+    if (task->group)
+        task->group->members--;
+    task->group = 0;
+}
+
+void group_charge(task_t *task)
+{
+    uint64_t now = timer_now();
+    task_group_t *group = task->group;
+    if (group)
+    {
+        group->used += now - charged_at;
+        if (group->used >= group->quota)
+            group->throttled = 1;
+    }
+    charged_at = now;
+}
+
+int group_throttled(task_t *task)
+{
+    return task->group && task->group->throttled;
+}
+
+void group_park(task_t *task)
+{
+    task->state = TASK_THROTTLED;
+    task->next = task->group->parked;
+    task->group->parked = task;
+}
+
+void group_tick(task_t *curr)
+{
+    uint64_t now = timer_now();
+    task_group_t *group;
+    for (group = groups; group; group = group->next)
+    {
+        if (group->period_end <= now)
+        {
+            group->used = 0;
+            group->period_end += group->period;
+            if (group->period_end <= now)
+                group->period_end = now + group->period;
+            group->throttled = 0;
+            while (group->parked)
+                unpark(group, group->parked);
+        }
+        if (group->throttled)
+            timer_request(group->period_end);
+    }
+
+    // Come back when the running group's quota runs out.
+    if (curr->group && !curr->group->throttled)
+        timer_request(now + curr->group->quota - curr->group->used);
+}
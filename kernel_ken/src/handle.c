@@ -0,0 +1,109 @@
+// handle.c -- Implements the id to kernel object table. Allocation, lookup
+//             and release are all O(1); only growing the table copies it.
+
+#include "handle.h"
+#include "kheap.h"
+
+static handle_entry_t *handles = 0;
+static uint32_t handles_size = 0;
+
+// First free slot, or 0 if there is none.
+static uint32_t free_head = 0;
+
+// Doubles the table and puts the new slots on the free list.
+static int grow_table()
+{
+    uint32_t new_size = handles_size ? handles_size*2 : HANDLE_TABLE_INITIAL;
+    if (new_size > HANDLE_TABLE_MAX)
+        return 0;
+
+    handle_entry_t *new_handles = (handle_entry_t*)kmalloc(new_size*sizeof(handle_entry_t));
+    memset(new_handles, 0, new_size*sizeof(handle_entry_t));
+    if (handles)
+    {
+        memcpy(new_handles, handles, handles_size*sizeof(handle_entry_t));
+        kfree(handles);
+    }
+
+    // Push in reverse, so the lowest index comes off first. Slot 0 is
+    // never handed out.
+    uint32_t i;
+    for (i = new_size - 1; i >= handles_size && i > 0; i--)
+    {
+        new_handles[i].next_free = free_head;
+        free_head = i;
+    }
+    handles = new_handles;
+    handles_size = new_size;
+    return 1;
+}
+
+int handle_alloc(uint8_t type, void *object)
+{
+    if (!free_head && !grow_table())
+        return 0;
+
+    uint32_t idx = free_head;
+    handle_entry_t *entry = &handles[idx];
+    free_head = entry->next_free;
+
+    entry->object = object;
+    entry->type = type;
+    entry->next_free = 0;
+    return ((entry->generation & HANDLE_GEN_MASK) << HANDLE_INDEX_BITS) | idx;
+}
+
+// Returns the slot 'handle' names if it is still live, otherwise 0.
+static handle_entry_t *get_entry(int handle)
+{
+    uint32_t idx = handle & HANDLE_INDEX_MASK;
+    uint32_t gen = (handle >> HANDLE_INDEX_BITS) & HANDLE_GEN_MASK;
+    if (handle <= 0 || idx == 0 || idx >= handles_size)
+        return 0;
+
+    handle_entry_t *entry = &handles[idx];
+    if (entry->type == HANDLE_FREE || (entry->generation & HANDLE_GEN_MASK) != gen)
+        return 0;
+    return entry;
+}
+
+void *handle_lookup(int handle, uint8_t type)
+{
+    handle_entry_t *entry = get_entry(handle);
+    if (!entry || entry->type != type)
+        return 0;
+    return entry->object;
+}
+
+void handle_release(int handle)
+{
+    handle_entry_t *entry = get_entry(handle);
+    if (!entry)
+        return;
+
+    entry->object = 0;
+    entry->type = HANDLE_FREE;
+    entry->generation++;
+    entry->next_free = free_head;
+    free_head = handle & HANDLE_INDEX_MASK;
+}
+
+struct task *lookup_task(int pid)
+{
+    return (struct task*)handle_lookup(pid, HANDLE_TASK);
+}
+
+struct semaphore *lookup_sem(int id)
+{
+    return (struct semaphore*)handle_lookup(id, HANDLE_SEM);
+}
+
+struct pipe *lookup_pipe(int id)
+{
+    return (struct pipe*)handle_lookup(id, HANDLE_PIPE);
+}
+
+struct ring *lookup_ring(int id)
+{
+    return (struct ring*)handle_lookup(id, HANDLE_RING);
+}
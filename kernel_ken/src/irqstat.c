@@ -0,0 +1,209 @@
+// irqstat.c -- Per-vector interrupt statistics and, with IRQSOFF_TRACE,
+//              the longest section with interrupts off.
+
+#include "irqstat.h"
+#include "serial.h"
+#include "paging.h"
+
+static irqstat_t irqstats[256];
+
+// Index of the highest set bit, 0 for 0.
+static int log2_cycles(uint64_t n)
+{
+    uint32_t hi = (uint32_t)(n >> 32);
+    uint32_t lo = (uint32_t)n;
+    int bit;
+    if (hi)
+        bit = 63 - __builtin_clz(hi);
+    else if (lo)
+        bit = 31 - __builtin_clz(lo);
+    else
+        bit = 0;
+    return bit < IRQSTAT_BUCKETS ? bit : IRQSTAT_BUCKETS - 1;
+}
+
+void irqstat_record(uint8_t vector, uint64_t handler, uint64_t masked)
+{
+    uint32_t flags = irq_save();
+    irqstat_t *s = &irqstats[vector];
+    s->count++;
+    s->handler_cycles += handler;
+    if (handler > s->handler_max)
+        s->handler_max = handler;
+    s->handler_hist[log2_cycles(handler)]++;
+    if (masked)
+    {
+        s->masked_count++;
+        if (masked > s->masked_max)
+            s->masked_max = masked;
+        s->masked_hist[log2_cycles(masked)]++;
+    }
+    irq_restore(flags);
+}
+
+int irqstat_get(int vector, irqstat_t *out)
+{
+    if (vector < 0 || vector > 255)
+        return -1;
+    // Copy straight out with interrupts off: nothing can unmap the pages
+    // between the check and the copy, and the copy is consistent. There
+    // is no snapshot on the kernel stack, which is only 2KB.
+    uint32_t flags = irq_save();
+    int ok = user_ptr_ok(out, sizeof(irqstat_t), 1);
+    if (ok)
+        memcpy(out, &irqstats[vector], sizeof(irqstat_t));
+    irq_restore(flags);
+    return ok ? 0 : -1;
+}
+
+#ifdef IRQSOFF_TRACE
+
+// The section currently open, if any, and the longest one closed so far.
+// Only touched with interrupts off.
+static uint8_t section_open = 0;
+static uint64_t section_start;
+static uint32_t section_site;
+static irqsoff_t irqsoff_max;
+
+// These sit underneath cli() and sti(), so they use the instructions
+// directly.
+void irqsoff_cli_at(void *site)
+{
+    uint32_t flags = read_eflags();
+    asm volatile("cli");
+    if (flags & EFLAGS_IF)
+    {
+        section_open = 1;
+        section_site = (uint32_t)site;
+        section_start = rdtsc();
+    }
+}
+
+void irqsoff_sti_at(void *site)
+{
+    if (read_eflags() & EFLAGS_IF)
+    {
+        // Turned on behind our back (by an iret), so whatever was open
+        // is stale.
+        section_open = 0;
+        return;
+    }
+    if (section_open)
+    {
+        uint64_t cycles = rdtsc() - section_start;
+        section_open = 0;
+        irqsoff_max.sections++;
+        if (cycles > irqsoff_max.cycles)
+        {
+            irqsoff_max.cycles = cycles;
+            irqsoff_max.begin_site = section_site;
+            irqsoff_max.end_site = (uint32_t)site;
+        }
+    }
+    asm volatile("sti");
+}
+
+void irqsoff_cli()
+{
+    irqsoff_cli_at(__builtin_return_address(0));
+}
+
+void irqsoff_sti()
+{
+    irqsoff_sti_at(__builtin_return_address(0));
+}
+
+void irqsoff_enter()
+{
+    section_open = 0;
+}
+
+int irqsoff_get(irqsoff_t *out)
+{
+    uint32_t flags = irq_save();
+    int ok = user_ptr_ok(out, sizeof(irqsoff_t), 1);
+    if (ok)
+        memcpy(out, &irqsoff_max, sizeof(irqsoff_t));
+    irq_restore(flags);
+    return ok ? 0 : -1;
+}
+
+#else
+
+int irqsoff_get(irqsoff_t *out)
+{
+    (void)out;
+    return -1;
+}
+
+#endif // IRQSOFF_TRACE
+
+// Reads the live histogram a bucket at a time, so it may be a few samples
+// ahead of the counts printed above it.
+static void dump_hist(const char *name, const uint32_t *hist)
+{
+    serial_write("  ");
+    serial_write(name);
+    int i;
+    for (i = 0; i < IRQSTAT_BUCKETS; i++)
+    {
+        uint32_t n = hist[i];
+        if (!n)
+            continue;
+        serial_write(" 2^");
+        serial_write_dec(i);
+        serial_put(':');
+        serial_write_dec(n);
+    }
+    serial_put('\n');
+}
+
+void irqstat_dump()
+{
+    serial_write("irqstat: vector count avg_cycles max_cycles max_masked\n");
+    int v;
+    for (v = 0; v < 256; v++)
+    {
+        // Only the totals are copied; the whole irqstat_t is too big for a
+        // kernel stack frame.
+        irqstat_t *s = &irqstats[v];
+        uint32_t flags = irq_save();
+        uint32_t count = s->count;
+        uint32_t masked_count = s->masked_count;
+        uint64_t handler_cycles = s->handler_cycles;
+        uint64_t handler_max = s->handler_max;
+        uint64_t masked_max = s->masked_max;
+        irq_restore(flags);
+        if (!count)
+            continue;
+
+        serial_write_dec(v);
+        serial_put(' ');
+        serial_write_dec(count);
+        serial_put(' ');
+        serial_write_dec((uint32_t)udiv64_32(handler_cycles, count));
+        serial_put(' ');
+        serial_write_dec((uint32_t)handler_max);
+        serial_put(' ');
+        serial_write_dec((uint32_t)masked_max);
+        serial_put('\n');
+        dump_hist("handler", s->handler_hist);
+        if (masked_count)
+            dump_hist("masked", s->masked_hist);
+    }
+
+#ifdef IRQSOFF_TRACE
+    uint32_t flags = irq_save();
+    irqsoff_t m = irqsoff_max;
+    irq_restore(flags);
+    serial_write("irqsoff: max ");
+    serial_write_dec((uint32_t)m.cycles);
+    serial_write(" cycles from ");
+    serial_write_hex(m.begin_site);
+    serial_write(" to ");
+    serial_write_hex(m.end_site);
+    serial_write(", ");
+    serial_write_dec(m.sections);
+    serial_write(" sections\n");
+#endif
+}
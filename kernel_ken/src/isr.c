@@ -7,6 +7,10 @@
 #include "common.h"
 #include "isr.h"
 #include "monitor.h"
+#include "task.h"
+#include "softirq.h"
+#include "timer.h"
+#include "irqstat.h"
 
 isr_t interrupt_handlers[256];
 
@@ -15,33 +19,55 @@ void register_interrupt_handler(uint8_t n, isr_t handler)
     interrupt_handlers[n] = handler;
 }
 
-// This gets called from our ASM interrupt handler stub.
-void isr_handler(registers_t regs)
+// This gets called from our ASM interrupt handler stub. The stubs push
+// int_no as a full dword, so it indexes the table as it is.
+void isr_handler(registers_t *regs)
 {
-    // This line is important. When the processor extends the 8-bit interrupt number
-    // to a 32bit value, it sign-extends, not zero extends. So if the most significant
-    // bit (0x80) is set, regs.int_no will be very large (about 0xffffff80).
-    uint8_t int_no = regs.int_no & 0xFF;
-    if (interrupt_handlers[int_no] != 0)
+    uint64_t start = rdtsc();
+#ifdef IRQSOFF_TRACE
+    irqsoff_enter();
+#endif
+    isr_t handler = interrupt_handlers[regs->int_no];
+    if (handler)
     {
-        isr_t handler = interrupt_handlers[int_no];
-        handler(&regs);
+        handler(regs);
+        // A handler that turns interrupts on (a system call) gives no
+        // masked sample, and its time includes any time switched out.
+        uint64_t cycles = rdtsc() - start;
+        irqstat_record(regs->int_no, cycles,
+                       (read_eflags() & EFLAGS_IF) ? 0 : cycles);
     }
     else
     {
         monitor_write("unhandled interrupt: ");
-        monitor_write_hex(int_no);
+        monitor_write_hex(regs->int_no);
         monitor_put('\n');
         for(;;);
     }
 }
 
+// The end of every IRQ: the bottom halves, with interrupts on. The top
+// half or the bottom halves may have made a switch due; this is where it
+// happens. The handler time covers the top half only; interrupts stay
+// masked until the softirqs turn them on, or until the iret.
+static void irq_exit(uint32_t int_no, uint64_t start)
+{
+    uint64_t handled = rdtsc();
+    uint64_t unmasked = do_softirq() ? handled : rdtsc();
+    irqstat_record(int_no, handled - start, unmasked - start);
+    preempt_irq_exit();
+}
+
 // This gets called from our ASM interrupt handler stub.
-void irq_handler(registers_t regs)
+void irq_handler(registers_t *regs)
 {
+    uint64_t start = rdtsc();
+#ifdef IRQSOFF_TRACE
+    irqsoff_enter();
+#endif
     // Send an EOI (end of interrupt) signal to the PICs.
     // If this interrupt involved the slave.
-    if (regs.int_no >= 40)
+    if (regs->int_no >= 40)
     {
         // Send reset signal to slave.
         outb(0xA0, 0x20);
@@ -49,10 +75,22 @@ void irq_handler(registers_t regs)
     // Send reset signal to master. (As well as slave, if necessary).
     outb(0x20, 0x20);
 
-    if (interrupt_handlers[regs.int_no] != 0)
-    {
-        isr_t handler = interrupt_handlers[regs.int_no];
-        handler(&regs);
-    }
+    isr_t handler = interrupt_handlers[regs->int_no];
+    if (handler)
+        handler(regs);
+
+    irq_exit(regs->int_no, start);
+}
 
+// Called from the timer's own stub: it is always on the master PIC, and
+// its handler is known.
+void irq_timer(registers_t *regs)
+{
+    uint64_t start = rdtsc();
+#ifdef IRQSOFF_TRACE
+    irqsoff_enter();
+#endif
+    outb(0x20, 0x20);
+    timer_interrupt(regs);
+    irq_exit(regs->int_no, start);
 }
@@ -5,6 +5,7 @@
 
 #include "kheap.h"
 #include "paging.h"
+#include "task.h"
 
 // end is defined in the linker script.
 extern uint32_t end;
@@ -16,12 +17,18 @@ uint32_t kmalloc_int(uint32_t sz, int align, uint32_t *phys)
 {
     if (kheap != 0)
     {
+        // The heap is shared by every task; it is only ever preempted at
+        // the preemption points in expand().
+        preempt_disable();
         void *addr = alloc(sz, (uint8_t)align, kheap);
         if (phys != 0)
         {
-            page_t *page = get_page((uint32_t)addr, 0, kernel_directory);
-            *phys = page->frame*0x1000 + ((uint32_t)addr&0xFFF);
+            *phys = get_physical((uint32_t)addr, kernel_directory);
         }
+#ifdef KHEAP_TRACE
+        kheap_trace_record(KHEAP_TRACE_ALLOC, (uint32_t)addr, sz, (uint8_t)align);
+#endif
+        preempt_enable();
         return (uint32_t)addr;
     }
     else
@@ -34,7 +41,7 @@ uint32_t kmalloc_int(uint32_t sz, int align, uint32_t *phys)
         }
         if (phys)
         {
-            *phys = placement_address;
+            *phys = VIRT_TO_PHYS(placement_address);
         }
         uint32_t tmp = placement_address;
         placement_address += sz;
@@ -44,7 +51,13 @@ uint32_t kmalloc_int(uint32_t sz, int align, uint32_t *phys)
 
 void kfree(void *p)
 {
+    preempt_disable();
     free(p, kheap);
+#ifdef KHEAP_TRACE
+    if (p)
+        kheap_trace_record(KHEAP_TRACE_FREE, (uint32_t)p, 0, 0);
+#endif
+    preempt_enable();
 }
 
 uint32_t kmalloc_a(uint32_t sz)
@@ -67,6 +80,19 @@ uint32_t kmalloc(uint32_t sz)
     return kmalloc_int(sz, 0, 0);
 }
 
+// Takes a hole out of the index.
+static void remove_hole(header_t *hole, heap_t *heap)
+{
+    uint32_t iterator = 0;
+    while ( (iterator < heap->index.size) &&
+            (lookup_ordered_array(iterator, &heap->index) != (void*)hole) )
+        iterator++;
+
+    // Make sure we actually found the item.
+    ASSERT(iterator < heap->index.size);
+    remove_ordered_array(iterator, &heap->index);
+}
+
 static void expand(uint32_t new_size, heap_t *heap)
 {
     // Sanity check.
@@ -85,14 +111,54 @@ static void expand(uint32_t new_size, heap_t *heap)
     // This should always be on a page boundary.
     uint32_t old_size = heap->end_address-heap->start_address;
 
+    // The heap stays consistent while we map pages past its end, so other
+    // tasks may use it - and grow it - at the preemption points below.
+    // Contracting it would unmap pages we are about to claim, though.
+    heap->growing++;
     uint32_t i = old_size;
     while (i < new_size)
     {
-        alloc_frame( get_page(heap->start_address+i, 1, kernel_directory),
-                     (heap->supervisor)?1:0, (heap->readonly)?0:1);
+        uint32_t addr = heap->start_address+i;
+        if (is_large_page(addr, kernel_directory))
+        {
+            // Already backed by a 4MB page, skip to its end.
+            i = (addr | (LARGE_PAGE_SZ-1)) + 1 - heap->start_address;
+            continue;
+        }
+        // Kernel page tables are shared and fixed, so growth is in 4KB pages.
+        map_kernel_page(addr, (heap->supervisor)?1:0, (heap->readonly)?0:1);
         i += 0x1000 /* page size */;
+        preempt_point();
+    }
+    heap->growing--;
+
+    // Someone else may have claimed the space already.
+    uint32_t new_end = heap->start_address+new_size;
+    if (new_end <= heap->end_address)
+        return;
+
+    // Add the new space to the hole at the end, or make it a new hole.
+    footer_t *footer = (footer_t*) (heap->end_address - sizeof(footer_t));
+    header_t *header;
+    if (footer->magic == HEAP_MAGIC && footer->header->is_hole)
+    {
+        // Re-sort the hole as it grows.
+        header = footer->header;
+        remove_hole(header, heap);
+        header->size += new_end - heap->end_address;
     }
-    heap->end_address = heap->start_address+new_size;
+    else
+    {
+        header = (header_t*)heap->end_address;
+        header->magic = HEAP_MAGIC;
+        header->is_hole = 1;
+        header->size = new_end - heap->end_address;
+    }
+    insert_ordered_array((void*)header, &heap->index);
+    footer = (footer_t*) (new_end - sizeof(footer_t));
+    footer->magic = HEAP_MAGIC;
+    footer->header = header;
+    heap->end_address = new_end;
 }
 
 static uint32_t contract(uint32_t new_size, heap_t *heap)
@@ -101,9 +167,9 @@ static uint32_t contract(uint32_t new_size, heap_t *heap)
     ASSERT(new_size < heap->end_address-heap->start_address);
 
     // Get the nearest following page boundary.
-    if (new_size&0x1000)
+    if (new_size&0xFFF)
     {
-        new_size &= 0x1000;
+        new_size &= 0xFFFFF000;
         new_size += 0x1000;
     }
 
@@ -112,10 +178,12 @@ static uint32_t contract(uint32_t new_size, heap_t *heap)
         new_size = HEAP_MIN_SIZE;
 
     uint32_t old_size = heap->end_address-heap->start_address;
+    if (new_size >= old_size)
+        return old_size;
     uint32_t i = old_size - 0x1000;
     while (new_size < i)
     {
-        free_frame(get_page(heap->start_address+i, 0, kernel_directory));
+        unmap_kernel_page(heap->start_address+i);
         i -= 0x1000;
     }
 
@@ -123,6 +191,18 @@ static uint32_t contract(uint32_t new_size, heap_t *heap)
     return new_size;
 }
 
+// Bytes to leave at the start of a hole at 'location' for the data of a
+// block placed after them to be page aligned. Anything left has to be
+// big enough to be a hole of its own.
+static uint32_t align_offset(uint32_t location)
+{
+    uint32_t data = location + sizeof(header_t);
+    uint32_t offset = ((data + 0xFFF) & 0xFFFFF000) - data;
+    if (offset && offset < sizeof(header_t) + sizeof(footer_t))
+        offset += 0x1000 /* page size */;
+    return offset;
+}
+
 static int32_t find_smallest_hole(uint32_t size, uint8_t page_align, heap_t *heap)
 {
     // Find the smallest hole that will fit.
@@ -133,14 +213,10 @@ static int32_t find_smallest_hole(uint32_t size, uint8_t page_align, heap_t *hea
         // If the user has requested the memory be page-aligned
         if (page_align > 0)
         {
-            // Page-align the starting point of this header.
-            uint32_t location = (uint32_t)header;
-            int32_t offset = 0;
-            if (((location+sizeof(header_t)) & 0xFFFFF000) != 0)
-                offset = 0x1000 /* page size */  - (location+sizeof(header_t))%0x1000;
-            int32_t hole_size = (int32_t)header->size - offset;
+            // Skip to where an aligned block could start in this hole.
+            uint32_t offset = align_offset((uint32_t)header);
             // Can we fit now?
-            if (hole_size >= (int32_t)size)
+            if (header->size >= offset && header->size - offset >= size)
                 break;
         }
         else if (header->size >= size)
@@ -185,12 +261,16 @@ heap_t *create_heap(uint32_t start, uint32_t end_addr, uint32_t max, uint8_t sup
     heap->max_address = max;
     heap->supervisor = supervisor;
     heap->readonly = readonly;
+    heap->growing = 0;
 
     // We start off with one large hole in the index.
     header_t *hole = (header_t *)start;
     hole->size = end_addr-start;
     hole->magic = HEAP_MAGIC;
     hole->is_hole = 1;
+    footer_t *hole_footer = (footer_t *) (end_addr - sizeof(footer_t));
+    hole_footer->magic = HEAP_MAGIC;
+    hole_footer->header = hole;
     insert_ordered_array((void*)hole, &heap->index);     
 
     return heap;
@@ -206,85 +286,44 @@ void *alloc(uint32_t size, uint8_t page_align, heap_t *heap)
 
     if (iterator == BAD) // If we didn't find a suitable hole
     {
-        // Save some previous data.
+        // We need to allocate some more space. The new space ends up in
+        // the hole at the end of the heap.
         uint32_t old_length = heap->end_address - heap->start_address;
-        uint32_t old_end_address = heap->end_address;
-
-        // We need to allocate some more space.
         expand(old_length+new_size, heap);
-        uint32_t new_length = heap->end_address-heap->start_address;
-
-        // Find the endmost header. (Not endmost in size, but in location).
-        iterator = 0;
-        // Vars to hold the index of, and value of, the endmost header found so far.
-        uint32_t idx = -1; uint32_t value = 0x0;
-        while (iterator < heap->index.size)
-        {
-            uint32_t tmp = (uint32_t)lookup_ordered_array(iterator, &heap->index);
-            if (tmp > value)
-            {
-                value = tmp;
-                idx = iterator;
-            }
-            iterator++;
-        }
-
-        // If we didn't find ANY headers, we need to add one.
-        if (idx == BAD)
-        {
-            header_t *header = (header_t *)old_end_address;
-            header->magic = HEAP_MAGIC;
-            header->size = new_length - old_length;
-            header->is_hole = 1;
-            footer_t *footer = (footer_t *) (old_end_address + header->size - sizeof(footer_t));
-            footer->magic = HEAP_MAGIC;
-            footer->header = header;
-            insert_ordered_array((void*)header, &heap->index);
-        }
-        else
-        {
-            // The last header needs adjusting.
-            header_t *header = lookup_ordered_array(idx, &heap->index);
-            header->size += new_length - old_length;
-            // Rewrite the footer.
-            footer_t *footer = (footer_t *) ( (uint32_t)header + header->size - sizeof(footer_t) );
-            footer->header = header;
-            footer->magic = HEAP_MAGIC;
-        }
-        // We now have enough space. Recurse, and call the function again.
+        // We now have enough space, unless another task took it while the
+        // heap was growing. Recurse, and call the function again.
         return alloc(size, page_align, heap);
     }
 
     header_t *orig_hole_header = (header_t *)lookup_ordered_array(iterator, &heap->index);
     uint32_t orig_hole_pos = (uint32_t)orig_hole_header;
     uint32_t orig_hole_size = orig_hole_header->size;
-    // Here we work out if we should split the hole we found into two parts.
-    // Is the original hole size - requested hole size less than the overhead for adding a new hole?
-    if (orig_hole_size-new_size < sizeof(header_t)+sizeof(footer_t))
-    {
-        // Then just increase the requested size to the size of the hole we found.
-        size += orig_hole_size-new_size;
-        new_size = orig_hole_size;
-    }
+    // The hole leaves the index; what is left of it goes back in below.
+    remove_ordered_array(iterator, &heap->index);
 
     // If we need to page-align the data, do it now and make a new hole in front of our block.
-    if (page_align && orig_hole_pos&0xFFFFF000)
+    uint32_t offset = page_align ? align_offset(orig_hole_pos) : 0;
+    if (offset)
     {
-        uint32_t new_location   = orig_hole_pos + 0x1000 /* page size */ - (orig_hole_pos&0xFFF) - sizeof(header_t);
         header_t *hole_header = (header_t *)orig_hole_pos;
-        hole_header->size     = 0x1000 /* page size */ - (orig_hole_pos&0xFFF) - sizeof(header_t);
+        hole_header->size     = offset;
         hole_header->magic    = HEAP_MAGIC;
         hole_header->is_hole  = 1;
-        footer_t *hole_footer = (footer_t *) ( (uint32_t)new_location - sizeof(footer_t) );
+        footer_t *hole_footer = (footer_t *) (orig_hole_pos + offset - sizeof(footer_t));
         hole_footer->magic    = HEAP_MAGIC;
         hole_footer->header   = hole_header;
-        orig_hole_pos         = new_location;
-        orig_hole_size        = orig_hole_size - hole_header->size;
+        insert_ordered_array((void*)hole_header, &heap->index);
+        orig_hole_pos        += offset;
+        orig_hole_size       -= offset;
     }
-    else
+
+    // Here we work out if we should split the hole we found into two parts.
+    // Is the original hole size - requested hole size less than the overhead for adding a new hole?
+    if (orig_hole_size-new_size < sizeof(header_t)+sizeof(footer_t))
     {
-        // Else we don't need this hole any more, delete it from the index.
-        remove_ordered_array(iterator, &heap->index);
+        // Then just increase the requested size to the size of the hole we found.
+        size += orig_hole_size-new_size;
+        new_size = orig_hole_size;
     }
 
     // Overwrite the original header...
@@ -336,73 +375,54 @@ void free(void *p, heap_t *heap)
     // Make us a hole.
     header->is_hole = 1;
 
-    // Do we want to add this header into the 'free holes' index?
-    char do_add = 1;
-
     // Unify left
     // If the thing immediately to the left of us is a footer...
     footer_t *test_footer = (footer_t*) ( (uint32_t)header - sizeof(footer_t) );
-    if (test_footer->magic == HEAP_MAGIC &&
+    if ((uint32_t)header > heap->start_address &&
+        test_footer->magic == HEAP_MAGIC &&
         test_footer->header->is_hole == 1)
     {
         uint32_t cache_size = header->size; // Cache our current size.
         header = test_footer->header;     // Rewrite our header with the new one.
         footer->header = header;          // Rewrite our footer to point to the new header.
+        // The index is sorted by size, so take the hole out while it grows;
+        // it goes back in below.
+        remove_hole(header, heap);
         header->size += cache_size;       // Change the size.
-        do_add = 0;                       // Since this header is already in the index, we don't want to add it again.
     }
 
     // Unify right
-    // If the thing immediately to the right of us is a header...
+    // If the thing immediately to the right of us is a header... There is
+    // nothing to the right of the last block, or what is there is left
+    // over from before the heap last contracted.
     header_t *test_header = (header_t*) ( (uint32_t)footer + sizeof(footer_t) );
-    if (test_header->magic == HEAP_MAGIC &&
+    if ((uint32_t)test_header < heap->end_address &&
+        test_header->magic == HEAP_MAGIC &&
         test_header->is_hole)
     {
+        remove_hole(test_header, heap);
         header->size += test_header->size; // Increase our size.
-        test_footer = (footer_t*) ( (uint32_t)test_header + // Rewrite it's footer to point to our header.
-                                    test_header->size - sizeof(footer_t) );
-        footer = test_footer;
-        // Find and remove this header from the index.
-        uint32_t iterator = 0;
-        while ( (iterator < heap->index.size) &&
-                (lookup_ordered_array(iterator, &heap->index) != (void*)test_header) )
-            iterator++;
-
-        // Make sure we actually found the item.
-        ASSERT(iterator < heap->index.size);
-        // Remove it.
-        remove_ordered_array(iterator, &heap->index);
+        footer = (footer_t*) ( (uint32_t)test_header + // Rewrite its footer to point to our header.
+                               test_header->size - sizeof(footer_t) );
+        footer->header = header;
     }
 
-    // If the footer location is the end address, we can contract.
-    if ( (uint32_t)footer+sizeof(footer_t) == heap->end_address)
+    // If the footer location is the end address, we can contract. Keep
+    // room for a header and footer, so the hole always survives, and
+    // don't bother for less than a page.
+    if ( (uint32_t)footer+sizeof(footer_t) == heap->end_address && !heap->growing &&
+         header->size > 0x1000)
     {
         uint32_t old_length = heap->end_address-heap->start_address;
-        uint32_t new_length = contract( (uint32_t)header - heap->start_address, heap);
-        // Check how big we will be after resizing.
-        if (header->size - (old_length-new_length) > 0)
-        {
-            // We will still exist, so resize us.
-            header->size -= old_length-new_length;
-            footer = (footer_t*) ( (uint32_t)header + header->size - sizeof(footer_t) );
-            footer->magic = HEAP_MAGIC;
-            footer->header = header;
-        }
-        else
-        {
-            // We will no longer exist :(. Remove us from the index.
-            uint32_t iterator = 0;
-            while ( (iterator < heap->index.size) &&
-                    (lookup_ordered_array(iterator, &heap->index) != (void*)test_header) )
-                iterator++;
-            // If we didn't find ourselves, we have nothing to remove.
-            if (iterator < heap->index.size)
-                remove_ordered_array(iterator, &heap->index);
-        }
+        uint32_t new_length = contract( (uint32_t)header - heap->start_address +
+                                        sizeof(header_t) + sizeof(footer_t), heap);
+        header->size -= old_length-new_length;
+        footer = (footer_t*) ( (uint32_t)header + header->size - sizeof(footer_t) );
+        footer->magic = HEAP_MAGIC;
+        footer->header = header;
     }
 
-    // If required, add us to the index.
-    if (do_add == 1)
-        insert_ordered_array((void*)header, &heap->index);
+    // Add us to the index.
+    insert_ordered_array((void*)header, &heap->index);
 
 }
@@ -0,0 +1,71 @@
+// kheap_trace.c -- Records kernel heap calls for replay on the host.
+
+#include "kheap.h"
+#include "serial.h"
+
+#ifdef KHEAP_TRACE
+
+static kheap_trace_t trace[KHEAP_TRACE_ENTRIES];
+static volatile uint32_t trace_len = 0;
+static uint32_t trace_dropped = 0;
+
+void kheap_trace_record(uint8_t op, uint32_t ptr, uint32_t size, uint8_t align)
+{
+    // Interrupt handlers do not allocate, so with preemption off nothing
+    // else can get in here.
+    if (trace_len == KHEAP_TRACE_ENTRIES)
+    {
+        trace_dropped++;
+        return;
+    }
+    kheap_trace_t *t = &trace[trace_len];
+    t->tsc = rdtsc();
+    t->ptr = ptr;
+    t->size = size;
+    t->op = op;
+    t->align = align;
+    trace_len++;
+}
+
+void kheap_trace_dump()
+{
+    // Records are never changed once written, so take the count now and
+    // let later calls carry on appending while we write.
+    uint32_t len = trace_len;
+    serial_write("kheap trace: ");
+    serial_write_dec(len);
+    serial_write(" records, ");
+    serial_write_dec(trace_dropped);
+    serial_write(" dropped\n");
+
+    uint32_t i;
+    uint64_t last = len ? trace[0].tsc : 0;
+    for (i = 0; i < len; i++)
+    {
+        kheap_trace_t *t = &trace[i];
+        uint64_t dt = t->tsc - last;
+        last = t->tsc;
+
+        serial_write(t->op == KHEAP_TRACE_ALLOC ? "H a " : "H f ");
+        serial_write_dec(dt > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)dt);
+        serial_put(' ');
+        serial_write_hex(t->ptr);
+        if (t->op == KHEAP_TRACE_ALLOC)
+        {
+            serial_put(' ');
+            serial_write_dec(t->size);
+            serial_write(t->align ? " 1" : " 0");
+        }
+        serial_put('\n');
+    }
+    serial_write("kheap trace: end\n");
+}
+
+#else
+
+void kheap_trace_dump()
+{
+    serial_write("kheap trace: not built in, use KERNEL_DEFS=-DKHEAP_TRACE\n");
+}
+
+#endif // KHEAP_TRACE
@@ -8,6 +8,13 @@
 #include "multiboot.h"
 #include "task.h"
 #include "syscall.h"
+#include "vdata.h"
+#include "fpu.h"
+#include "sched.h"
+#include "workqueue.h"
+#include "serial.h"
+#include "bench.h"
+#include "clock.h"
 
 extern uint32_t placement_address;
 uint32_t initial_esp;
@@ -17,18 +24,43 @@ int kernel_main(struct multiboot *mboot_ptr, uint32_t initial_stack)
     initial_esp = initial_stack;
     // Initialise all the ISRs and segmentation
     init_descriptor_tables();
+    // Enable the FPU/SSE; tasks get their FPU state lazily.
+    initialise_fpu();
     // Initialise the screen (by clearing it)
     monitor_clear();
+    // COM1, for diagnostics such as irqstat_dump().
+    init_serial();
+    // Calibrate the TSC against the PIT while nothing can interrupt it.
+    init_clock();
 
     // Initialise the PIT to 100Hz
-    asm volatile("sti");
+    sti();
     init_timer(50);
 
     // Start paging.
     initialise_paging();
+    // Now the shared data page is mapped, start publishing to it.
+    initialise_vdata(timer_frequency);
+
+    // Pick the scheduler class, e.g. "sched=fair" on the command line.
+    const char *cmdline = 0;
+    if (mboot_ptr->flags & MULTIBOOT_FLAG_CMDLINE)
+        cmdline = (const char*)PHYS_TO_VIRT(mboot_ptr->cmdline);
+    sched_select(cmdline);
 
     // Start multitasking.
     initialise_tasking();
+    // Worker threads for deferred work, such as freeing exited tasks.
+    initialise_workqueues();
+    // The way back in from user mode: int 0x80, and SYSENTER where the
+    // CPU has it.
+    initialise_syscalls();
+
+    // "bench" on the command line: measure, report and power off.
+    if (bench_wanted(cmdline))
+    {
+        bench_run();
+    }
     
             // Create a new process in a new address space which is a clone of this
 
@@ -48,8 +80,6 @@ int kernel_main(struct multiboot *mboot_ptr, uint32_t initial_stack)
         monitor_write_hex(getpid());
         monitor_write("\n============================================================================\n");
 
-    // initialise_syscalls();
-
     // switch_to_user_mode();
 
     // syscall_monitor_write("Hello, user world!\n");
@@ -8,7 +8,7 @@
 #include <stdint.h>
 
 // The VGA framebuffer starts at 0xB8000.
-uint16_t *video_memory = (uint16_t *)0xB8000;
+uint16_t *video_memory = (uint16_t *)PHYS_TO_VIRT(0xB8000);
 // Stores the cursor position.
 uint8_t cursor_x = 0;
 uint8_t cursor_y = 0;
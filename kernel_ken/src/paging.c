@@ -4,6 +4,8 @@
 #include "paging.h"
 #include "kheap.h"
 #include "monitor.h"
+#include "vdata.h"
+#include "task.h"
 
 // The kernel's page directory
 page_directory_t *kernel_directory=0;
@@ -15,11 +17,25 @@ page_directory_t *current_directory=0;
 uint32_t *frames;
 uint32_t nframes;
 
+// Set once CR4.PSE is on.
+uint8_t pse_enabled = 0;
+
+// Frames per 4MB page.
+#define LARGE_FRAMES (LARGE_PAGE_SZ/PAGE_SZ)
+
 // Defined in kheap.c
 extern uint32_t placement_address;
 extern heap_t *kheap;
 
-void copy_page_physical(uint32_t src, uint32_t dest);
+// Defined by the linker script: the start and end of the kernel image.
+extern uint32_t code;
+extern uint32_t end;
+
+// Copies a frame through the kernel mapping of physical memory.
+static void copy_page_physical(uint32_t src, uint32_t dest)
+{
+    memcpy(PHYS_TO_VIRT(dest), PHYS_TO_VIRT(src), PAGE_SZ);
+}
 
 // Function to allocate a frame.
 void alloc_frame(page_t *page, int is_kernel, int is_writeable)
@@ -27,7 +43,9 @@ void alloc_frame(page_t *page, int is_kernel, int is_writeable)
 	uint32_t idx = 0x0;
 	if(page->frame)
 		return;
-		
+
+    // No other task may take the frame between our test and set.
+    preempt_disable();
 	while (idx < nframes)
     {
         if (frames[idx/ARCH] == BAD) // nothing free, exit early.
@@ -43,6 +61,7 @@ void alloc_frame(page_t *page, int is_kernel, int is_writeable)
 		    page->rw = (is_writeable==1)?1:0;
 		    page->user = (is_kernel==1)?0:1;
 		    page->frame = idx;
+		    preempt_enable();
 			return;
         }
     }
@@ -55,8 +74,150 @@ void free_frame(page_t *page)
     if (!page->frame)
         return;
     
-    frames[(page->frame/PAGE_SZ)/ARCH] &= ~(0x1 << (page->frame/PAGE_SZ)%ARCH);
+    // page->frame is already a frame index, as set by alloc_frame.
+    preempt_disable();
+    frames[page->frame/ARCH] &= ~(0x1 << (page->frame%ARCH));
     page->frame = 0x0;
+    page->present = 0;
+    preempt_enable();
+}
+
+// Marks 'count' frames starting at 'frame' as used.
+static void set_frames(uint32_t frame, uint32_t count)
+{
+    uint32_t i;
+    for (i = frame; i < frame + count; i++)
+        frames[i/ARCH] |= (0x1 << (i%ARCH));
+}
+
+static void clear_frames(uint32_t frame, uint32_t count)
+{
+    uint32_t i;
+    for (i = frame; i < frame + count; i++)
+        frames[i/ARCH] &= ~(0x1 << (i%ARCH));
+}
+
+// Finds a free, 4MB aligned run of frames. Returns its first frame or BAD.
+static uint32_t find_large_frame()
+{
+    uint32_t idx, w;
+    for (idx = 0; idx + LARGE_FRAMES <= nframes; idx += LARGE_FRAMES)
+    {
+        for (w = idx/ARCH; w < (idx + LARGE_FRAMES)/ARCH; w++)
+            if (frames[w])
+                break;
+        if (w == (idx + LARGE_FRAMES)/ARCH)
+            return idx;
+    }
+    return BAD;
+}
+
+// Turns on 4MB pages if the CPU has them (CPUID.01h:EDX.PSE, bit 3).
+static void enable_pse()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 3)))
+        return;
+
+    uint32_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r" (cr4));
+    cr4 |= 0x10; // CR4.PSE
+    asm volatile("mov %0, %%cr4" : : "r" (cr4));
+    pse_enabled = 1;
+}
+
+// Turns on global pages if the CPU has them (CPUID.01h:EDX.PGE, bit 13).
+static void enable_pge()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 13)))
+        return;
+
+    uint32_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r" (cr4));
+    cr4 |= 0x80; // CR4.PGE
+    asm volatile("mov %0, %%cr4" : : "r" (cr4));
+}
+
+void map_large_page(uint32_t address, uint32_t phys, int is_kernel, int is_writeable, page_directory_t *dir)
+{
+    uint32_t idx = address / LARGE_PAGE_SZ;
+    ASSERT(!dir->tables[idx]);
+    dir->tablesPhysical[idx] = (phys & ~(LARGE_PAGE_SZ - 1)) | PDE_LARGE | PDE_PRESENT
+                             | ((is_writeable==1)?PDE_RW:0)
+                             | ((is_kernel==1)?0:PDE_USER)
+                             | ((idx >= KERNEL_PDE_START)?PDE_GLOBAL:0);
+}
+
+int alloc_large_page(uint32_t address, int is_kernel, int is_writeable, page_directory_t *dir)
+{
+    uint32_t idx = address / LARGE_PAGE_SZ;
+    // Only an untouched 4MB region can become a 4MB page.
+    if (!pse_enabled || dir->tables[idx] || dir->tablesPhysical[idx])
+        return 0;
+
+    uint32_t frame = find_large_frame();
+    if (frame == BAD)
+        return 0;
+    set_frames(frame, LARGE_FRAMES);
+    map_large_page(address, frame*PAGE_SZ, is_kernel, is_writeable, dir);
+    return 1;
+}
+
+int is_large_page(uint32_t address, page_directory_t *dir)
+{
+    return (dir->tablesPhysical[address / LARGE_PAGE_SZ] & PDE_LARGE) ? 1 : 0;
+}
+
+uint32_t get_physical(uint32_t address, page_directory_t *dir)
+{
+    uint32_t pde = dir->tablesPhysical[address / LARGE_PAGE_SZ];
+    if (pde & PDE_LARGE)
+        return (pde & ~(LARGE_PAGE_SZ - 1)) + (address & (LARGE_PAGE_SZ - 1));
+
+    page_t *page = get_page(address, 0, dir);
+    ASSERT(page && page->frame);
+    return page->frame*PAGE_SZ + (address & (PAGE_SZ - 1));
+}
+
+page_t *map_kernel_page(uint32_t address, int is_kernel, int is_writeable)
+{
+    ASSERT(address >= KERNEL_VBASE);
+    page_t *page = get_page(address, 0, kernel_directory);
+    ASSERT(page);
+    alloc_frame(page, is_kernel, is_writeable);
+    page->global = 1;
+    return page;
+}
+
+void unmap_kernel_page(uint32_t address)
+{
+    page_t *page = get_page(address, 0, kernel_directory);
+    // Pages inside a 4MB page have no page_t and stay resident.
+    if (!page)
+        return;
+    free_frame(page);
+    // A CR3 write no longer drops global pages, so drop this one by hand.
+    asm volatile("invlpg (%0)" : : "r" (address) : "memory");
+}
+
+int user_ptr_ok(const void *p, uint32_t size, int write)
+{
+    uint32_t start = (uint32_t)p;
+    if (!start || start + size < start || start + size > KERNEL_VBASE)
+        return 0;
+    // A fault on user memory from kernel mode is fatal, so every page must
+    // be there already. User memory is always 4KB pages.
+    uint32_t a;
+    for (a = start & ~(PAGE_SZ - 1); a < start + size; a += PAGE_SZ)
+    {
+        page_t *page = get_page(a, 0, current_directory);
+        if (!page || !page->present || !page->user || (write && !page->rw))
+            return 0;
+    }
+    return 1;
 }
 
 void initialise_paging()
@@ -66,7 +227,7 @@ void initialise_paging()
     uint32_t mem_end_page = 0x1000000;
     nframes = mem_end_page / PAGE_SZ;
 
-    frames = (uint32_t*)kmalloc_a(nframes/ARCH);
+    frames = (uint32_t*)kmalloc_a(sizeof(uint32_t)*(nframes/ARCH));
     memset(frames, 0, sizeof(uint32_t)*(nframes/ARCH));
     
     // Let's make a page directory.
@@ -74,46 +235,91 @@ void initialise_paging()
     memset(kernel_directory, 0, sizeof(page_directory_t));
     
     
-    kernel_directory->physicalAddr = (uint32_t)kernel_directory->tablesPhysical;
-    // Map some pages in the kernel heap area.
-    // Here we call get_page but not alloc_frame. This causes page_table_t's 
-    // to be created where necessary. We can't allocate frames yet because they
-    // they need to be identity mapped first below, and yet we can't increase
-    // placement_address between identity mapping and enabling the heap!
-    uint32_t i = KHEAP_START;
-    while (i < KHEAP_START+KHEAP_INITIAL_SIZE)
-    {
-        get_page(i, 1, kernel_directory);
-    	i += PAGE_SZ;
-    }
-
-    // We need to identity map (phys addr = virt addr) from
-    // 0x0 to the end of used memory, so we can access this
-    // transparently, as if paging wasn't enabled.
-    i = 0;
-    while (i < placement_address +PAGE_SZ)
-    {
-        // Kernel code is readable but not writeable from userspace.
-        alloc_frame( get_page(i, 1, kernel_directory), 0, 0);
+    kernel_directory->physicalAddr = VIRT_TO_PHYS(kernel_directory->tablesPhysical);
+
+    // Use 4MB pages for the kernel mapping and the heap if we can. That
+    // needs no page tables for them at all and one TLB entry per 4MB.
+    enable_pse();
+
+    // Map all of physical memory at KERNEL_VBASE, for the kernel only. This
+    // covers the kernel image and everything placement allocated, and lets
+    // us reach any frame.
+    uint32_t i = 0;
+    while (i < mem_end_page)
+    {
+        // The first 4MB holds the kernel image, so it gets 4KB pages, the
+        // rest 4MB ones if we can.
+        if (pse_enabled && i >= LARGE_PAGE_SZ)
+        {
+            map_large_page(KERNEL_VBASE+i, i, 1, 1, kernel_directory);
+            i += LARGE_PAGE_SZ;
+            continue;
+        }
+        page_t *page = get_page(KERNEL_VBASE+i, 1, kernel_directory);
+        page->present = 1;
+        // User threads run kernel code, so the image is readable, but not
+        // writeable, from userspace. Nothing placed after it is. CR0.WP is
+        // clear, so the kernel still writes to it.
+        page->user = (KERNEL_VBASE+i >= (uint32_t)&code && KERNEL_VBASE+i < (uint32_t)&end);
+        page->rw = !page->user;
+        page->global = 1;
+        page->frame = i/PAGE_SZ;
         i += PAGE_SZ;
     }
+    // The user bit must be set at both levels.
+    kernel_directory->tablesPhysical[KERNEL_PDE_START] |= PDE_USER;
 
-    // Now allocate those pages we mapped earlier.
-    i = KHEAP_START; 
-    while (i < KHEAP_START+KHEAP_INITIAL_SIZE)
+    // Back every 4MB stretch the initial heap reaches with a 4MB page where
+    // we can. The kernel page tables are made once, below, and shared, so
+    // this is the only chance: expand() grows into the rest of the last
+    // stretch for free and uses 4KB pages past it. Anything that misses
+    // out gets 4KB pages below. Everything placed before paging is on
+    // lives in the first 4MB (the boot page table maps no more), so keep
+    // the heap out of there.
+    if (pse_enabled)
     {
-        alloc_frame( get_page(i, 1, kernel_directory), 0, 0);
-        i += PAGE_SZ;
+        set_frames(0, LARGE_FRAMES);
+        for (i = KHEAP_START; i < KHEAP_START+KHEAP_INITIAL_SIZE; i += LARGE_PAGE_SZ)
+            alloc_large_page(i, 1, 1, kernel_directory);
+        clear_frames(0, LARGE_FRAMES);
+    }
+
+    // Make every other kernel page table now. Directories copy the kernel
+    // entries when they are made, so a table made later would be missed.
+    for (i = KERNEL_PDE_START; i < 1024; i++)
+    {
+        if (kernel_directory->tablesPhysical[i])
+            continue;
+        uint32_t phys;
+        kernel_directory->tables[i] = (page_table_t*)kmalloc_ap(sizeof(page_table_t), &phys);
+        memset(kernel_directory->tables[i], 0, sizeof(page_table_t));
+        kernel_directory->tablesPhysical[i] = phys | 0x3; // PRESENT, RW.
     }
 
+    // Placement allocation is nearly done: only the heap_t is still to come.
+    // Mark the frames it has used, and check they are all in the boot mapping.
+    ASSERT(VIRT_TO_PHYS(placement_address) + PAGE_SZ <= LARGE_PAGE_SZ);
+    set_frames(0, (VIRT_TO_PHYS(placement_address) + PAGE_SZ + PAGE_SZ - 1) / PAGE_SZ);
+
+    // Now allocate the rest of the initial heap.
+    for (i = KHEAP_START; i < KHEAP_START+KHEAP_INITIAL_SIZE; i += PAGE_SZ)
+        if (!is_large_page(i, kernel_directory))
+            map_kernel_page(i, 1, 1);
+
+    // The shared data page. User-readable, not user-writeable.
+    map_kernel_page(VDATA_ADDR, 0, 0);
+    kernel_directory->tablesPhysical[VDATA_ADDR / LARGE_PAGE_SZ] |= PDE_USER;
+
     // Before we enable paging, we must register our page fault handler.
     register_interrupt_handler(14, page_fault);
 
     // Now, enable paging!
     switch_page_directory(kernel_directory);
+    // The kernel half is the same everywhere, so keep it in the TLB.
+    enable_pge();
 
     // Initialise the kernel heap.
-    kheap = create_heap(KHEAP_START, KHEAP_START+KHEAP_INITIAL_SIZE, 0xCFFFF000, 0, 0);
+    kheap = create_heap(KHEAP_START, KHEAP_START+KHEAP_INITIAL_SIZE, KHEAP_MAX, 1, 0);
 
     current_directory = clone_directory(kernel_directory);
     switch_page_directory(current_directory);
@@ -136,6 +342,10 @@ page_t *get_page(uint32_t address, int make, page_directory_t *dir)
     // Find the page table containing this address.
     uint32_t table_idx = address / 1024;
 
+    // A 4MB page has no page table, and must not be given one.
+    if (dir->tablesPhysical[table_idx] & PDE_LARGE)
+        return 0;
+
     if (dir->tables[table_idx]) // If this table is already assigned
     {
         return &dir->tables[table_idx]->pages[address%1024];
@@ -145,7 +355,12 @@ page_t *get_page(uint32_t address, int make, page_directory_t *dir)
         uint32_t tmp;
         dir->tables[table_idx] = (page_table_t*)kmalloc_ap(sizeof(page_table_t), &tmp);
         memset(dir->tables[table_idx], 0, 0x1000);
-        dir->tablesPhysical[table_idx] = tmp | 0x7; // PRESENT, RW, US.
+        // Kernel tables are the kernel's; the few user-readable pages in
+        // them get PDE_USER by hand.
+        if (table_idx >= KERNEL_PDE_START)
+            dir->tablesPhysical[table_idx] = tmp | 0x3; // PRESENT, RW.
+        else
+            dir->tablesPhysical[table_idx] = tmp | 0x7; // PRESENT, RW, US.
         return &dir->tables[table_idx]->pages[address%1024];
     }
     else
@@ -183,7 +398,7 @@ static page_table_t *clone_table(page_table_t *src, uint32_t *physAddr)
     // Make a new page table, which is page aligned.
     page_table_t *table = (page_table_t*)kmalloc_ap(sizeof(page_table_t), physAddr);
     // Ensure that the new table is blank.
-    memset(table, 0, sizeof(page_directory_t));
+    memset(table, 0, sizeof(page_table_t));
 
     // For every entry in the table...
     int i;
@@ -200,13 +415,14 @@ static page_table_t *clone_table(page_table_t *src, uint32_t *physAddr)
         if (src->pages[i].user)    table->pages[i].user = 1;
         if (src->pages[i].accessed)table->pages[i].accessed = 1;
         if (src->pages[i].dirty)   table->pages[i].dirty = 1;
-        // Physically copy the data across. This function is in process.s.
+        // Physically copy the data across.
         copy_page_physical(src->pages[i].frame*0x1000, table->pages[i].frame*0x1000);
+        preempt_point();
     }
     return table;
 }
 
-page_directory_t *clone_directory(page_directory_t *src)
+page_directory_t *new_directory()
 {
     uint32_t phys;
     // Make a new page directory and obtain its physical address.
@@ -219,27 +435,225 @@ page_directory_t *clone_directory(page_directory_t *src)
 
     // Then the physical address of dir->tablesPhysical is:
     dir->physicalAddr = phys + offset;
+    dir->refcount = 1;
 
-    // Go through each page table. If the page table is in the kernel directory, do not make a new copy.
-    int i;
-    for (i = 0; i < 1024; i++)
+    // The kernel half is the same set of tables in every directory.
+    memcpy(&dir->tables[KERNEL_PDE_START], &kernel_directory->tables[KERNEL_PDE_START],
+           (1024 - KERNEL_PDE_START) * sizeof(page_table_t*));
+    memcpy(&dir->tablesPhysical[KERNEL_PDE_START], &kernel_directory->tablesPhysical[KERNEL_PDE_START],
+           (1024 - KERNEL_PDE_START) * sizeof(uint32_t));
+    return dir;
+}
+
+void copy_to_directory(page_directory_t *dir, uint32_t address, const void *src, uint32_t size)
+{
+    const uint8_t *from = (const uint8_t*)src;
+    while (size)
+    {
+        // Write through the kernel mapping of the frame, one page at a time.
+        uint32_t chunk = MIN(size, PAGE_SZ - (address & (PAGE_SZ - 1)));
+        memcpy(PHYS_TO_VIRT(get_physical(address, dir)), from, chunk);
+        address += chunk;
+        from += chunk;
+        size -= chunk;
+    }
+}
+
+page_directory_t *clone_directory(page_directory_t *src)
+{
+    // Each page is copied whole, without another task getting in; the
+    // copy may only be preempted between pages.
+    preempt_disable();
+    page_directory_t *dir = new_directory();
+    // The clone has the same user stacks and heap as its source.
+    memcpy(dir->stack_slots, src->stack_slots, sizeof(dir->stack_slots));
+    dir->heap_start = src->heap_start;
+    dir->heap_end = src->heap_end;
+    dir->heap_brk = src->heap_brk;
+
+    // Copy every table in the user half.
+    uint32_t i;
+    for (i = 0; i < KERNEL_PDE_START; i++)
     {
         if (!src->tables[i])
             continue;
 
-        if (kernel_directory->tables[i] == src->tables[i])
+        // Copy the table.
+        uint32_t phys;
+        dir->tables[i] = clone_table(src->tables[i], &phys);
+        dir->tablesPhysical[i] = phys | 0x07;
+    }
+    preempt_enable();
+    return dir;
+}
+
+void alloc_user_range(page_directory_t *dir, uint32_t start, uint32_t end)
+{
+    preempt_disable();
+    uint32_t i;
+    for (i = start; i < end; i += PAGE_SZ)
+    {
+        page_t *page = get_page(i, 1, dir);
+        alloc_frame(page, 0 /* User mode */, 1 /* Is writable */);
+        // A fresh frame still holds whatever its last owner left in it.
+        memset(PHYS_TO_VIRT(page->frame*PAGE_SZ), 0, PAGE_SZ);
+        preempt_point();
+    }
+    preempt_enable();
+}
+
+// Frames not in use. Counted rather than kept, as only sbrk asks.
+static uint32_t free_frame_count()
+{
+    uint32_t i, n = 0;
+    for (i = 0; i < nframes / ARCH; i++)
+    {
+        uint32_t w = ~frames[i];
+        while (w)
         {
-            // It's in the kernel, so just use the same pointer.
-            dir->tables[i] = src->tables[i];
-            dir->tablesPhysical[i] = src->tablesPhysical[i];
+            w &= w - 1;
+            n++;
         }
-        else
+    }
+    return n;
+}
+
+
+int pin_user_range(page_directory_t *dir, uint32_t start, uint32_t size)
+{
+    uint32_t a;
+    // User memory is always 4KB pages, so a 4MB page here is not ours.
+    for (a = start & ~(PAGE_SZ - 1); a < start + size; a += PAGE_SZ)
+    {
+        page_t *page = get_page(a, 0, dir);
+        if (!page || !page->present || !page->rw || !page->user ||
+            (page->avail & PAGE_PINNED))
+            return 0;
+    }
+    for (a = start & ~(PAGE_SZ - 1); a < start + size; a += PAGE_SZ)
+        get_page(a, 0, dir)->avail |= PAGE_PINNED;
+    return 1;
+}
+
+void unpin_user_range(page_directory_t *dir, uint32_t start, uint32_t size)
+{
+    uint32_t a;
+    for (a = start & ~(PAGE_SZ - 1); a < start + size; a += PAGE_SZ)
+        get_page(a, 0, dir)->avail &= ~PAGE_PINNED;
+}
+
+int user_range_pinned(page_directory_t *dir, uint32_t start, uint32_t end)
+{
+    uint32_t a;
+    for (a = start & ~(PAGE_SZ - 1); a < end; a += PAGE_SZ)
+    {
+        page_t *page = get_page(a, 0, dir);
+        if (page && (page->avail & PAGE_PINNED))
+            return 1;
+    }
+    return 0;
+}
+
+// Moves the break of 'dir' to 'brk'. The first USER_HEAP_INITIAL_SIZE
+// bytes stay mapped once they are, so a heap working near its start does
+// not keep freeing and mapping the same frames.
+static int set_break(page_directory_t *dir, uint32_t brk)
+{
+    if (brk < dir->heap_start + USER_HEAP_HEADER || brk > USER_HEAP_END)
+        return -1;
+
+    uint32_t end = (brk + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+    uint32_t keep = MAX(end, dir->heap_start + USER_HEAP_INITIAL_SIZE);
+    // No other task may take the frames between the count and the mapping,
+    // or move the break under us.
+    preempt_disable();
+    if (end > dir->heap_end)
+    {
+        if ((end - dir->heap_end) / PAGE_SZ > free_frame_count())
         {
-            // Copy the table.
-            uint32_t phys;
-            dir->tables[i] = clone_table(src->tables[i], &phys);
-            dir->tablesPhysical[i] = phys | 0x07;
+            preempt_enable();
+            return -1;
         }
+        alloc_user_range(dir, dir->heap_end, end);
+        dir->heap_end = end;
     }
-    return dir;
+    else if (keep < dir->heap_end)
+    {
+        // The kernel is still working on memory up there.
+        if (user_range_pinned(dir, keep, dir->heap_end))
+        {
+            preempt_enable();
+            return -1;
+        }
+        uint32_t i;
+        for (i = keep; i < dir->heap_end; i += PAGE_SZ)
+        {
+            free_frame(get_page(i, 0, dir));
+            asm volatile("invlpg (%0)" : : "r" (i) : "memory");
+        }
+        dir->heap_end = keep;
+    }
+    dir->heap_brk = brk;
+    preempt_enable();
+    return 0;
+}
+
+int user_heap_init(page_directory_t *dir)
+{
+    // Two threads of a process may get here at once.
+    preempt_disable();
+    int ret = 0;
+    if (!dir->heap_start)
+    {
+        dir->heap_start = dir->heap_end = dir->heap_brk = USER_HEAP_START;
+        ret = set_break(dir, USER_HEAP_START + USER_HEAP_HEADER);
+        if (ret)
+            dir->heap_start = dir->heap_end = dir->heap_brk = 0;
+    }
+    preempt_enable();
+    return ret;
+}
+
+void *sbrk(int increment)
+{
+    page_directory_t *dir = current_directory;
+    if (user_heap_init(dir))
+        return (void*)-1;
+    uint32_t old = dir->heap_brk;
+    uint32_t brk = old + increment;
+    if ((increment > 0 && brk < old) || (increment < 0 && brk > old))
+        return (void*)-1;
+    if (set_break(dir, brk))
+        return (void*)-1;
+    return (void*)old;
+}
+
+int brk(void *addr)
+{
+    if (user_heap_init(current_directory))
+        return -1;
+    return set_break(current_directory, (uint32_t)addr);
+}
+
+void free_directory(page_directory_t *dir)
+{
+    // The kernel directory is never freed.
+    ASSERT(dir != kernel_directory);
+    uint32_t flags = irq_save();
+    uint32_t refs = --dir->refcount;
+    irq_restore(flags);
+    if (refs > 0)
+        return;
+
+    uint32_t i, j;
+    for (i = 0; i < KERNEL_PDE_START; i++)
+    {
+        if (!dir->tables[i])
+            continue;
+
+        for (j = 0; j < 1024; j++)
+            free_frame(&dir->tables[i]->pages[j]);
+        kfree(dir->tables[i]);
+    }
+    kfree(dir);
 }
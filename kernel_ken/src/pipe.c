@@ -0,0 +1,74 @@
+// pipe.c -- Implements pipes as ring buffers on top of the handle table.
+
+#include "pipe.h"
+#include "handle.h"
+#include "kheap.h"
+
+int pipe_open()
+{
+    pipe_t *pipe = (pipe_t*)kmalloc(sizeof(pipe_t));
+    pipe->head = pipe->count = 0;
+
+    cli();
+    pipe->id = handle_alloc(HANDLE_PIPE, pipe);
+    sti();
+    if (!pipe->id)
+    {
+        kfree(pipe);
+        return PIPE_INVALID;
+    }
+    return pipe->id;
+}
+
+uint32_t pipe_write(int fd, const void *buf, uint32_t nbyte)
+{
+    const uint8_t *src = (const uint8_t*)buf;
+    uint32_t i;
+
+    cli();
+    pipe_t *pipe = lookup_pipe(fd);
+    if (!pipe || nbyte > PIPE_SIZE - pipe->count)
+    {
+        sti();
+        return 0;
+    }
+    for (i = 0; i < nbyte; i++)
+        pipe->buffer[(pipe->head + pipe->count + i) % PIPE_SIZE] = src[i];
+    pipe->count += nbyte;
+    sti();
+    return nbyte;
+}
+
+uint32_t pipe_read(int fd, void *buf, uint32_t nbyte)
+{
+    uint8_t *dst = (uint8_t*)buf;
+    uint32_t i;
+
+    cli();
+    pipe_t *pipe = lookup_pipe(fd);
+    if (!pipe)
+    {
+        sti();
+        return (uint32_t)-1;
+    }
+    nbyte = MIN(nbyte, pipe->count);
+    for (i = 0; i < nbyte; i++)
+        dst[i] = pipe->buffer[(pipe->head + i) % PIPE_SIZE];
+    pipe->head = (pipe->head + nbyte) % PIPE_SIZE;
+    pipe->count -= nbyte;
+    sti();
+    return nbyte;
+}
+
+int pipe_close(int fd)
+{
+    cli();
+    pipe_t *pipe = lookup_pipe(fd);
+    if (pipe)
+    {
+        handle_release(fd);
+        kfree(pipe);
+    }
+    sti();
+    return pipe ? fd : PIPE_INVALID;
+}
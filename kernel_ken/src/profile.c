@@ -0,0 +1,141 @@
+// profile.c -- The sampling profiler. There is one CPU, so there is one
+//              sample buffer, written only from the timer interrupt.
+
+#include "profile.h"
+#include "timer.h"
+#include "paging.h"
+#include "task.h"
+#include "serial.h"
+
+extern volatile task_t *current_task;
+extern page_directory_t *current_directory;
+
+static profile_sample_t samples[PROFILE_SAMPLES];
+static uint32_t nsamples = 0;
+static uint32_t dropped = 0;
+
+static volatile int profiling = 0;
+static uint32_t profile_hz;
+// Timer counts between samples, and when the next one is due.
+static uint64_t period;
+static uint64_t next_sample;
+
+int profile_start(uint32_t hz)
+{
+    if (!hz)
+        hz = PROFILE_DEFAULT_HZ;
+    if (hz > PROFILE_MAX_HZ)
+        return -1;
+
+    uint32_t flags = irq_save();
+    nsamples = 0;
+    dropped = 0;
+    profile_hz = hz;
+    period = TIMER_PIT_HZ / hz;
+    next_sample = timer_now() + period;
+    profiling = 1;
+    irq_restore(flags);
+
+    timer_request(next_sample);
+    return 0;
+}
+
+void profile_stop()
+{
+    profiling = 0;
+}
+
+// Nonzero if the word at 'address' can be read without faulting. The
+// walk runs in an interrupt, so it must not touch anything unmapped.
+static int readable(uint32_t address)
+{
+    if (address & 3)
+        return 0;
+    if (is_large_page(address, current_directory))
+        return 1;
+    page_t *page = get_page(address, 0, current_directory);
+    return page && page->present;
+}
+
+// Follows the saved frame pointers: [ebp] is the caller's ebp and
+// [ebp+4] the return address into the caller. Frames live further up
+// the stack the further out they are, which ends the walk at garbage.
+static uint32_t walk_frames(uint32_t ebp, uint32_t *callers, int user)
+{
+    uint32_t depth = 0;
+    while (depth < PROFILE_DEPTH && ebp && readable(ebp) && readable(ebp + 4))
+    {
+        if (user && ebp + 8 > KERNEL_VBASE)
+            break;
+        uint32_t *frame = (uint32_t*)ebp;
+        if (!frame[1])
+            break;
+        callers[depth++] = frame[1];
+        if (frame[0] <= ebp)
+            break;
+        ebp = frame[0];
+    }
+    return depth;
+}
+
+uint64_t profile_interrupt(registers_t *regs, uint64_t now)
+{
+    if (!profiling)
+        return TIMER_NEVER;
+    if (now < next_sample)
+        return next_sample;
+
+    if (nsamples < PROFILE_SAMPLES)
+    {
+        profile_sample_t *s = &samples[nsamples++];
+        int user = (regs->cs & 3) == 3;
+        s->pid = current_task ? current_task->id : 0;
+        s->flags = user ? PROFILE_USER : 0;
+        s->eip = regs->eip;
+        s->depth = walk_frames(regs->ebp, s->callers, user);
+    }
+    else
+    {
+        dropped++;
+    }
+
+    // Keep to the grid, but never queue up samples we were too late for.
+    next_sample += period;
+    if (next_sample <= now)
+        next_sample = now + period;
+    return next_sample;
+}
+
+void profile_dump()
+{
+    // Stop while we read the buffer; a restart begins a fresh one anyway.
+    int was_profiling = profiling;
+    profiling = 0;
+
+    serial_write("profile: ");
+    serial_write_dec(nsamples);
+    serial_write(" samples, ");
+    serial_write_dec(dropped);
+    serial_write(" dropped, ");
+    serial_write_dec(profile_hz);
+    serial_write(" hz\n");
+
+    uint32_t i, j;
+    for (i = 0; i < nsamples; i++)
+    {
+        profile_sample_t *s = &samples[i];
+        serial_write("P ");
+        serial_write_dec(s->pid);
+        serial_write((s->flags & PROFILE_USER) ? " u " : " k ");
+        serial_write_hex(s->eip);
+        for (j = 0; j < s->depth; j++)
+        {
+            serial_put(' ');
+            serial_write_hex(s->callers[j]);
+        }
+        serial_put('\n');
+    }
+    serial_write("profile: end\n");
+
+    profiling = was_profiling;
+}
@@ -0,0 +1,314 @@
+// ring.c -- Implements submission/completion rings on top of the handle
+//           table. Operations run in order, one at a time, in the context
+//           of whoever works the ring: the process inside ring_enter(), or
+//           the ring's polling thread, which shares its address space.
+
+#include "ring.h"
+#include "handle.h"
+#include "kheap.h"
+#include "task.h"
+#include "clock.h"
+#include "monitor.h"
+#include "pipe.h"
+#include "sem.h"
+#include "syscall.h"
+
+extern page_directory_t *current_directory;
+
+// Every ring, so those of an exiting process can be found. Changed with
+// interrupts off.
+static ring_t *rings = 0;
+
+static int32_t run_op(ring_t *ring, const ring_sqe_t *sqe)
+{
+    const uint32_t *a = sqe->args;
+    uint32_t i;
+    int32_t ret = -1;
+    switch (sqe->opcode)
+    {
+    case RING_OP_NOP:
+        return 0;
+    // The buffers must stay mapped from the check to the copy, so no other
+    // thread of the process may run in between.
+    case RING_OP_WRITE:
+        preempt_disable();
+        if (user_ptr_ok((void*)a[0], a[1], 0))
+        {
+            for (i = 0; i < a[1]; i++)
+                monitor_put(((const char*)a[0])[i]);
+            ret = a[1];
+        }
+        preempt_enable();
+        return ret;
+    case RING_OP_PIPE_WRITE:
+        preempt_disable();
+        if (user_ptr_ok((void*)a[1], a[2], 0))
+            ret = pipe_write(a[0], (const void*)a[1], a[2]);
+        preempt_enable();
+        return ret;
+    case RING_OP_PIPE_READ:
+        preempt_disable();
+        if (user_ptr_ok((void*)a[1], a[2], 1))
+            ret = pipe_read(a[0], (void*)a[1], a[2]);
+        preempt_enable();
+        return ret;
+    case RING_OP_SEM_WAIT:
+        // stop_ring() wakes a polling thread stuck here.
+        return sem_wait_abort(a[0], &ring->closing);
+    case RING_OP_SEM_SIGNAL:
+        return sem_signal(a[0]);
+    case RING_OP_SYSCALL:
+        // A ring must not work or free itself from inside an operation, and
+        // the polling thread must not exit in place of the process.
+        if (a[0] == SYS_ring_setup || a[0] == SYS_ring_enter ||
+            a[0] == SYS_ring_close || a[0] == SYS_exit)
+            return -1;
+        return syscall_call(a[0], a[1], a[2], a[3], a[4], a[5]);
+    default:
+        return -1;
+    }
+}
+
+// Runs up to 'max' submitted operations (0 for no limit) while there is
+// room for their completions. Returns the number run.
+static uint32_t run_ring(ring_t *ring, uint32_t max)
+{
+    ring_shared_t *shared = ring->shared;
+    uint32_t entries = ring->mask + 1;
+    uint32_t tail = shared->sq_tail;
+    barrier();
+    // A tail further ahead than the queue is long is garbage; take nothing.
+    if (tail - ring->sq_head > entries)
+        return 0;
+
+    uint32_t done = 0;
+    while (ring->sq_head != tail && (!max || done < max) && !ring->closing)
+    {
+        if (ring->cq_tail - shared->cq_head >= entries)
+            break;
+
+        // Copy the entry first, so it cannot change while it runs.
+        ring_sqe_t sqe = ring->sq[ring->sq_head & ring->mask];
+        shared->sq_head = ++ring->sq_head;
+
+        ring_cqe_t *cqe = &ring->cq[ring->cq_tail & ring->mask];
+        cqe->user_data = sqe.user_data;
+        cqe->result = run_op(ring, &sqe);
+        barrier();
+        shared->cq_tail = ++ring->cq_tail;
+        done++;
+    }
+    return done;
+}
+
+// Works the ring until it is closed. It polls while submissions keep
+// coming, and once there have been none for idle_ns it sets
+// RING_NEED_WAKEUP and sleeps until ring_enter() wakes it.
+static void ring_poller(void *arg)
+{
+    ring_t *ring = (ring_t*)arg;
+    uint64_t idle_since = clock_ns();
+    while (!ring->closing)
+    {
+        if (run_ring(ring, 0))
+        {
+            idle_since = clock_ns();
+            continue;
+        }
+        if (clock_ns() - idle_since < ring->idle_ns)
+        {
+            yield();
+            continue;
+        }
+
+        // Say we are going to sleep before the last look, so a submission
+        // either shows up in it or sees the flag and wakes us.
+        ring->shared->flags |= RING_NEED_WAKEUP;
+        barrier();
+        cli();
+        if (ring->shared->sq_tail == ring->sq_head && !ring->closing)
+            task_sleep();
+        sti();
+        ring->shared->flags &= ~RING_NEED_WAKEUP;
+        idle_since = clock_ns();
+    }
+}
+
+// Takes a ring out of use: its id goes, and its polling thread is told to
+// stop. Interrupts must be off.
+static void stop_ring(ring_t *ring)
+{
+    handle_release(ring->id);
+    ring_t **link = &rings;
+    while (*link != ring)
+        link = &(*link)->next;
+    *link = ring->next;
+
+    ring->closing = 1;
+    task_t *poller = ring->poller ? lookup_task(ring->poller) : 0;
+    if (poller)
+        task_wake(poller);
+}
+
+// Frees a stopped ring and hands its memory back to the process.
+static void free_ring(ring_t *ring)
+{
+    // The thread's pid goes when it exits; until then it may be inside an
+    // operation.
+    while (ring->poller && lookup_task(ring->poller))
+        yield();
+    cli();
+    unpin_user_range(ring->dir, (uint32_t)ring->shared, RING_BYTES(ring->mask + 1));
+    sti();
+    kfree(ring);
+}
+
+int ring_setup(void *mem, uint32_t entries, uint32_t poll_idle_us)
+{
+    uint32_t addr = (uint32_t)mem;
+    if (!entries || entries > RING_MAX_ENTRIES || (entries & (entries - 1)))
+        return 0;
+    if ((addr & (PAGE_SZ - 1)) || !user_ptr_ok(mem, RING_BYTES(entries), 1))
+        return 0;
+
+    ring_t *ring = (ring_t*)kmalloc(sizeof(ring_t));
+    memset(ring, 0, sizeof(ring_t));
+    ring->shared = (ring_shared_t*)mem;
+    ring->sq = (ring_sqe_t*)(ring->shared + 1);
+    ring->cq = (ring_cqe_t*)(ring->sq + entries);
+    ring->mask = entries - 1;
+    ring->dir = current_directory;
+
+    // The ring is worked for as long as it lives, so unlike a one-off copy
+    // out the memory must be there up front and stay there.
+    cli();
+    if (!pin_user_range(current_directory, addr, RING_BYTES(entries)))
+    {
+        sti();
+        kfree(ring);
+        return 0;
+    }
+    ring->id = handle_alloc(HANDLE_RING, ring);
+    if (ring->id)
+    {
+        ring->next = rings;
+        rings = ring;
+    }
+    else
+        unpin_user_range(current_directory, addr, RING_BYTES(entries));
+    sti();
+    if (!ring->id)
+    {
+        kfree(ring);
+        return 0;
+    }
+    memset(mem, 0, RING_BYTES(entries));
+    ring->shared->entries = entries;
+
+    if (poll_idle_us)
+    {
+        ring->idle_ns = (uint64_t)poll_idle_us * 1000;
+        ring->poller = thread_create(&ring_poller, ring, 0);
+        if (!ring->poller)
+        {
+            cli();
+            stop_ring(ring);
+            sti();
+            free_ring(ring);
+            return 0;
+        }
+    }
+    return ring->id;
+}
+
+int ring_enter(int id, uint32_t to_submit, uint32_t flags)
+{
+    cli();
+    ring_t *ring = lookup_ring(id);
+    if (!ring || ring->dir != current_directory)
+    {
+        sti();
+        return -1;
+    }
+    if (ring->poller)
+    {
+        task_t *poller = lookup_task(ring->poller);
+        if ((flags & RING_ENTER_WAKEUP) && poller)
+            task_wake(poller);
+        sti();
+        return 0;
+    }
+    if (ring->busy)
+    {
+        sti();
+        return -1;
+    }
+    ring->busy = 1;
+    sti();
+
+    int done = run_ring(ring, to_submit);
+    ring->busy = 0;
+    return done;
+}
+
+int ring_close(int id)
+{
+    cli();
+    ring_t *ring = lookup_ring(id);
+    if (!ring || ring->dir != current_directory || ring->busy)
+    {
+        sti();
+        return 0;
+    }
+    stop_ring(ring);
+    sti();
+    free_ring(ring);
+    return id;
+}
+
+void ring_exit(page_directory_t *dir)
+{
+    for (;;)
+    {
+        cli();
+        ring_t *ring = rings;
+        while (ring && ring->dir != dir)
+            ring = ring->next;
+        if (ring)
+            stop_ring(ring);
+        sti();
+        if (!ring)
+            return;
+        free_ring(ring);
+    }
+}
+
+ring_sqe_t *ring_get_sqe(ring_shared_t *ring)
+{
+    if (ring->sq_fill - ring->sq_head >= ring->entries)
+        return 0;
+    ring_sqe_t *sq = (ring_sqe_t*)(ring + 1);
+    return &sq[ring->sq_fill++ & (ring->entries - 1)];
+}
+
+void ring_submit(ring_shared_t *ring)
+{
+    // The entries must be written before the tail that hands them over.
+    barrier();
+    ring->sq_tail = ring->sq_fill;
+}
+
+ring_cqe_t *ring_peek_cqe(ring_shared_t *ring)
+{
+    if (ring->cq_head == ring->cq_tail)
+        return 0;
+    barrier();
+    ring_cqe_t *cq = (ring_cqe_t*)((ring_sqe_t*)(ring + 1) + ring->entries);
+    return &cq[ring->cq_head & (ring->entries - 1)];
+}
+
+void ring_cqe_seen(ring_shared_t *ring)
+{
+    barrier();
+    ring->cq_head++;
+}
@@ -0,0 +1,43 @@
+// sched.c -- Chooses the scheduler class.
+
+#include "sched.h"
+#include "monitor.h"
+
+// Round-robin within strict priorities, as the kernel always had.
+sched_class_t *sched = &sched_prio;
+
+static sched_class_t *classes[] =
+{
+    &sched_prio,
+    &sched_fair,
+};
+
+#define SCHED_OPTION "sched="
+
+void sched_select(const char *cmdline)
+{
+    if (!cmdline)
+        return;
+    const char *opt = strstr(cmdline, SCHED_OPTION);
+    if (!opt)
+        return;
+    opt += strlen(SCHED_OPTION);
+
+    // The name runs up to the next space or the end of the line.
+    uint32_t len = 0;
+    while (opt[len] && opt[len] != ' ')
+        len++;
+
+    uint32_t i;
+    for (i = 0; i < sizeof(classes)/sizeof(classes[0]); i++)
+    {
+        if (strlen(classes[i]->name) == len && !memcmp(classes[i]->name, opt, len))
+        {
+            sched = classes[i];
+            return;
+        }
+    }
+    monitor_write("Unknown scheduler, keeping ");
+    monitor_write((char*)sched->name);
+    monitor_write("\n");
+}
@@ -0,0 +1,175 @@
+// sched_dl.c -- The deadline scheduler class. Each task gets 'runtime' of
+//               CPU every 'period'; the runnable one with the earliest
+//               absolute deadline runs. A task that has used up its runtime
+//               is throttled until its next period starts, and the timer
+//               is programmed for exactly that moment. There are few such
+//               tasks, so both queues are sorted lists.
+
+#include "sched.h"
+#include "timer.h"
+
+// Runnable tasks by deadline, and throttled ones by release time.
+static task_t *ready = 0;
+static task_t *throttled = 0;
+
+// Sum of runtime/period over all admitted tasks.
+static uint32_t total_util = 0;
+
+static uint32_t util(task_t *task)
+{
+    if (!task->dl_period)
+        return 0;
+    return (uint32_t)udiv64_32(task->dl_runtime << DL_UTIL_SHIFT, (uint32_t)task->dl_period);
+}
+
+// Inserts 'task' into the list at *head, keeping it sorted by *key.
+static void insert_sorted(task_t **head, task_t *task, uint64_t *(*key)(task_t*))
+{
+    while (*head && *key(*head) <= *key(task))
+        head = &(*head)->next;
+    task->next = *head;
+    *head = task;
+}
+
+static int unlink(task_t **head, task_t *task)
+{
+    while (*head && *head != task)
+        head = &(*head)->next;
+    if (!*head)
+        return 0;
+    *head = task->next;
+    task->next = 0;
+    return 1;
+}
+
+static uint64_t *by_deadline(task_t *task) { return &task->dl_abs_deadline; }
+static uint64_t *by_release(task_t *task) { return &task->dl_release; }
+
+// Charges the running task for the time since it was last charged.
+static void charge(task_t *curr, uint64_t now)
+{
+    if (!curr->dl_start)
+        return;
+    curr->dl_budget -= (int64_t)(now - curr->dl_start);
+    curr->dl_start = now;
+}
+
+// Starts a new period for every throttled task whose release time is due.
+static void replenish(uint64_t now)
+{
+    while (throttled && throttled->dl_release <= now)
+    {
+        task_t *task = throttled;
+        throttled = task->next;
+
+        // If we are late, start the period now rather than in the past.
+        if (task->dl_release + task->dl_period <= now)
+            task->dl_release = now;
+        task->dl_budget = task->dl_runtime;
+        task->dl_abs_deadline = task->dl_release + task->dl_deadline;
+        task->dl_release += task->dl_period;
+        insert_sorted(&ready, task, &by_deadline);
+    }
+    if (throttled)
+        timer_request(throttled->dl_release);
+}
+
+static void dl_enqueue(task_t *task)
+{
+    charge(task, timer_now());
+    task->dl_start = 0;
+    if (task->dl_budget <= 0)
+    {
+        // Out of runtime: wait for the next period.
+        insert_sorted(&throttled, task, &by_release);
+        timer_request(task->dl_release);
+    }
+    else
+    {
+        insert_sorted(&ready, task, &by_deadline);
+    }
+}
+
+static void dl_dequeue(task_t *task)
+{
+    if (!unlink(&ready, task))
+        unlink(&throttled, task);
+}
+
+static task_t *dl_pick_next()
+{
+    uint64_t now = timer_now();
+    replenish(now);
+    if (!ready)
+        return 0;
+
+    task_t *task = ready;
+    ready = task->next;
+    task->next = 0;
+    task->dl_start = now;
+    // Come back when its runtime is used up.
+    timer_request(now + task->dl_budget);
+    return task;
+}
+
+static int dl_tick(task_t *curr)
+{
+    uint64_t now = timer_now();
+    replenish(now);
+
+    if (curr->sched_class != &sched_dl)
+        return ready != 0;
+
+    charge(curr, now);
+    if (curr->dl_budget <= 0)
+        return 1;
+    if (ready && ready->dl_abs_deadline < curr->dl_abs_deadline)
+        return 1;
+    timer_request(now + curr->dl_budget);
+    return 0;
+}
+
+static void dl_yield(task_t *curr)
+{
+    // Done for this period.
+    charge(curr, timer_now());
+    curr->dl_budget = 0;
+}
+
+int sched_dl_admit(task_t *task, uint64_t runtime, uint64_t deadline, uint64_t period)
+{
+    if (!runtime || runtime > deadline || deadline > period || period > 0xFFFFFFFF)
+        return 0;
+
+    uint32_t old_util = (task->sched_class == &sched_dl) ? util(task) : 0;
+    uint32_t new_util = (uint32_t)udiv64_32(runtime << DL_UTIL_SHIFT, (uint32_t)period);
+    if (total_util - old_util + new_util > DL_UTIL_MAX)
+        return 0;
+    total_util = total_util - old_util + new_util;
+
+    uint64_t now = timer_now();
+    task->dl_runtime = runtime;
+    task->dl_deadline = deadline;
+    task->dl_period = period;
+    task->dl_budget = runtime;
+    task->dl_abs_deadline = now + deadline;
+    task->dl_release = now + period;
+    task->dl_start = 0;
+    return 1;
+}
+
+void sched_dl_leave(task_t *task)
+{
+    total_util -= util(task);
+    task->dl_runtime = task->dl_deadline = task->dl_period = 0;
+}
+
+sched_class_t sched_dl =
+{
+    .name = "deadline",
+    .enqueue = &dl_enqueue,
+    .dequeue = &dl_dequeue,
+    .pick_next = &dl_pick_next,
+    .tick = &dl_tick,
+    .yield = &dl_yield,
+};
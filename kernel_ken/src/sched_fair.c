@@ -0,0 +1,200 @@
+// sched_fair.c -- The fair-share scheduler class. Every task accumulates
+//                 virtual runtime: TSC cycles on the CPU, scaled down for
+//                 high priorities and up for low ones. The task with the
+//                 least virtual runtime runs next. Runnable tasks are kept
+//                 in an AVL tree ordered by (vruntime, id).
+
+#include "sched.h"
+
+// Weight of a task of each priority, PRIORITY_HIGHEST first. Each step
+// is worth 25% of CPU time against the step below it.
+static const uint32_t weights[PRIORITY_LOWEST - PRIORITY_HIGHEST + 1] =
+{
+    2500, 2000, 1600, 1280, 1024, 819, 655, 524, 419, 335
+};
+#define WEIGHT_DEFAULT 1024
+
+static task_t *root = 0;
+
+// Never goes backwards. New and woken tasks start here, so they cannot
+// claim the CPU for the time they were away.
+static uint64_t min_vruntime = 0;
+
+static int less(task_t *a, task_t *b)
+{
+    if (a->vruntime != b->vruntime)
+        return a->vruntime < b->vruntime;
+    return a->id < b->id;
+}
+
+static int height(task_t *n)
+{
+    return n ? n->tree_height : 0;
+}
+
+static void update_height(task_t *n)
+{
+    n->tree_height = MAX(height(n->tree_left), height(n->tree_right)) + 1;
+}
+
+static task_t *rotate_right(task_t *n)
+{
+    task_t *l = n->tree_left;
+    n->tree_left = l->tree_right;
+    l->tree_right = n;
+    update_height(n);
+    update_height(l);
+    return l;
+}
+
+static task_t *rotate_left(task_t *n)
+{
+    task_t *r = n->tree_right;
+    n->tree_right = r->tree_left;
+    r->tree_left = n;
+    update_height(n);
+    update_height(r);
+    return r;
+}
+
+// Restores the AVL property at 'n' after one of its subtrees changed height
+// by one. Returns the new root of the subtree.
+static task_t *balance(task_t *n)
+{
+    update_height(n);
+    int diff = height(n->tree_left) - height(n->tree_right);
+    if (diff > 1)
+    {
+        if (height(n->tree_left->tree_left) < height(n->tree_left->tree_right))
+            n->tree_left = rotate_left(n->tree_left);
+        return rotate_right(n);
+    }
+    if (diff < -1)
+    {
+        if (height(n->tree_right->tree_right) < height(n->tree_right->tree_left))
+            n->tree_right = rotate_right(n->tree_right);
+        return rotate_left(n);
+    }
+    return n;
+}
+
+static task_t *tree_insert(task_t *n, task_t *task)
+{
+    if (!n)
+        return task;
+    if (less(task, n))
+        n->tree_left = tree_insert(n->tree_left, task);
+    else
+        n->tree_right = tree_insert(n->tree_right, task);
+    return balance(n);
+}
+
+// Unlinks the leftmost node of the subtree 'n' into *min.
+static task_t *remove_min(task_t *n, task_t **min)
+{
+    if (!n->tree_left)
+    {
+        *min = n;
+        return n->tree_right;
+    }
+    n->tree_left = remove_min(n->tree_left, min);
+    return balance(n);
+}
+
+static task_t *tree_remove(task_t *n, task_t *task)
+{
+    if (!n)
+        return 0;
+    if (n == task)
+    {
+        if (!n->tree_right)
+            return n->tree_left;
+        task_t *min;
+        task_t *right = remove_min(n->tree_right, &min);
+        min->tree_left = n->tree_left;
+        min->tree_right = right;
+        return balance(min);
+    }
+    if (less(task, n))
+        n->tree_left = tree_remove(n->tree_left, task);
+    else
+        n->tree_right = tree_remove(n->tree_right, task);
+    return balance(n);
+}
+
+// Charges the running task for the time since it was last charged.
+static void update_curr(task_t *curr)
+{
+    if (!curr->exec_start)
+        return;
+    uint64_t now = rdtsc();
+    uint64_t delta = now - curr->exec_start;
+    curr->vruntime += udiv64_32(delta * WEIGHT_DEFAULT, weights[curr->priority - PRIORITY_HIGHEST]);
+    curr->exec_start = now;
+}
+
+static void fair_enqueue(task_t *task)
+{
+    update_curr(task);
+    task->exec_start = 0;
+    if (task->vruntime < min_vruntime)
+        task->vruntime = min_vruntime;
+
+    task->tree_left = task->tree_right = 0;
+    task->tree_height = 1;
+    root = tree_insert(root, task);
+}
+
+static void fair_dequeue(task_t *task)
+{
+    root = tree_remove(root, task);
+}
+
+static task_t *fair_pick_next()
+{
+    if (!root)
+        return 0;
+
+    task_t *task;
+    root = remove_min(root, &task);
+    if (task->vruntime > min_vruntime)
+        min_vruntime = task->vruntime;
+    task->exec_start = rdtsc();
+    return task;
+}
+
+static int fair_tick(task_t *curr)
+{
+    update_curr(curr);
+    if (!root)
+        return 0;
+
+    task_t *first = root;
+    while (first->tree_left)
+        first = first->tree_left;
+    return first->vruntime < curr->vruntime;
+}
+
+static void fair_yield(task_t *curr)
+{
+    update_curr(curr);
+    if (!root)
+        return;
+
+    // Go behind everyone that is waiting.
+    task_t *last = root;
+    while (last->tree_right)
+        last = last->tree_right;
+    if (curr->vruntime <= last->vruntime)
+        curr->vruntime = last->vruntime + 1;
+}
+
+sched_class_t sched_fair =
+{
+    .name = "fair",
+    .enqueue = &fair_enqueue,
+    .dequeue = &fair_dequeue,
+    .pick_next = &fair_pick_next,
+    .tick = &fair_tick,
+    .yield = &fair_yield,
+};
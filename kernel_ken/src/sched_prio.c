@@ -0,0 +1,91 @@
+// sched_prio.c -- The priority scheduler class: one FIFO per priority, and
+//                 the highest priority that has a task always runs. Tasks
+//                 of equal priority take turns, one tick each.
+
+#include "sched.h"
+
+#define NUM_PRIORITIES (PRIORITY_LOWEST - PRIORITY_HIGHEST + 1)
+
+static task_t *heads[NUM_PRIORITIES];
+static task_t *tails[NUM_PRIORITIES];
+
+// Bit n is set if the queue for priority PRIORITY_HIGHEST+n is not empty.
+static uint32_t nonempty = 0;
+
+static void prio_enqueue(task_t *task)
+{
+    uint32_t q = task->priority - PRIORITY_HIGHEST;
+    task->next = 0;
+    if (tails[q])
+        tails[q]->next = task;
+    else
+        heads[q] = task;
+    tails[q] = task;
+    nonempty |= 0x1 << q;
+}
+
+static void prio_dequeue(task_t *task)
+{
+    uint32_t q = task->priority - PRIORITY_HIGHEST;
+    task_t *prev = 0, *tmp = heads[q];
+    while (tmp && tmp != task)
+    {
+        prev = tmp;
+        tmp = tmp->next;
+    }
+    if (!tmp)
+        return;
+
+    if (prev)
+        prev->next = task->next;
+    else
+        heads[q] = task->next;
+    if (tails[q] == task)
+        tails[q] = prev;
+    if (!heads[q])
+        nonempty &= ~(0x1 << q);
+    task->next = 0;
+}
+
+static task_t *prio_pick_next()
+{
+    if (!nonempty)
+        return 0;
+
+    // The lowest set bit is the highest priority queue with a task in it.
+    uint32_t q;
+    asm("bsf %1, %0" : "=r" (q) : "r" (nonempty));
+
+    task_t *task = heads[q];
+    heads[q] = task->next;
+    if (!heads[q])
+    {
+        tails[q] = 0;
+        nonempty &= ~(0x1 << q);
+    }
+    task->next = 0;
+    return task;
+}
+
+static int prio_tick(task_t *curr)
+{
+    // Every tick ends a time slice.
+    (void)curr;
+    return 1;
+}
+
+static void prio_yield(task_t *curr)
+{
+    // Going to the back of its queue is all a yield needs.
+    (void)curr;
+}
+
+sched_class_t sched_prio =
+{
+    .name = "prio",
+    .enqueue = &prio_enqueue,
+    .dequeue = &prio_dequeue,
+    .pick_next = &prio_pick_next,
+    .tick = &prio_tick,
+    .yield = &prio_yield,
+};
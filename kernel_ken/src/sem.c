@@ -0,0 +1,125 @@
+// sem.c -- Implements counting semaphores on top of the handle table.
+
+#include "sem.h"
+#include "handle.h"
+#include "kheap.h"
+#include "task.h"
+
+extern volatile task_t *current_task;
+
+int sem_open(int n)
+{
+    if (n <= 0)
+        return 0;
+
+    semaphore_t *sem = (semaphore_t*)kmalloc(sizeof(semaphore_t));
+    memset(sem, 0, sizeof(semaphore_t));
+    sem->count = sem->max = n;
+
+    cli();
+    int id = sem->id = handle_alloc(HANDLE_SEM, sem);
+    sti();
+    if (!id)
+        kfree(sem);
+    return id;
+}
+
+int sem_wait(int id)
+{
+    return sem_wait_abort(id, 0);
+}
+
+int sem_wait_abort(int id, volatile int *abort)
+{
+    cli();
+    semaphore_t *sem = lookup_sem(id);
+    if (!sem)
+    {
+        sti();
+        return 0;
+    }
+    // Nobody queued ahead of us can have been passed over: slots only sit
+    // free while the queue is empty.
+    if (sem->count > 0)
+    {
+        sem->count--;
+        sti();
+        return id;
+    }
+
+    sem_waiter_t waiter;
+    waiter.task = (task_t*)current_task;
+    waiter.state = SEM_WAITING;
+    waiter.next = 0;
+    if (sem->tail)
+        sem->tail->next = &waiter;
+    else
+        sem->head = &waiter;
+    sem->tail = &waiter;
+
+    // Go back to sleep if something else woke us before the semaphore
+    // decided.
+    while (waiter.state == SEM_WAITING && !(abort && *abort))
+        task_sleep();
+    if (waiter.state == SEM_WAITING)
+    {
+        // Aborted. The semaphore is still open, or we would have been
+        // told; take ourselves off its queue.
+        sem_waiter_t *prev = 0, *w = sem->head;
+        while (w != &waiter)
+        {
+            prev = w;
+            w = w->next;
+        }
+        if (prev)
+            prev->next = waiter.next;
+        else
+            sem->head = waiter.next;
+        if (sem->tail == &waiter)
+            sem->tail = prev;
+    }
+    sti();
+    return waiter.state == SEM_GRANTED ? id : 0;
+}
+
+int sem_signal(int id)
+{
+    cli();
+    semaphore_t *sem = lookup_sem(id);
+    sem_waiter_t *waiter = sem ? sem->head : 0;
+    if (waiter)
+    {
+        // The slot passes straight on; count stays at 0.
+        sem->head = waiter->next;
+        if (!sem->head)
+            sem->tail = 0;
+        waiter->state = SEM_GRANTED;
+        task_wake(waiter->task);
+    }
+    else if (!sem || sem->count >= sem->max)
+        id = 0;
+    else
+        sem->count++;
+    sti();
+    return id;
+}
+
+int sem_close(int id)
+{
+    cli();
+    semaphore_t *sem = lookup_sem(id);
+    if (sem)
+    {
+        handle_release(id);
+        while (sem->head)
+        {
+            sem_waiter_t *waiter = sem->head;
+            sem->head = waiter->next;
+            waiter->state = SEM_CLOSED;
+            task_wake(waiter->task);
+        }
+        kfree(sem);
+    }
+    sti();
+    return sem ? id : 0;
+}
@@ -0,0 +1,83 @@
+// serial.c -- Writes to the first serial port (a 16550 UART).
+
+#include "serial.h"
+
+// UART registers, as offsets from the port base.
+#define UART_DATA     0   // Data, or the divisor's low byte while DLAB is set.
+#define UART_IER      1   // Interrupt enable, or the divisor's high byte.
+#define UART_FCR      2   // FIFO control.
+#define UART_LCR      3   // Line control.
+#define UART_MCR      4   // Modem control.
+#define UART_LSR      5   // Line status.
+
+#define LCR_8N1       0x03
+#define LCR_DLAB      0x80
+#define MCR_LOOPBACK  0x10
+#define LSR_THR_EMPTY 0x20
+
+static uint8_t serial_ready = 0;
+
+int init_serial()
+{
+    uint16_t port = SERIAL_COM1;
+    outb(port + UART_IER, 0x00);            // No interrupts, we poll.
+    outb(port + UART_LCR, LCR_DLAB);
+    outb(port + UART_DATA, 1);              // Divisor 1: 115200 baud.
+    outb(port + UART_IER, 0);
+    outb(port + UART_LCR, LCR_8N1);
+    outb(port + UART_FCR, 0xC7);            // FIFOs on and cleared, 14 byte threshold.
+
+    // Check the chip is there by sending a byte to ourselves.
+    outb(port + UART_MCR, MCR_LOOPBACK | 0x0F);
+    outb(port + UART_DATA, 0xAE);
+    if (inb(port + UART_DATA) != 0xAE)
+        return 0;
+
+    outb(port + UART_MCR, 0x0F);            // DTR, RTS, OUT1, OUT2.
+    serial_ready = 1;
+    return 1;
+}
+
+void serial_put(char c)
+{
+    if (!serial_ready)
+        return;
+    if (c == '\n')
+        serial_put('\r');
+    while (!(inb(SERIAL_COM1 + UART_LSR) & LSR_THR_EMPTY))
+        ;
+    outb(SERIAL_COM1 + UART_DATA, c);
+}
+
+void serial_write(const char *c)
+{
+    while (*c)
+        serial_put(*c++);
+}
+
+void serial_write_hex(uint32_t n)
+{
+    serial_write("0x");
+    int i;
+    for (i = 28; i > 0; i -= 4)
+        if (n >> i)
+            break;
+    for (; i >= 0; i -= 4)
+    {
+        uint32_t digit = (n >> i) & 0xF;
+        serial_put(digit < 0xA ? '0' + digit : 'a' + digit - 0xA);
+    }
+}
+
+void serial_write_dec(uint32_t n)
+{
+    char buf[11];
+    int i = 0;
+    do
+    {
+        buf[i++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    while (i)
+        serial_put(buf[--i]);
+}
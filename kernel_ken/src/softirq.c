@@ -0,0 +1,62 @@
+// softirq.c -- Runs the bottom halves raised by interrupt handlers.
+
+#include "softirq.h"
+#include "task.h"
+
+softirq_stats_t softirq_stats[NR_SOFTIRQS];
+
+static softirq_handler_t handlers[NR_SOFTIRQS];
+static volatile uint32_t pending = 0;
+// Set while do_softirq() runs, so an interrupt taken meanwhile leaves
+// what it raises to the loop below.
+static volatile int running = 0;
+
+void open_softirq(int nr, softirq_handler_t handler)
+{
+    ASSERT(nr >= 0 && nr < NR_SOFTIRQS);
+    handlers[nr] = handler;
+}
+
+void raise_softirq(int nr)
+{
+    uint32_t flags = irq_save();
+    pending |= 1 << nr;
+    softirq_stats[nr].raised++;
+    irq_restore(flags);
+}
+
+int do_softirq()
+{
+    if (running || !pending)
+        return 0;
+    running = 1;
+    // Whatever task was interrupted stays on the CPU until we are done.
+    preempt_disable();
+
+    int restart = SOFTIRQ_MAX_RESTART;
+    uint32_t todo;
+    while ((todo = pending) && restart--)
+    {
+        pending = 0;
+        sti();
+        int nr;
+        for (nr = 0; nr < NR_SOFTIRQS; nr++)
+        {
+            if (!(todo & (1 << nr)) || !handlers[nr])
+                continue;
+            uint64_t start = rdtsc();
+            handlers[nr]();
+            uint64_t cycles = rdtsc() - start;
+            softirq_stats[nr].runs++;
+            softirq_stats[nr].cycles += cycles;
+            if (cycles > softirq_stats[nr].max_cycles)
+                softirq_stats[nr].max_cycles = cycles;
+        }
+        cli();
+    }
+
+    // Interrupts are off, so this never switches; preempt_irq_exit() does.
+    preempt_enable();
+    running = 0;
+    return 1;
+}
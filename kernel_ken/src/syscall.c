@@ -3,55 +3,144 @@
 
 #include "syscall.h"
 #include "isr.h"
+#include "descriptor_tables.h"
 
 #include "monitor.h"
+#include "task.h"
+#include "group.h"
+#include "irqstat.h"
+#include "profile.h"
+#include "kheap.h"
+#include "bench.h"
+#include "clock.h"
+#include "ring.h"
+#include "sem.h"
+#include "pipe.h"
 
 static void syscall_handler(registers_t *regs);
 
-DEFN_SYSCALL1(monitor_write, 0, const char*);
-DEFN_SYSCALL1(monitor_write_hex, 1, const char*);
-DEFN_SYSCALL1(monitor_write_dec, 2, const char*);
+// User-side wrappers: syscall_<name>(), numbered SYS_<name>.
+#define SYSCALL_DEFN(name, kind, n, ...) DEFN_SYSCALL##n(name, SYS_##name, ##__VA_ARGS__)
+SYSCALL_LIST(SYSCALL_DEFN)
+#undef SYSCALL_DEFN
 
-static void *syscalls[3] =
+// Helpers for the trampolines: the parameter list for 'n' raw arguments, and
+// the call arguments cast back to the declared types.
+#define SC_PARAMS_0 void
+#define SC_PARAMS_1 uint32_t a1
+#define SC_PARAMS_2 SC_PARAMS_1, uint32_t a2
+#define SC_PARAMS_3 SC_PARAMS_2, uint32_t a3
+#define SC_PARAMS_4 SC_PARAMS_3, uint32_t a4
+#define SC_PARAMS_5 SC_PARAMS_4, uint32_t a5
+
+#define SC_ARGS_0()
+#define SC_ARGS_1(T1) (T1)a1
+#define SC_ARGS_2(T1, T2) SC_ARGS_1(T1), (T2)a2
+#define SC_ARGS_3(T1, T2, T3) SC_ARGS_2(T1, T2), (T3)a3
+#define SC_ARGS_4(T1, T2, T3, T4) SC_ARGS_3(T1, T2, T3), (T4)a4
+#define SC_ARGS_5(T1, T2, T3, T4, T5) SC_ARGS_4(T1, T2, T3, T4), (T5)a5
+
+#define SC_RETURN_VOID(call) call; return 0;
+#define SC_RETURN_INT(call) return (uint32_t)(call);
+
+#define SYSCALL_TRAMPOLINE(name, kind, n, ...) \
+static uint32_t sys_##name(SC_PARAMS_##n) \
+{ \
+    SC_RETURN_##kind(name(SC_ARGS_##n(__VA_ARGS__))) \
+}
+SYSCALL_LIST(SYSCALL_TRAMPOLINE)
+#undef SYSCALL_TRAMPOLINE
+
+#define SYSCALL_ENTRY(name, kind, n, ...) \
+    [SYS_##name] = { n, { .fn##n = &sys_##name }, #name },
+const syscall_entry_t syscall_table[NUM_SYSCALLS] =
 {
-    &monitor_write,
-    &monitor_write_hex,
-    &monitor_write_dec,
+    SYSCALL_LIST(SYSCALL_ENTRY)
 };
-uint32_t num_syscalls = 3;
+#undef SYSCALL_ENTRY
+
+uint32_t syscall_counts[NUM_SYSCALLS];
+
+// Until initialise_syscalls() has probed the CPU, use the path that always works.
+void (*syscall_gate)() = &syscall_int80;
+
+// Defined in descriptor_tables.c and syscall.s.
+extern tss_entry_t tss_entry;
+extern void sysenter_entry();
+
+// SYSENTER is advertised by CPUID.01h:EDX.SEP (bit 11). The Pentium Pro sets
+// the bit without implementing the instructions (family 6, model < 3, stepping < 3).
+static int sysenter_supported()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 1)
+        return 0;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 11)))
+        return 0;
+
+    uint32_t family = (eax >> 8) & 0xF;
+    uint32_t model = (eax >> 4) & 0xF;
+    uint32_t stepping = eax & 0xF;
+    if (family == 6 && model < 3 && stepping < 3)
+        return 0;
+    return 1;
+}
 
 void initialise_syscalls()
 {
-    // Register our syscall handler.
+    // Register our syscall handler. int 0x80 stays available even when
+    // SYSENTER is in use.
     register_interrupt_handler (0x80, &syscall_handler);
+
+    if (!sysenter_supported())
+        return;
+
+    // SYSENTER loads CS from the MSR and SS from CS+8; SYSEXIT loads
+    // CS+16 and CS+24 with RPL 3. That matches our GDT layout exactly.
+    wrmsr(IA32_SYSENTER_CS, 0x08);
+    // Point the entry ESP at the TSS esp0 slot rather than at a stack. The
+    // entry stub loads the real kernel stack from there, so a task switch
+    // only has to update the TSS, not the MSR.
+    wrmsr(IA32_SYSENTER_ESP, (uint32_t)&tss_entry.esp0);
+    wrmsr(IA32_SYSENTER_EIP, (uint32_t)&sysenter_entry);
+
+    syscall_gate = &syscall_sysenter;
 }
 
-void syscall_handler(registers_t *regs)
+int syscall_call(uint32_t num, uint32_t p1, uint32_t p2, uint32_t p3, uint32_t p4, uint32_t p5)
 {
     // Firstly, check if the requested syscall number is valid.
-    // The syscall number is found in EAX.
-    if (regs->eax >= num_syscalls)
-        return;
+    if (num >= NUM_SYSCALLS)
+        return -1;
+
+    const syscall_entry_t *entry = &syscall_table[num];
+    syscall_counts[num]++;
 
-    // Get the required syscall location.
-    void *location = syscalls[regs->eax];
-
-    // We don't know how many parameters the function wants, so we just
-    // push them all onto the stack in the correct order. The function will
-    // use all the parameters it wants, and we can pop them all back off afterwards.
-    int ret;
-    asm volatile (" \
-      push %1; \
-      push %2; \
-      push %3; \
-      push %4; \
-      push %5; \
-      call *%6; \
-      pop %%ebx; \
-      pop %%ebx; \
-      pop %%ebx; \
-      pop %%ebx; \
-      pop %%ebx; \
-    " : "=a" (ret) : "r" (regs->edi), "r" (regs->esi), "r" (regs->edx), "r" (regs->ecx), "r" (regs->ebx), "r" (location));
-    regs->eax = ret;
+    // Call the trampoline with exactly the arguments it takes.
+    switch (entry->nargs)
+    {
+    case 0:  return entry->fn.fn0();
+    case 1:  return entry->fn.fn1(p1);
+    case 2:  return entry->fn.fn2(p1, p2);
+    case 3:  return entry->fn.fn3(p1, p2, p3);
+    case 4:  return entry->fn.fn4(p1, p2, p3, p4);
+    default: return entry->fn.fn5(p1, p2, p3, p4, p5);
+    }
+}
+
+int syscall_dispatch(uint32_t num, uint32_t p1, uint32_t p2, uint32_t p3, uint32_t p4, uint32_t p5)
+{
+    // Both entry paths arrive with interrupts off. System calls run with
+    // them on, so they can be preempted like any other kernel code, and
+    // take their own locks where they need them.
+    sti();
+    return syscall_call(num, p1, p2, p3, p4, p5);
+}
+
+void syscall_handler(registers_t *regs)
+{
+    // The syscall number is found in EAX, the arguments in EBX, ECX, EDX, ESI, EDI.
+    regs->eax = syscall_dispatch(regs->eax, regs->ebx, regs->ecx, regs->edx, regs->esi, regs->edi);
 }
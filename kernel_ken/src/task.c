@@ -7,43 +7,97 @@
 #include "paging.h"
 #include "descriptor_tables.h"
 #include "kheap.h"
+#include "vdata.h"
+#include "fpu.h"
+#include "syscall.h"
+#include "handle.h"
+#include "sched.h"
+#include "timer.h"
+#include "group.h"
+#include "workqueue.h"
+#include "umalloc.h"
+#include "ring.h"
 
 // The currently running task.
 volatile task_t *current_task;
 
-// The start of the task linked list.
-volatile task_t *ready_queue;
+// Tasks that have exited but whose memory has not been freed yet.
+static task_t *zombies = 0;
+
+// Set when the running task should be switched out as soon as it can be.
+static volatile int need_resched = 0;
+
+static work_t reap_work;
+
+// Runs when no other task can: nothing is runnable, or every runnable task
+// is in a throttled group. It is in no scheduler class and has no pid.
+static task_t *idle_task = 0;
 
 // Some externs are needed to access members in paging.c...
 extern page_directory_t *kernel_directory;
 extern page_directory_t *current_directory;
 extern void alloc_frame(page_t*,int,int);
 extern uint32_t initial_esp;
-extern uint32_t read_eip();
-extern void perform_task_switch(u32int, u32int, u32int, u32int);
+extern void switch_context(uint32_t *prev_esp, uint32_t next_esp, uint32_t next_cr3);
+extern uint32_t fork_context(uint32_t *child_esp, void (*clone)(void*), void *arg);
+extern void thread_start();
 
-// The next available process ID.
-uint32_t next_pid = 1;
+static task_t *make_thread(page_directory_t *dir, thread_entry_t entry, void *arg,
+                           uint32_t stack_size, uint32_t user_esp);
+static void reap_zombies(void *arg);
+
+static void idle(void *arg)
+{
+    (void)arg;
+    for (;;)
+        asm volatile("hlt");
+}
+
+// Gives 'task' a pid: a handle that finds it again in O(1).
+static int alloc_pid(task_t *task)
+{
+    int pid = handle_alloc(HANDLE_TASK, task);
+    if (!pid)
+        PANIC("No pids left");
+    return pid;
+}
 
 void initialise_tasking()
 {
     // Rather important stuff happening, no interrupts please!
-    asm volatile("cli");
+    cli();
 
-    // Relocate the stack so we know where it is.
-    move_stack((void*)0xE0000000, 0x2000);
+    // Relocate the stack so we know where it is. It goes at the top of the
+    // user half, so that fork() gives the child its own copy of it.
+    move_stack((void*)0xBFFFF000, 0x2000);
 
     // Initialise the first task (kernel task)
-    current_task = ready_queue = (task_t*)kmalloc(sizeof(task_t));
-    current_task->id = next_pid++;
-    current_task->esp = current_task->ebp = 0;
-    current_task->eip = 0;
+    // It is on the CPU, so it is not handed to the scheduler class.
+    current_task = (task_t*)kmalloc(sizeof(task_t));
+    memset((void*)current_task, 0, sizeof(task_t));
+    current_task->id = alloc_pid((task_t*)current_task);
+    current_task->tgid = current_task->id;
+    current_task->state = TASK_RUNNABLE;
+    current_task->priority = PRIORITY_DEFAULT;
+    current_task->sched_class = sched;
+    current_task->esp = 0;
     current_task->page_directory = current_directory;
     current_task->next = 0;
     current_task->kernel_stack = kmalloc_a(KERNEL_STACK_SIZE);
+    current_task->kernel_stack_size = KERNEL_STACK_SIZE;
+    current_task->user_stack = current_task->user_stack_size = 0;
+    current_task->fpu_area = 0;
+    current_task->fpu_state = 0;
+    vdata_set_pid(current_task->id);
+
+    idle_task = make_thread(current_directory, &idle, 0, KERNEL_STACK_SIZE, 0);
+    current_directory->refcount++;
+    handle_release(idle_task->id);
+
+    init_work(&reap_work, &reap_zombies, 0);
 
     // Reenable interrupts.
-    asm volatile("sti");
+    sti();
 }
 
 void move_stack(void *new_stack_start, uint32_t size)
@@ -98,116 +152,475 @@ void move_stack(void *new_stack_start, uint32_t size)
   asm volatile("mov %0, %%ebp" : : "r" (new_base_pointer));
 }
 
+// Maps a stack of 'size' bytes for a user thread into 'dir'. Returns the
+// base of its slot, or 0 if there is no free slot.
+static uint32_t alloc_user_stack(page_directory_t *dir, uint32_t size)
+{
+    uint32_t slot;
+    for (slot = 0; slot < USER_STACK_SLOTS; slot++)
+        if (!(dir->stack_slots[slot/32] & (0x1 << (slot%32))))
+            break;
+    if (slot == USER_STACK_SLOTS)
+        return 0;
+    dir->stack_slots[slot/32] |= 0x1 << (slot%32);
+
+    // The stack sits at the top of its slot and grows down towards the
+    // unmapped bottom of it, which acts as a guard.
+    uint32_t base = USER_STACKS_START + slot*USER_STACK_SLOT;
+    alloc_user_range(dir, base + USER_STACK_SLOT - size, base + USER_STACK_SLOT);
+    return base;
+}
+
+static void free_user_stack(task_t *task)
+{
+    if (!task->user_stack)
+        return;
+
+    page_directory_t *dir = task->page_directory;
+    uint32_t top = task->user_stack + USER_STACK_SLOT;
+    uint32_t i;
+    // Nothing can pin or unpin pages while we look. Pinned pages stay,
+    // along with the slot, so no new stack is laid over them.
+    uint32_t flags = irq_save();
+    int pinned = user_range_pinned(dir, top - task->user_stack_size, top);
+    for (i = top - task->user_stack_size; i < top; i += PAGE_SZ)
+    {
+        page_t *page = get_page(i, 0, dir);
+        if (page->avail & PAGE_PINNED)
+            continue;
+        free_frame(page);
+        // Other directories drop their entries when they are next loaded.
+        if (dir == current_directory)
+            asm volatile("invlpg (%0)" : : "r" (i) : "memory");
+    }
+
+    // Other threads of the process may be taking slots meanwhile.
+    uint32_t slot = (task->user_stack - USER_STACKS_START) / USER_STACK_SLOT;
+    if (!pinned)
+        dir->stack_slots[slot/32] &= ~(0x1 << (slot%32));
+    irq_restore(flags);
+    task->user_stack = 0;
+}
+
+// Frees everything the zombies own. Runs on a workqueue thread, which only
+// gets the CPU once exit() has switched away from the zombie's stack.
+static void reap_zombies(void *arg)
+{
+    (void)arg;
+    cli();
+    task_t *list = zombies;
+    zombies = 0;
+    sti();
+
+    while (list)
+    {
+        task_t *task = list;
+        list = task->next;
+
+        free_user_stack(task);
+        free_directory(task->page_directory);
+        fpu_release(task);
+        kfree((void*)task->kernel_stack);
+        kfree(task);
+    }
+}
+
+// Makes 'next' the running task.
+static void switch_to(task_t *prev, task_t *next)
+{
+    current_task = next;
+
+    // Let user code see the new pid without a syscall.
+    vdata_set_pid(next->id);
+    // Arm the #NM trap unless the new task already owns the FPU.
+    fpu_switch(next);
+
+    // Change our kernel stack over.
+    set_kernel_stack(next->kernel_stack+next->kernel_stack_size);
+
+    // Only reload CR3 (and lose the TLB) if the address space changes.
+    uint32_t cr3 = 0;
+    if (next->page_directory != prev->page_directory)
+    {
+        // Make sure the memory manager knows we've changed page directory.
+        current_directory = next->page_directory;
+        cr3 = current_directory->physicalAddr;
+    }
+
+    // Saves our callee-saved registers on this stack and resumes 'next' from
+    // its own. We return from here when something switches back to us.
+    switch_context(&prev->esp, next->esp, cr3);
+}
+
+// Hands a new task to its scheduler class.
+static void enqueue_task(task_t *task)
+{
+    task->sched_class->enqueue(task);
+}
+
+// Deadline tasks first, then whatever the normal class picks. Tasks of
+// throttled groups are parked as they come up.
+static task_t *pick_next_task()
+{
+    for (;;)
+    {
+        task_t *next = sched_dl.pick_next();
+        if (!next)
+            next = sched->pick_next();
+        if (!next)
+            return idle_task;
+        if (!group_throttled(next))
+            return next;
+        group_park(next);
+    }
+}
+
 void task_switch()
 {
     // If we haven't initialised tasking yet, just return.
     if (!current_task)
         return;
 
-    // Read esp, ebp now for saving later on.
-    uint32_t esp, ebp, eip;
-    asm volatile("mov %%esp, %0" : "=r"(esp));
-    asm volatile("mov %%ebp, %0" : "=r"(ebp));
-
-    // Read the instruction pointer. We do some cunning logic here:
-    // One of two things could have happened when this function exits - 
-    //   (a) We called the function and it returned the EIP as requested.
-    //   (b) We have just switched tasks, and because the saved EIP is essentially
-    //       the instruction after read_eip(), it will seem as if read_eip has just
-    //       returned.
-    // In the second case we need to return immediately. To detect it we put a dummy
-    // value in EAX further down at the end of this function. As C returns values in EAX,
-    // it will look like the return value is this dummy value! (0x12345).
-    eip = read_eip();
-
-    // Have we just switched tasks?
-    if (eip == 0x12345)
+    task_t *prev = (task_t*)current_task;
+    need_resched = 0;
+
+    // Put ourselves back, then take whatever the classes want run now.
+    group_charge(prev);
+    if (prev == idle_task || prev->state == TASK_SLEEPING)
+        ;
+    else if (group_throttled(prev))
+        group_park(prev);
+    else
+        prev->sched_class->enqueue(prev);
+    task_t *next = pick_next_task();
+    // Have the timer stop 'next' when its group's quota runs out.
+    group_tick(next);
+    if (next == prev)
         return;
 
-    // No, we didn't switch tasks. Let's save some register values and switch.
-    current_task->eip = eip;
-    current_task->esp = esp;
-    current_task->ebp = ebp;
-    
-    // Get the next task to run.
-    current_task = current_task->next;
-    // If we fell off the end of the linked list start again at the beginning.
-    if (!current_task) current_task = ready_queue;
+    switch_to(prev, next);
+}
 
-    eip = current_task->eip;
-    esp = current_task->esp;
-    ebp = current_task->ebp;
+void task_sleep()
+{
+    current_task->state = TASK_SLEEPING;
+    task_switch();
+}
 
-    // Make sure the memory manager knows we've changed page directory.
-    current_directory = current_task->page_directory;
+void task_wake(task_t *task)
+{
+    if (task->state != TASK_SLEEPING)
+        return;
+    task->state = TASK_RUNNABLE;
+    enqueue_task(task);
+    // Nothing else wanted the CPU, so don't wait for the next tick.
+    if (current_task == idle_task)
+        need_resched = 1;
+}
 
-    // Change our kernel stack over.
-    set_kernel_stack(current_task->kernel_stack+KERNEL_STACK_SIZE);
-    // Here we:
-    // * Stop interrupts so we don't get interrupted.
-    // * Temporarily put the new EIP location in ECX.
-    // * Load the stack and base pointers from the new task struct.
-    // * Change page directory to the physical address (physicalAddr) of the new directory.
-    // * Put a dummy value (0x12345) in EAX so that above we can recognise that we've just
-    //   switched task.
-    // * Restart interrupts. The STI instruction has a delay - it doesn't take effect until after
-    //   the next instruction.
-    // * Jump to the location in ECX (remember we put the new EIP in there).
-    perform_task_switch(eip, current_directory->physicalAddr, ebp, esp);
+void task_tick(int periodic)
+{
+    if (!current_task)
+        return;
+
+    task_t *curr = (task_t*)current_task;
+    // This runs as a softirq, with interrupts on; unparking a group and
+    // replenishing a deadline task both change run queues that interrupt
+    // handlers may wake tasks onto.
+    uint32_t flags = irq_save();
+    // Quotas, like the deadline class, run on their own timer events.
+    group_charge(curr);
+    group_tick(curr);
+    int resched = group_throttled(curr) || curr == idle_task;
+    // The deadline class runs on its own timer events, not just on ticks.
+    resched |= sched_dl.tick(curr);
+    if (periodic && curr->sched_class != &sched_dl && curr != idle_task)
+        resched |= sched->tick(curr);
+    irq_restore(flags);
+    // The switch itself waits until the interrupted code can be preempted.
+    if (resched)
+        need_resched = 1;
 }
 
-int fork()
+void preempt_disable()
 {
-    // We are modifying kernel structures, and so cannot be interrupted.
-    asm volatile("cli");
+    if (current_task)
+        current_task->preempt_count++;
+}
+
+void preempt_enable()
+{
+    if (!current_task)
+        return;
+    ASSERT(current_task->preempt_count > 0);
+    // Code running with interrupts off has its own reasons not to be
+    // switched out; the switch waits for the next preemption point.
+    if (--current_task->preempt_count == 0 && need_resched && (read_eflags() & EFLAGS_IF))
+    {
+        cli();
+        task_switch();
+        sti();
+    }
+}
+
+void preempt_point()
+{
+    preempt_enable();
+    preempt_disable();
+}
+
+void preempt_irq_exit()
+{
+    if (need_resched && current_task && !current_task->preempt_count)
+        task_switch();
+}
+
+void exit()
+{
+    task_t *task = (task_t*)current_task;
+
+    // The last user thread takes the process' rings with it; their polling
+    // threads would otherwise keep the address space alive for good.
+    if (task->user_stack)
+    {
+        uint32_t flags = irq_save();
+        int last = !--task->page_directory->user_threads;
+        irq_restore(flags);
+        if (last)
+            ring_exit(task->page_directory);
+    }
 
+    cli();
+
+    // We are on the CPU, so not in the scheduler class; just don't go back.
+    if (task->sched_class == &sched_dl)
+        sched_dl_leave(task);
+    group_charge(task);
+    group_leave(task);
+    task_t *next = pick_next_task();
+    group_tick(next);
+
+    // The pid goes at once, so nothing can look up a zombie.
+    handle_release(task->id);
+
+    // We are still running on our own stack and address space, so the
+    // actual freeing is left to reap_zombies(), run by the next task.
+    task->state = TASK_ZOMBIE;
+    task->next = zombies;
+    zombies = task;
+    // Nothing would ever free us.
+    ASSERT(system_wq);
+    queue_work(system_wq, &reap_work);
+
+    switch_to(task, next);
+    PANIC("A zombie was scheduled");
+}
+
+// Called by fork_context() while the child's initial frame is on the stack.
+static void fork_clone(void *arg)
+{
+    task_t *new_task = (task_t*)arg;
+    // Clone the address space, including the stack we are running on.
+    new_task->page_directory = clone_directory(current_directory);
+}
+
+int fork()
+{
     // Take a pointer to this process' task struct for later reference.
     task_t *parent_task = (task_t*)current_task;
 
-    // Clone the address space.
-    page_directory_t *directory = clone_directory(current_directory);
-
     // Create a new process.
     task_t *new_task = (task_t*)kmalloc(sizeof(task_t));
-    new_task->id = next_pid++;
-    new_task->esp = new_task->ebp = 0;
-    new_task->eip = 0;
-    new_task->page_directory = directory;
-    current_task->kernel_stack = kmalloc_a(KERNEL_STACK_SIZE);
+    memset(new_task, 0, sizeof(task_t));
+    new_task->kernel_stack = kmalloc_a(KERNEL_STACK_SIZE);
+
+    // We are modifying kernel structures, and so cannot be interrupted.
+    cli();
+    new_task->id = alloc_pid(new_task);
+    new_task->tgid = new_task->id;
+    new_task->state = TASK_RUNNABLE;
+    new_task->priority = parent_task->priority;
+    // Deadline parameters are not inherited; the child must be admitted itself.
+    new_task->sched_class = sched;
+    group_join(new_task, parent_task->group);
+    new_task->esp = 0;
+    new_task->kernel_stack_size = KERNEL_STACK_SIZE;
+    // The clone copies the user stack of a forking thread along with
+    // everything else, so it is simply part of the child's address space.
+    new_task->user_stack = new_task->user_stack_size = 0;
+    fpu_fork(parent_task, new_task);
     new_task->next = 0;
+    sti();
+
+    // Clone the address space with a switch frame on top of the stack. The
+    // child starts out by returning from fork_context() with 0. The copy
+    // runs with interrupts on and can be preempted between pages.
+    if (!fork_context(&new_task->esp, &fork_clone, new_task))
+    {
+        // We are the child - by convention return 0.
+        return 0;
+    }
 
     // Add it to the end of the ready queue.
-    // Find the end of the ready queue...
-    task_t *tmp_task = (task_t*)ready_queue;
-    while (tmp_task->next)
-        tmp_task = tmp_task->next;
-    // ...And extend it.
-    tmp_task->next = new_task;
-
-    // This will be the entry point for the new process.
-    uint32_t eip = read_eip();
-
-    // We could be the parent or the child here - check.
-    if (current_task == parent_task)
-    {
-        // We are the parent, so set up the esp/ebp/eip for our child.
-        uint32_t esp; asm volatile("mov %%esp, %0" : "=r"(esp));
-        uint32_t ebp; asm volatile("mov %%ebp, %0" : "=r"(ebp));
-        new_task->esp = esp;
-        new_task->ebp = ebp;
-        new_task->eip = eip;
-        // All finished: Reenable interrupts.
-        asm volatile("sti");
-
-        // And by convention return the PID of the child.
-        return new_task->id;
+    cli();
+    enqueue_task(new_task);
+
+    // All finished: Reenable interrupts.
+    sti();
+
+    // And by convention return the PID of the child.
+    return new_task->id;
+}
+
+// Builds a task in 'dir' whose first switch_context lands in thread_start
+// (process.s). thread_start calls entry(arg) - in user mode on the stack at
+// 'user_esp' if that is non-zero - and exits when it returns. The task is
+// in the caller's thread group and not yet on the ready queue.
+static task_t *make_thread(page_directory_t *dir, thread_entry_t entry, void *arg,
+                           uint32_t stack_size, uint32_t user_esp)
+{
+    task_t *parent_task = (task_t*)current_task;
+
+    task_t *new_task = (task_t*)kmalloc(sizeof(task_t));
+    memset(new_task, 0, sizeof(task_t));
+    new_task->id = alloc_pid(new_task);
+    new_task->tgid = parent_task->tgid;
+    new_task->state = TASK_RUNNABLE;
+    new_task->priority = parent_task->priority;
+    new_task->sched_class = sched;
+    group_join(new_task, parent_task->group);
+    new_task->page_directory = dir;
+    new_task->kernel_stack = kmalloc_a(stack_size);
+    new_task->kernel_stack_size = stack_size;
+    new_task->user_stack = new_task->user_stack_size = 0;
+    new_task->fpu_area = 0;
+    new_task->fpu_state = 0;
+    new_task->next = 0;
+
+    // The frame switch_context pops: EFLAGS, EDI, ESI, EBX, EBP, return address.
+    uint32_t *sp = (uint32_t*)(new_task->kernel_stack + stack_size);
+    *--sp = (uint32_t)&thread_start;
+    *--sp = 0;                     // EBP
+    *--sp = (uint32_t)entry;       // EBX
+    *--sp = (uint32_t)arg;         // ESI
+    *--sp = user_esp;              // EDI
+    *--sp = 0x2;                   // EFLAGS, IF clear
+    new_task->esp = (uint32_t)sp;
+
+    return new_task;
+}
+
+int thread_create(thread_entry_t entry, void *arg, uint32_t stack_size)
+{
+    if (!stack_size)
+        stack_size = THREAD_STACK_SIZE;
+
+    cli();
+    task_t *task = make_thread(current_directory, entry, arg, stack_size, 0);
+    current_directory->refcount++;
+    enqueue_task(task);
+    sti();
+    return task->id;
+}
+
+int thread_create_user(thread_entry_t entry, void *arg, uint32_t stack_size)
+{
+    if (!stack_size)
+        stack_size = THREAD_STACK_SIZE;
+    // Whole pages, and no more than a slot minus its guard page.
+    stack_size = (stack_size + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+    if (stack_size > USER_STACK_SLOT - PAGE_SZ)
+        return 0;
+    // The thread may use the user heap, whose state lives in the heap.
+    if (user_heap_init(current_directory))
+        return 0;
+
+    cli();
+    int id = 0;
+    uint32_t user_stack = alloc_user_stack(current_directory, stack_size);
+    if (user_stack)
+    {
+        task_t *task = make_thread(current_directory, entry, arg, KERNEL_STACK_SIZE,
+                                   user_stack + USER_STACK_SLOT);
+        task->user_stack = user_stack;
+        task->user_stack_size = stack_size;
+        current_directory->refcount++;
+        current_directory->user_threads++;
+        enqueue_task(task);
+        id = task->id;
     }
-    else
+    sti();
+    return id;
+}
+
+// Copies the strings in 'args' and then an array pointing at those copies
+// to the top of the stack slot 'user_stack' in 'dir'. Returns the user
+// address of the array, or 0 if it does not fit in SPAWN_ARGS_MAX bytes.
+static uint32_t copy_args(page_directory_t *dir, uint32_t user_stack, char **args)
+{
+    uint32_t argc = 0, size = 0;
+    while (args && args[argc])
+        size += strlen(args[argc++]) + 1;
+    size = (size + 3) & ~3;
+    size += (argc + 1) * sizeof(uint32_t);
+    if (size > SPAWN_ARGS_MAX)
+        return 0;
+
+    uint32_t top = user_stack + USER_STACK_SLOT;
+    uint32_t argv = top - size;
+    uint32_t str = argv + (argc + 1) * sizeof(uint32_t);
+    uint32_t i;
+    for (i = 0; i < argc; i++)
     {
-        // We are the child - by convention return 0.
+        uint32_t len = strlen(args[i]) + 1;
+        copy_to_directory(dir, str, args[i], len);
+        copy_to_directory(dir, argv + i*sizeof(uint32_t), &str, sizeof(uint32_t));
+        str += len;
+    }
+    uint32_t null = 0;
+    copy_to_directory(dir, argv + argc*sizeof(uint32_t), &null, sizeof(uint32_t));
+    return argv;
+}
+
+int spawn(thread_entry_t entry, char **args, int priority)
+{
+    if (priority < PRIORITY_HIGHEST || priority > PRIORITY_LOWEST)
+        return 0;
+
+    // A new address space: the kernel half, one user stack, and a heap.
+    // Nobody else can see it yet, so it is filled in with interrupts on.
+    page_directory_t *dir = new_directory();
+    uint32_t user_stack = alloc_user_stack(dir, THREAD_STACK_SIZE);
+    uint32_t argv = copy_args(dir, user_stack, args);
+    if (!argv)
+    {
+        free_directory(dir);
         return 0;
     }
+    alloc_user_range(dir, USER_HEAP_START, USER_HEAP_START + USER_HEAP_INITIAL_SIZE);
+    dir->heap_start = USER_HEAP_START;
+    dir->heap_brk = USER_HEAP_START + USER_HEAP_HEADER;
+    dir->heap_end = USER_HEAP_START + USER_HEAP_INITIAL_SIZE;
+
+    cli();
+    // The arguments sit at the top of the stack; the stack proper starts below.
+    task_t *task = make_thread(dir, entry, (void*)argv, KERNEL_STACK_SIZE, argv);
+    task->tgid = task->id;
+    task->priority = priority;
+    task->user_stack = user_stack;
+    task->user_stack_size = THREAD_STACK_SIZE;
+    dir->user_threads = 1;
+    enqueue_task(task);
+
+    sti();
+    return task->id;
+}
 
+// A user thread's entry function returns here, still in user mode.
+void thread_user_exit()
+{
+    umalloc_thread_exit();
+    syscall_exit();
 }
 
 int getpid()
@@ -215,10 +628,92 @@ int getpid()
     return current_task->id;
 }
 
+int setpriority(int pid, int new_priority)
+{
+    if (new_priority < PRIORITY_HIGHEST || new_priority > PRIORITY_LOWEST)
+        return 0;
+
+    cli();
+    task_t *task = lookup_task(pid);
+    if (!task)
+    {
+        sti();
+        return 0;
+    }
+    // A queued task is re-queued, so the class files it under the new
+    // priority. A parked or sleeping one is in no class until it is
+    // unthrottled or woken.
+    if (task == current_task || task->state != TASK_RUNNABLE)
+    {
+        task->priority = new_priority;
+    }
+    else
+    {
+        task->sched_class->dequeue(task);
+        task->priority = new_priority;
+        task->sched_class->enqueue(task);
+    }
+    sti();
+    return new_priority;
+}
+
+int sched_setdeadline(int pid, uint32_t runtime_us, uint32_t deadline_us, uint32_t period_us)
+{
+    cli();
+    task_t *task = lookup_task(pid);
+    if (!task)
+    {
+        sti();
+        return 0;
+    }
+
+    // Take it out of its class while we change it. The running task and
+    // parked or sleeping tasks are in none.
+    int queued = (task != current_task && task->state == TASK_RUNNABLE);
+    if (queued)
+        task->sched_class->dequeue(task);
+
+    int ok = 1;
+    if (!runtime_us)
+    {
+        if (task->sched_class == &sched_dl)
+            sched_dl_leave(task);
+        task->sched_class = sched;
+    }
+    else if (sched_dl_admit(task, timer_us_to_counts(runtime_us),
+                            timer_us_to_counts(deadline_us), timer_us_to_counts(period_us)))
+    {
+        task->sched_class = &sched_dl;
+        if (task == current_task)
+            task->dl_start = timer_now();
+    }
+    else
+    {
+        ok = 0;
+    }
+    // Runtime accounting starts over in whichever class it is now in.
+    task->exec_start = 0;
+
+    if (queued)
+        task->sched_class->enqueue(task);
+    else if (task == current_task)
+        task_switch();   // It may no longer be the one that should run.
+    sti();
+    return ok;
+}
+
+void yield()
+{
+    cli();
+    current_task->sched_class->yield((task_t*)current_task);
+    task_switch();
+    sti();
+}
+
 void switch_to_user_mode()
 {
     // Set up our kernel stack.
-    set_kernel_stack(current_task->kernel_stack+KERNEL_STACK_SIZE);
+    set_kernel_stack(current_task->kernel_stack+current_task->kernel_stack_size);
     
     // Set up a stack structure for switching to user mode.
     asm volatile("  \
@@ -1,37 +1,146 @@
 // timer.c -- Initialises the PIT, and handles clock updates.
 //            Written for JamesM's kernel development tutorials.
+//            The PIT runs one-shot: each interrupt programs the next one
+//            for whichever comes first: the next periodic tick, the
+//            earliest event asked for with timer_request(), or the
+//            profiler's next sample. The interrupt only keeps the clock;
+//            the scheduler tick runs as a softirq.
 
 #include "timer.h"
 #include "isr.h"
 #include "monitor.h"
 #include "task.h"
+#include "vdata.h"
+#include "softirq.h"
+#include "profile.h"
+#include "clock.h"
 
 uint32_t tick = 0;
+uint32_t timer_frequency = 0;
 
-static void timer_callback(registers_t *regs)
+// PIT counts from boot to the start of the count now running.
+static uint64_t clock = 0;
+// Length of the count now running.
+static uint32_t programmed = 0;
+// PIT counts between periodic ticks, and when the next one is due.
+static uint32_t tick_counts = 0;
+static uint64_t next_tick = 0;
+// Earliest event asked for since the last interrupt.
+static uint64_t next_request = TIMER_NEVER;
+// Set when a periodic tick has happened that task_tick() has not seen yet.
+static volatile int tick_pending = 0;
+
+// Counts run down since the current count was programmed.
+static uint32_t pit_elapsed()
 {
-    tick++;
-    task_switch();
+    // Read-back: latch channel 0's status and count together. The status
+    // comes out first.
+    outb(0x43, 0xC2);
+    uint8_t status = inb(0x40);
+    uint32_t count = inb(0x40);
+    count |= inb(0x40) << 8;
+    // Once it reaches 0 it wraps and carries on from 0xFFFF, so the count
+    // alone cannot tell a finished count from a fresh one. OUT goes high at
+    // terminal count and stays there until the next count is programmed.
+    if ((status & 0x80) || count > programmed)
+        return programmed;
+    return programmed - count;
 }
 
-void init_timer(uint32_t frequency)
+uint64_t timer_now()
+{
+    // The softirq asks too, and must not see the interrupt move 'clock'
+    // between the two reads.
+    uint32_t flags = irq_save();
+    uint64_t now = clock + pit_elapsed();
+    irq_restore(flags);
+    return now;
+}
+
+// Starts a new one-shot count, ending at 'when'.
+static void pit_program(uint64_t when)
+{
+    clock = timer_now();
+    uint64_t delta = (when > clock) ? when - clock : 0;
+    if (delta < TIMER_MIN_COUNTS)
+        delta = TIMER_MIN_COUNTS;
+    if (delta > 0xFFFF)
+        delta = 0xFFFF;
+    programmed = (uint32_t)delta;
+
+    // Channel 0, lobyte/hibyte, mode 0 (interrupt on terminal count).
+    outb(0x43, 0x30);
+    outb(0x40, (uint8_t)(programmed & 0xFF));
+    outb(0x40, (uint8_t)((programmed>>8) & 0xFF));
+}
+
+void timer_request(uint64_t when)
 {
-    // Firstly, register our timer callback.
-    register_interrupt_handler(IRQ0, &timer_callback);
+    uint32_t flags = irq_save();
+    if (when < next_request)
+    {
+        next_request = when;
+        // Cut the running count short if it would end too late.
+        if (when < clock + programmed)
+            pit_program(when);
+    }
+    irq_restore(flags);
+}
 
-    // The value we send to the PIT is the value to divide it's input clock
-    // (1193180 Hz) by, to get our required frequency. Important to note is
-    // that the divisor must be small enough to fit into 16-bits.
-    uint32_t divisor = 1193180 / frequency;
+uint64_t timer_us_to_counts(uint32_t us)
+{
+    return udiv64_32((uint64_t)us * TIMER_PIT_HZ, 1000000);
+}
 
-    // Send the command byte.
-    outb(0x43, 0x36);
+void timer_interrupt(registers_t *regs)
+{
+    clock += programmed;
+    programmed = 0;
+    if (next_request <= clock)
+        next_request = TIMER_NEVER;
+
+    int periodic = 0;
+    if (clock >= next_tick)
+    {
+        tick++;
+        clock_tick();
+        vdata_tick(tick);
+        // Stay on the grid even if this interrupt was late.
+        next_tick += tick_counts;
+        if (next_tick <= clock)
+            next_tick = clock + tick_counts;
+        periodic = 1;
+    }
+
+    // The profiler samples on interrupts of its own, between ticks.
+    uint64_t sample = profile_interrupt(regs, clock);
+
+    // Arm the next interrupt before we may switch away on the way out.
+    pit_program(MIN(MIN(next_tick, next_request), sample));
+    tick_pending |= periodic;
+    raise_softirq(SOFTIRQ_TIMER);
+}
+
+// Bottom half: lets the scheduler look at the time that has gone by.
+static void timer_softirq()
+{
+    cli();
+    int periodic = tick_pending;
+    tick_pending = 0;
+    sti();
+    task_tick(periodic);
+}
+
+void init_timer(uint32_t frequency)
+{
+    // IRQ0 has a stub of its own that calls timer_interrupt() directly.
+    open_softirq(SOFTIRQ_TIMER, &timer_softirq);
+    timer_frequency = frequency;
 
-    // Divisor has to be sent byte-wise, so split here into upper/lower bytes.
-    uint8_t l = (uint8_t)(divisor & 0xFF);
-    uint8_t h = (uint8_t)( (divisor>>8) & 0xFF );
+    // The number of input clock cycles (1193180 Hz) per tick. A tick longer
+    // than the 16-bit counter can hold is simply made of several counts.
+    tick_counts = TIMER_PIT_HZ / frequency;
 
-    // Send the frequency divisor.
-    outb(0x40, l);
-    outb(0x40, h);
+    next_tick = tick_counts;
+    pit_program(next_tick);
 }
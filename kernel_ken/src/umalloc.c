@@ -0,0 +1,414 @@
+// umalloc.c -- The user heap allocator. Memory comes from sbrk and is
+//              handed out a page run at a time; a page serving a size
+//              class is cut into blocks of that size. A page map records
+//              what every page is used for, so ufree() needs no header.
+//              Everything here runs in user mode, and all its state lives
+//              in the process' own heap, in the header the kernel sets
+//              aside at its start.
+
+#include "umalloc.h"
+#include "paging.h"
+#include "syscall.h"
+#include "vdata.h"
+
+// Page map tag for the first page of a run given out whole; the run's
+// length in pages is kept above it. Small pages are tagged class + 1.
+#define TAG_LARGE 0xFF
+
+typedef struct free_block
+{
+    struct free_block *next;
+} free_block_t;
+
+// A run of free pages, described in its own first page.
+typedef struct run
+{
+    uint32_t pages;
+    struct run *next;
+} run_t;
+
+/**
+   One thread's blocks, by size class. Only its owner touches the lists,
+   so they need no lock; 'owner' only changes under the heap lock.
+**/
+typedef struct
+{
+    volatile int owner;                 // Pid of the thread, 0 if free.
+    free_block_t *free[UMALLOC_CLASSES];
+    uint32_t count[UMALLOC_CLASSES];
+} cache_t;
+
+static const uint16_t class_size[UMALLOC_CLASSES] =
+{
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+/**
+   The allocator's state, in the first USER_HEAP_HEADER bytes of the heap.
+   The kernel hands the header over zeroed, which is unlocked and not yet
+   set up. The kernel image is read-only in user mode, so nothing here may
+   be a static.
+**/
+typedef struct
+{
+    volatile uint32_t lock;
+    volatile int ready;
+
+    // Size class of each 16 byte step of request size.
+    uint8_t size_class[UMALLOC_MAX_SMALL / 16 + 1];
+
+    cache_t caches[UMALLOC_CACHES];
+
+    // Everything below is guarded by the lock.
+    free_block_t *central[UMALLOC_CLASSES];
+    run_t *free_runs;               // Sorted by address.
+    uint32_t top;                   // End of the memory sbrk gave us.
+
+    // Two levels, by 4MB and by page, so only the parts of the address
+    // space in use need a leaf. Leaves are never freed, so lookups need
+    // no lock.
+    uint32_t *pagemap[1024];
+} uheap_t;
+
+// Fails to compile if the header outgrows the room the kernel leaves.
+typedef char uheap_fits[(sizeof(uheap_t) <= USER_HEAP_HEADER) ? 1 : -1];
+
+static uheap_t *const heap = (uheap_t*)USER_HEAP_START;
+
+static void lock()
+{
+    // Whoever holds it is off the CPU; let it run rather than spin out
+    // the rest of our slice.
+    while (__sync_lock_test_and_set(&heap->lock, 1))
+        syscall_yield();
+}
+
+static void unlock()
+{
+    __sync_lock_release(&heap->lock);
+}
+
+// Blocks moved between a cache and the central list at a time.
+static uint32_t batch(int c)
+{
+    return MAX(2, MIN(32, PAGE_SZ / class_size[c]));
+}
+
+static void put_pages(void *p, uint32_t n)
+{
+    run_t *run = (run_t*)p;
+    run_t *prev = 0, *next = heap->free_runs;
+    while (next && next < run)
+    {
+        prev = next;
+        next = next->next;
+    }
+
+    run->pages = n;
+    run->next = next;
+    if (next && (uint8_t*)run + n * PAGE_SZ == (uint8_t*)next)
+    {
+        run->pages += next->pages;
+        run->next = next->next;
+    }
+    if (prev && (uint8_t*)prev + prev->pages * PAGE_SZ == (uint8_t*)run)
+    {
+        prev->pages += run->pages;
+        prev->next = run->next;
+    }
+    else if (prev)
+        prev->next = run;
+    else
+        heap->free_runs = run;
+}
+
+// Asks the kernel for room for at least 'pages' more pages.
+static int grow(uint32_t pages)
+{
+    uint32_t size = MAX(pages * PAGE_SZ, UMALLOC_GROW);
+    uint32_t cur = (uint32_t)syscall_sbrk(0);
+    uint32_t pad = -cur & (PAGE_SZ - 1);
+    if (syscall_sbrk(pad + size) == -1)
+        return 0;
+    heap->top = cur + pad + size;
+    put_pages((void*)(cur + pad), size / PAGE_SZ);
+    return 1;
+}
+
+// Gives back all but UMALLOC_GROW of a free run at the top of the heap
+// once it is UMALLOC_TRIM long, unless something else has moved the break.
+static void trim()
+{
+    run_t *last = heap->free_runs;
+    while (last && last->next)
+        last = last->next;
+    if (!last || (uint32_t)last + last->pages * PAGE_SZ != heap->top ||
+        last->pages * PAGE_SZ < UMALLOC_TRIM)
+        return;
+
+    uint32_t release = last->pages * PAGE_SZ - UMALLOC_GROW;
+    if ((uint32_t)syscall_sbrk(0) != heap->top || syscall_sbrk(-(int)release) == -1)
+        return;
+    last->pages = UMALLOC_GROW / PAGE_SZ;
+    heap->top -= release;
+}
+
+// Takes 'n' pages off the end of the first free run long enough.
+static void *get_pages(uint32_t n)
+{
+    for (;;)
+    {
+        run_t **link;
+        for (link = &heap->free_runs; *link; link = &(*link)->next)
+        {
+            run_t *run = *link;
+            if (run->pages < n)
+                continue;
+            run->pages -= n;
+            if (!run->pages)
+            {
+                *link = run->next;
+                return run;
+            }
+            return (uint8_t*)run + run->pages * PAGE_SZ;
+        }
+        if (!grow(n))
+            return 0;
+    }
+}
+
+// The page map entry for the page holding 'addr'. With 'make', a missing
+// leaf is made; otherwise it is 0.
+static uint32_t *pagemap_entry(uint32_t addr, int make)
+{
+    uint32_t **leaf = &heap->pagemap[addr >> 22];
+    if (!*leaf)
+    {
+        if (!make || !(*leaf = (uint32_t*)get_pages(1)))
+            return 0;
+        memset(*leaf, 0, PAGE_SZ);
+    }
+    return &(*leaf)[(addr >> 12) & 1023];
+}
+
+// Cuts a fresh page into blocks of class 'c' on the central list.
+static int carve(int c)
+{
+    uint8_t *page = (uint8_t*)get_pages(1);
+    if (!page)
+        return 0;
+    uint32_t *entry = pagemap_entry((uint32_t)page, 1);
+    if (!entry)
+    {
+        put_pages(page, 1);
+        return 0;
+    }
+    *entry = c + 1;
+
+    uint32_t size = class_size[c];
+    uint32_t off;
+    for (off = 0; off + size <= PAGE_SZ; off += size)
+    {
+        free_block_t *b = (free_block_t*)(page + off);
+        b->next = heap->central[c];
+        heap->central[c] = b;
+    }
+    return 1;
+}
+
+// Moves up to 'n' blocks of class 'c' between a list and the central one.
+static uint32_t take_central(int c, free_block_t **list, uint32_t n)
+{
+    uint32_t moved = 0;
+    while (moved < n && heap->central[c])
+    {
+        free_block_t *b = heap->central[c];
+        heap->central[c] = b->next;
+        b->next = *list;
+        *list = b;
+        moved++;
+    }
+    return moved;
+}
+
+static void give_central(int c, free_block_t **list, uint32_t n)
+{
+    while (n-- && *list)
+    {
+        free_block_t *b = *list;
+        *list = b->next;
+        b->next = heap->central[c];
+        heap->central[c] = b;
+    }
+}
+
+static void init()
+{
+    uint32_t i;
+    int c = 0;
+    for (i = 0; i <= UMALLOC_MAX_SMALL / 16; i++)
+    {
+        while (class_size[c] < i * 16)
+            c++;
+        heap->size_class[i] = c;
+    }
+    heap->ready = 1;
+}
+
+// The calling thread's cache, claimed on its first call. 0 if every
+// cache is taken.
+static cache_t *my_cache()
+{
+    // The shared data page says who is on the CPU, which can only be us.
+    int pid = vdata_getpid();
+    uint32_t start = (uint32_t)pid % UMALLOC_CACHES;
+    uint32_t i;
+    for (i = 0; i < UMALLOC_CACHES; i++)
+    {
+        cache_t *cache = &heap->caches[(start + i) % UMALLOC_CACHES];
+        if (cache->owner == pid)
+            return cache;
+    }
+
+    cache_t *found = 0;
+    lock();
+    for (i = 0; i < UMALLOC_CACHES && !found; i++)
+    {
+        cache_t *cache = &heap->caches[(start + i) % UMALLOC_CACHES];
+        if (!cache->owner)
+        {
+            cache->owner = pid;
+            found = cache;
+        }
+    }
+    unlock();
+    return found;
+}
+
+static void *alloc_pages(uint32_t size)
+{
+    uint32_t n = MAX(1, (size + PAGE_SZ - 1) / PAGE_SZ);
+    lock();
+    void *p = get_pages(n);
+    if (p)
+    {
+        uint32_t *entry = pagemap_entry((uint32_t)p, 1);
+        if (entry)
+            *entry = (n << 8) | TAG_LARGE;
+        else
+        {
+            put_pages(p, n);
+            p = 0;
+        }
+    }
+    unlock();
+    return p;
+}
+
+void *umalloc(uint32_t size, int page_align)
+{
+    if (!heap->ready)
+    {
+        lock();
+        if (!heap->ready)
+            init();
+        unlock();
+    }
+    if (page_align || size > UMALLOC_MAX_SMALL)
+        return alloc_pages(size);
+
+    int c = heap->size_class[(size + 15) / 16];
+    cache_t *cache = my_cache();
+    free_block_t *b;
+    if (!cache)
+    {
+        lock();
+        b = (heap->central[c] || carve(c)) ? heap->central[c] : 0;
+        if (b)
+            heap->central[c] = b->next;
+        unlock();
+        return b;
+    }
+
+    if (!cache->free[c])
+    {
+        lock();
+        if (heap->central[c] || carve(c))
+            cache->count[c] += take_central(c, &cache->free[c], batch(c));
+        unlock();
+        if (!cache->free[c])
+            return 0;
+    }
+    b = cache->free[c];
+    cache->free[c] = b->next;
+    cache->count[c]--;
+    return b;
+}
+
+void ufree(void *p)
+{
+    if (!p)
+        return;
+    uint32_t *entry = pagemap_entry((uint32_t)p, 0);
+    // Not a block of ours; leave it alone.
+    if (!entry || !*entry)
+        return;
+
+    if ((*entry & 0xFF) == TAG_LARGE)
+    {
+        if ((uint32_t)p & (PAGE_SZ - 1))
+            return;
+        lock();
+        uint32_t n = *entry >> 8;
+        *entry = 0;
+        put_pages(p, n);
+        trim();
+        unlock();
+        return;
+    }
+
+    int c = *entry - 1;
+    free_block_t *b = (free_block_t*)p;
+    cache_t *cache = my_cache();
+    if (!cache)
+    {
+        lock();
+        b->next = heap->central[c];
+        heap->central[c] = b;
+        unlock();
+        return;
+    }
+
+    b->next = cache->free[c];
+    cache->free[c] = b;
+    // Keep at most two batches; the rest may be wanted by other threads.
+    if (++cache->count[c] > 2 * batch(c))
+    {
+        lock();
+        give_central(c, &cache->free[c], batch(c));
+        unlock();
+        cache->count[c] -= batch(c);
+    }
+}
+
+void umalloc_thread_exit()
+{
+    int pid = vdata_getpid();
+    uint32_t i;
+    int c;
+    for (i = 0; i < UMALLOC_CACHES; i++)
+    {
+        cache_t *cache = &heap->caches[i];
+        if (cache->owner != pid)
+            continue;
+        lock();
+        for (c = 0; c < UMALLOC_CLASSES; c++)
+        {
+            give_central(c, &cache->free[c], cache->count[c]);
+            cache->count[c] = 0;
+        }
+        cache->owner = 0;
+        unlock();
+        return;
+    }
+}
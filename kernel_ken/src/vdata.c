@@ -0,0 +1,83 @@
+// vdata.c -- Maintains the shared kernel data page and the user-side
+//            functions that read it.
+
+#include "vdata.h"
+#include "clock.h"
+
+// The page is mapped user-accessible and read-only. CR0.WP is clear, so
+// supervisor writes still go through the same mapping.
+static volatile vdata_t *const vdata = (vdata_t*)VDATA_ADDR;
+
+static uint8_t vdata_ready = 0;
+
+static void write_begin()
+{
+    vdata->seq++;
+    barrier();
+}
+
+static void write_end()
+{
+    barrier();
+    vdata->seq++;
+}
+
+void initialise_vdata(uint32_t tick_hz)
+{
+    memset((void*)vdata, 0, sizeof(vdata_t));
+    vdata->tick_hz = tick_hz;
+    vdata_ready = 1;
+}
+
+void vdata_tick(uint32_t tick)
+{
+    // The timer starts before paging, so early ticks have nowhere to go.
+    if (!vdata_ready)
+        return;
+
+    // Copy the clock's base, just moved up by clock_tick(). Only the TSC
+    // can be read from user mode; on the PIT, readers get tick resolution.
+    const clocksource_t *source = clock_source();
+    uint64_t count, ns;
+    clock_base(&count, &ns);
+
+    write_begin();
+    vdata->tsc_base = count;
+    vdata->ns_base = ns;
+    vdata->tsc_mult = (source->read == &rdtsc) ? source->mult : 0;
+    vdata->tick = tick;
+    write_end();
+}
+
+void vdata_set_pid(int pid)
+{
+    if (!vdata_ready)
+        return;
+    vdata->pid = pid;
+}
+
+int vdata_getpid()
+{
+    return vdata->pid;
+}
+
+uint32_t vdata_ticks()
+{
+    return vdata->tick;
+}
+
+uint64_t vdata_time_ns()
+{
+    uint32_t seq;
+    uint64_t ns;
+    do
+    {
+        seq = vdata->seq;
+        barrier();
+        ns = vdata->ns_base;
+        if (vdata->tsc_mult)
+            ns += ((rdtsc() - vdata->tsc_base) * vdata->tsc_mult) >> VDATA_TSC_SHIFT;
+        barrier();
+    } while ((seq & 1) || seq != vdata->seq);
+    return ns;
+}
@@ -0,0 +1,116 @@
+// workqueue.c -- Implements workqueues and their worker threads.
+
+#include "workqueue.h"
+#include "kheap.h"
+#include "handle.h"
+
+workqueue_t *system_wq = 0;
+workqueue_t *workqueues = 0;
+
+// Workers per queue made by initialise_workqueues().
+#define SYSTEM_WQ_WORKERS 2
+
+static void worker(void *arg)
+{
+    workqueue_t *wq = (workqueue_t*)arg;
+    for (;;)
+    {
+        cli();
+        while (!wq->head)
+            task_sleep();
+        work_t *work = wq->head;
+        wq->head = work->next;
+        if (!wq->head)
+            wq->tail = 0;
+        work->pending = 0;
+        wq->stats.depth--;
+        sti();
+
+        uint64_t start = rdtsc();
+        uint64_t wait = start - work->queued_at;
+        work->func(work->arg);
+        uint64_t cycles = rdtsc() - start;
+
+        cli();
+        wq->stats.done++;
+        wq->stats.wait_cycles += wait;
+        if (wait > wq->stats.max_wait)
+            wq->stats.max_wait = wait;
+        wq->stats.run_cycles += cycles;
+        sti();
+    }
+}
+
+workqueue_t *create_workqueue(const char *name, int nworkers)
+{
+    ASSERT(nworkers > 0 && nworkers <= WQ_MAX_WORKERS);
+
+    workqueue_t *wq = (workqueue_t*)kmalloc(sizeof(workqueue_t));
+    memset(wq, 0, sizeof(workqueue_t));
+    wq->name = name;
+
+    int i;
+    for (i = 0; i < nworkers; i++)
+    {
+        int pid = thread_create(&worker, wq, 0);
+        cli();
+        wq->workers[wq->nworkers++] = lookup_task(pid);
+        sti();
+    }
+
+    cli();
+    wq->next = workqueues;
+    workqueues = wq;
+    sti();
+    return wq;
+}
+
+void initialise_workqueues()
+{
+    system_wq = create_workqueue("system", SYSTEM_WQ_WORKERS);
+}
+
+void init_work(work_t *work, work_func_t func, void *arg)
+{
+    memset(work, 0, sizeof(work_t));
+    work->func = func;
+    work->arg = arg;
+}
+
+int queue_work(workqueue_t *wq, work_t *work)
+{
+    uint32_t flags = irq_save();
+    if (work->pending)
+    {
+        wq->stats.merged++;
+        irq_restore(flags);
+        return 0;
+    }
+
+    work->pending = 1;
+    work->queued_at = rdtsc();
+    work->next = 0;
+    if (wq->tail)
+        wq->tail->next = work;
+    else
+        wq->head = work;
+    wq->tail = work;
+
+    wq->stats.queued++;
+    if (++wq->stats.depth > wq->stats.max_depth)
+        wq->stats.max_depth = wq->stats.depth;
+
+    // One sleeping worker is enough; the others are busy or will see the
+    // item on their way round.
+    int i;
+    for (i = 0; i < wq->nworkers; i++)
+    {
+        if (wq->workers[i]->state == TASK_SLEEPING)
+        {
+            task_wake(wq->workers[i]);
+            break;
+        }
+    }
+    irq_restore(flags);
+    return 1;
+}
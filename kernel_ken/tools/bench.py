@@ -0,0 +1,172 @@
+#!/usr/bin/env python3
+# bench.py -- Boots the kernel headless with "bench" on its command line,
+#             collects the "BENCH <name> <value> <unit>" lines it writes to
+#             the serial port, saves them as JSON and compares them with a
+#             saved baseline. Every result is a cost, so higher is worse.
+#
+#   tools/bench.py --kernel bin/kernel.bin                 run and compare
+#   tools/bench.py --kernel bin/kernel.bin --save-baseline run and keep as baseline
+#   tools/bench.py --log serial.log                        compare an old run
+#
+# The baseline may carry per-benchmark thresholds, in percent:
+#   { "results": {...}, "thresholds": { "fork": 25 } }
+# Exits 1 if anything regressed past its threshold, or if the run failed.
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+
+# Written to by the kernel, see BENCH_EXIT_PORT in bench.h. QEMU exits with
+# (value << 1) | 1, so a clean finish is 1.
+EXIT_DEVICE = "isa-debug-exit,iobase=0xf4,iosize=0x04"
+EXIT_OK = 1
+
+
+def run_qemu(args):
+    cmd = [args.qemu, "-kernel", args.kernel,
+           "-append", ("bench " + args.append).strip(),
+           "-nographic", "-monitor", "none", "-serial", "stdio",
+           "-device", EXIT_DEVICE, "-no-reboot"]
+    try:
+        proc = subprocess.run(cmd, capture_output=True, text=True,
+                              timeout=args.timeout)
+    except subprocess.TimeoutExpired as e:
+        out = e.stdout or ""
+        if isinstance(out, bytes):
+            out = out.decode(errors="replace")
+        sys.stderr.write(out)
+        sys.exit("bench: no clean exit within %d seconds" % args.timeout)
+    if proc.returncode != EXIT_OK:
+        sys.stderr.write(proc.stdout + proc.stderr)
+        sys.exit("bench: qemu exited with %d" % proc.returncode)
+    return proc.stdout
+
+
+def parse(log):
+    results = {}
+    begun = ended = False
+    for line in log.splitlines():
+        line = line.strip()
+        if line == "bench: begin":
+            begun = True
+        elif line == "bench: end":
+            ended = True
+        elif line.startswith("BENCH "):
+            parts = line.split()
+            if len(parts) != 4:
+                continue
+            results[parts[1]] = {"value": int(parts[2]), "unit": parts[3]}
+    if not begun or not ended:
+        sys.exit("bench: output incomplete, the kernel stopped part way")
+    return results
+
+
+def merge_runs(runs):
+    """The best of several boots, benchmark by benchmark."""
+    best = {}
+    for run in runs:
+        for name, r in run.items():
+            if name not in best or r["value"] < best[name]["value"]:
+                best[name] = dict(r)
+    return best
+
+
+def compare(results, baseline, default_threshold):
+    """Prints the comparison, returns the number of regressions."""
+    base = baseline.get("results", {})
+    thresholds = baseline.get("thresholds", {})
+    regressions = 0
+    print("%-28s %12s %12s %8s" % ("benchmark", "baseline", "now", "change"))
+    for name in sorted(set(results) | set(base)):
+        if name not in results:
+            print("%-28s %12d %12s %8s  MISSING" % (name, base[name]["value"], "-", ""))
+            regressions += 1
+            continue
+        now = results[name]["value"]
+        if name not in base:
+            print("%-28s %12s %12d %8s  new" % (name, "-", now, ""))
+            continue
+        was = base[name]["value"]
+        change = (now - was) * 100.0 / was if was else 0.0
+        limit = thresholds.get(name, default_threshold)
+        verdict = ""
+        if change > limit:
+            verdict = "  REGRESSION (limit %g%%)" % limit
+            regressions += 1
+        elif change < -limit:
+            verdict = "  improved"
+        print("%-28s %12d %12d %+7.1f%%%s" % (name, was, now, change, verdict))
+    return regressions
+
+
+def git_revision():
+    try:
+        return subprocess.run(["git", "rev-parse", "--short", "HEAD"],
+                              capture_output=True, text=True,
+                              check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Run the kernel benchmarks and compare them with a baseline.")
+    parser.add_argument("--kernel", default="bin/kernel.bin")
+    parser.add_argument("--qemu", default="qemu-system-x86_64")
+    parser.add_argument("--append", default="",
+                        help="more kernel arguments, e.g. sched=fair")
+    parser.add_argument("--runs", type=int, default=1,
+                        help="boots to take the best result from")
+    parser.add_argument("--timeout", type=int, default=120)
+    parser.add_argument("--log", help="parse this serial log instead of booting")
+    parser.add_argument("--out", default="bin/bench.json")
+    parser.add_argument("--baseline", default="bench/baseline.json")
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="default regression threshold, in percent")
+    parser.add_argument("--save-baseline", action="store_true")
+    args = parser.parse_args()
+
+    if args.log:
+        with open(args.log) as f:
+            results = parse(f.read())
+    else:
+        results = merge_runs([parse(run_qemu(args)) for _ in range(args.runs)])
+
+    record = {"revision": git_revision(), "kernel_args": args.append,
+              "runs": 1 if args.log else args.runs, "results": results}
+    os.makedirs(os.path.dirname(args.out) or ".", exist_ok=True)
+    with open(args.out, "w") as f:
+        json.dump(record, f, indent=2, sort_keys=True)
+
+    if args.save_baseline:
+        # Keep any thresholds already set by hand.
+        if os.path.exists(args.baseline):
+            with open(args.baseline) as f:
+                thresholds = json.load(f).get("thresholds", {})
+            if thresholds:
+                record["thresholds"] = thresholds
+        os.makedirs(os.path.dirname(args.baseline) or ".", exist_ok=True)
+        with open(args.baseline, "w") as f:
+            json.dump(record, f, indent=2, sort_keys=True)
+        print("bench: baseline saved to %s" % args.baseline)
+        return 0
+
+    if not os.path.exists(args.baseline):
+        for name in sorted(results):
+            print("%-28s %12d %s" % (name, results[name]["value"], results[name]["unit"]))
+        print("bench: no baseline at %s, save one with --save-baseline" % args.baseline)
+        return 0
+
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    regressions = compare(results, baseline, args.threshold)
+    if regressions:
+        print("bench: %d regression(s)" % regressions)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+# profile.py -- Turns the samples profile_dump() writes to the serial port
+#               into folded stacks, one "outer;...;inner count" line per
+#               distinct stack, for flamegraph.pl and friends.
+#
+#   make all > serial.log      (the serial port goes to stdout)
+#   tools/profile.py bin/kernel.bin serial.log > kernel.folded
+#   flamegraph.pl kernel.folded > kernel.svg
+
+import bisect
+import collections
+import subprocess
+import sys
+
+
+def load_symbols(kernel):
+    """Function symbols of 'kernel', sorted by address."""
+    out = subprocess.run(["nm", "-n", "--defined-only", kernel],
+                         check=True, capture_output=True, text=True).stdout
+    addrs, names = [], []
+    for line in out.splitlines():
+        parts = line.split()
+        if len(parts) == 3 and parts[1] in "tTwW":
+            addrs.append(int(parts[0], 16))
+            names.append(parts[2])
+    return addrs, names
+
+
+def symbolize(addrs, names, addr):
+    i = bisect.bisect_right(addrs, addr) - 1
+    if i < 0:
+        return "0x%x" % addr
+    return names[i]
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.exit("usage: profile.py bin/kernel.bin [serial.log]")
+    addrs, names = load_symbols(sys.argv[1])
+    log = open(sys.argv[2]) if len(sys.argv) == 3 else sys.stdin
+
+    stacks = collections.Counter()
+    for line in log:
+        parts = line.split()
+        if len(parts) < 4 or parts[0] != "P":
+            continue
+        mode = "user" if parts[2] == "u" else "kernel"
+        eip = int(parts[3], 16)
+        # Return addresses point past the call; look up the call itself.
+        frames = [symbolize(addrs, names, eip)]
+        frames += [symbolize(addrs, names, int(a, 16) - 1) for a in parts[4:]]
+        frames.append(mode)
+        stacks[";".join(reversed(frames))] += 1
+
+    for stack, count in sorted(stacks.items()):
+        print(stack, count)
+
+
+if __name__ == "__main__":
+    main()